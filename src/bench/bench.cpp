@@ -0,0 +1,197 @@
+// Headless benchmark for the emulator core. Runs a ROM at uncapped speed, with
+// no window or frame limiter, and prints the throughput as one line of JSON.
+//
+// Usage: MoonGB_bench <rom_file> [--frames N | --seconds S] [--jit | --jit-diff]
+//                     [--accurate] [--save-states]
+//
+// --jit runs hot ROM code compiled, and --jit-diff also checks it against the
+// interpreter. Both need a build with MOONGB_JIT. --accurate times each memory
+// access (CycleAccuracy), and can't be used with either. --save-states saves
+// and reloads the system after every frame, and reports how long each took.
+
+#include "../core.hpp"
+#include "../emulator/gameboy.hpp"
+#include "../program/logger.hpp"
+#include <chrono>
+#include <memory>
+#include <cstring>
+
+using std::string, fmt::format;
+
+// Escapes a string for use inside of a JSON string literal
+string escapeJSON(const string& input);
+void printUsage();
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        printUsage();
+        return 1;
+    }
+
+    string rom_file_path = argv[1];
+    uint64_t frame_limit = 3600; // One minute of emulated time
+    double second_limit = 0;
+    JITMode jit_mode = JITMode::OFF;
+    bool accurate = false;
+    bool save_states = false;
+
+    for(int i = 2; i < argc; i++)
+    {
+        if(!strcmp(argv[i], "--frames") && i + 1 < argc)
+        {
+            frame_limit = std::strtoull(argv[++i], nullptr, 10);
+            second_limit = 0;
+
+        } else if(!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+
+            second_limit = std::strtod(argv[++i], nullptr);
+            frame_limit = 0;
+
+        } else if(!strcmp(argv[i], "--jit")) {
+
+            jit_mode = JITMode::ON;
+
+        } else if(!strcmp(argv[i], "--jit-diff")) {
+
+            jit_mode = JITMode::DIFFERENTIAL;
+
+        } else if(!strcmp(argv[i], "--accurate")) {
+
+            accurate = true;
+
+        } else if(!strcmp(argv[i], "--save-states")) {
+
+            save_states = true;
+
+        } else {
+            printUsage();
+            return 1;
+        }
+    }
+
+    // Logging would dominate the run time and pollute stdout. Differential
+    // mode logs mismatches to the console.
+    Logger::initLogger("./",
+                       jit_mode == JITMode::DIFFERENTIAL ? Logger::logERROR
+                                                         : Logger::logNOTHING,
+                       jit_mode == JITMode::DIFFERENTIAL, false);
+
+    std::unique_ptr<Emulator> gb;
+    try {
+        if(accurate) { gb = std::make_unique<Gameboy<CycleAccuracy>>(rom_file_path); }
+        else { gb = std::make_unique<Gameboy<FastAccuracy>>(rom_file_path); }
+    } catch(std::exception& ex) {
+        std::cerr << format("Could not load {:s}: {:s}\n", rom_file_path, ex.what());
+        return 1;
+    }
+
+    if(!gb->setJITMode(jit_mode))
+    {
+        std::cerr << (accurate ? "The JIT can't be used with --accurate\n"
+                               : "The JIT is not available in this build\n");
+        return 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    uint64_t frames = 0;
+    double seconds = 0;
+    // Save state timings are left out of seconds
+    std::vector<uint8_t> state;
+    Clock::duration save_time{}, load_time{};
+    bool states_loaded = true;
+    Clock::time_point start = Clock::now();
+
+    while(!gb->isStopped())
+    {
+        gb->runFrame();
+        frames++;
+
+        if(save_states)
+        {
+            Clock::time_point save_start = Clock::now();
+            gb->saveState(state);
+            Clock::time_point load_start = Clock::now();
+            states_loaded &= gb->loadState(state);
+            Clock::time_point load_end = Clock::now();
+
+            save_time += load_start - save_start;
+            load_time += load_end - load_start;
+            start += load_end - save_start;
+        }
+
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if(frame_limit != 0 && frames >= frame_limit) { break; }
+        if(second_limit != 0 && seconds >= second_limit) { break; }
+    }
+
+    uint64_t instructions = gb->getInstructionCount();
+    uint64_t cycles = gb->getTotalCycles();
+    uint64_t idle_cycles = gb->getIdleCyclesSkipped();
+    uint64_t jit_mismatches = gb->getJITMismatches();
+    const char* jit_names[] = { "off", "on", "differential" };
+
+    string result = format(
+        "{{\"rom\": \"{:s}\", \"title\": \"{:s}\", \"frames\": {:d}, "
+        "\"instructions\": {:d}, \"cycles\": {:d}, \"seconds\": {:.6f}, "
+        "\"frames_per_second\": {:.2f}, \"instructions_per_second\": {:.0f}, "
+        "\"cycles_per_second\": {:.0f}, \"idle_cycles_skipped\": {:d}, "
+        "\"jit\": \"{:s}\", \"jit_mismatches\": {:d}, \"accuracy\": \"{:s}\"",
+        escapeJSON(rom_file_path), escapeJSON(gb->getGameTitle()), frames,
+        instructions, cycles, seconds,
+        frames / seconds, instructions / seconds, cycles / seconds, idle_cycles,
+        jit_names[static_cast<int>(jit_mode)], jit_mismatches,
+        accurate ? "cycle" : "fast"
+    );
+
+    if(save_states)
+    {
+        using Micros = std::chrono::duration<double, std::micro>;
+        result += format(
+            ", \"state_bytes\": {:d}, \"save_state_us\": {:.2f}, "
+            "\"load_state_us\": {:.2f}, \"states_loaded\": {}",
+            state.size(), Micros(save_time).count() / frames,
+            Micros(load_time).count() / frames, states_loaded
+        );
+    }
+    std::cout << result << "}\n";
+
+    return jit_mismatches == 0 && states_loaded ? 0 : 1;
+}
+
+
+
+// Escapes a string for use inside of a JSON string literal
+string escapeJSON(const string& input)
+{
+    string output;
+    for(char c : input)
+    {
+        switch(c)
+        {
+        case '"': output += "\\\""; break;
+        case '\\': output += "\\\\"; break;
+        default:
+        {
+            // Control characters and the title's NUL padding
+            if(static_cast<unsigned char>(c) < 0x20)
+            {
+                if(c != '\0') { output += format("\\u{:04x}", c); }
+            } else {
+                output += c;
+            }
+        }
+        }
+    }
+    return output;
+}
+
+
+
+void printUsage()
+{
+    std::cerr << "Usage: MoonGB_bench <rom_file> [--frames N | --seconds S] "
+                 "[--jit | --jit-diff]\n"
+                 "                    [--accurate] [--save-states]\n";
+}
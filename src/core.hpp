@@ -12,13 +12,3 @@
 
 #define FMT_HEADER_ONLY
 #include <fmt/core.h>
-
-#ifdef _WIN32
-#include <windows.h>
-#include <shobjidl.h>
-#include <tchar.h>
-#include <codecvt>
-
-#elif __linux__
-#include <gtk/gtk.h>
-#endif
@@ -0,0 +1,32 @@
+// Accuracy policies for the emulator core. Gameboy, the CPU, and the block
+// cache are templated on one, and are built for both.
+#pragma once
+
+#include "../core.hpp"
+
+// Instruction-granular timing. The clock moves once per instruction, so every
+// memory access sees the cycle the instruction started on. Fastest, and the
+// only mode that can run compiled code.
+struct FastAccuracy
+{
+    static constexpr bool TIMED_ACCESSES = false;
+};
+
+// M-cycle bus timing. Each memory access takes its own M-cycle, and the rest
+// of the system is brought up to the end of it before the access is made.
+// Registers like LY, STAT, and DIV then read what they would on hardware.
+struct CycleAccuracy
+{
+    static constexpr bool TIMED_ACCESSES = true;
+};
+
+// Lets the CPU bring the rest of the system up to a timed memory access
+class BusClock
+{
+public:
+    virtual ~BusClock() = default;
+
+    // Advances the clock to cycles into the current instruction, firing any
+    // events that are due
+    virtual void catchUp(int cycles) = 0;
+};
@@ -0,0 +1,193 @@
+// 8-bit arithmetic shared by the CPU's opcode handlers. Each operation takes
+// its operands and the packed F register, and returns the result and the new
+// F. Flags come from lookup tables built at compile time, so an operation is
+// its arithmetic plus one or two table loads.
+#pragma once
+
+#include "../core.hpp"
+#include "gbdefs.hpp"
+
+namespace ALU
+{
+    struct Result
+    {
+        uint8_t value;
+        uint8_t f;
+    };
+
+    // Tables //
+
+    // Index into ADD_FLAGS/SUB_FLAGS. The low 9 bits are the result with its
+    // carry/borrow out of bit 7. Bit 9 is the carry/borrow out of bit 3, which
+    // is bit 4 of a ^ value ^ result for both addition and subtraction.
+    constexpr size_t carryIndex(unsigned a, unsigned value, unsigned result)
+    {
+        return (result & 0x1FF) | (((a ^ value ^ result) & 0x10) << 5);
+    }
+
+    // Flags for each carryIndex of an ADD/ADC, or a SUB/SBC/CP
+    template<bool SUBTRACT>
+    constexpr std::array<uint8_t, 1024> makeCarryFlags()
+    {
+        std::array<uint8_t, 1024> table{};
+        for(size_t i = 0; i < table.size(); i++)
+        {
+            table[i] = packFlags((i & 0xFF) == 0, SUBTRACT, i & 0x200, i & 0x100);
+        }
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 1024> ADD_FLAGS = makeCarryFlags<false>();
+    inline constexpr std::array<uint8_t, 1024> SUB_FLAGS = makeCarryFlags<true>();
+
+    // Zero flag for each result
+    inline constexpr std::array<uint8_t, 256> ZERO_FLAGS = []
+    {
+        std::array<uint8_t, 256> table{};
+        for(size_t i = 0; i < table.size(); i++) { table[i] = (i == 0) ? FLAG_ZERO : 0; }
+        return table;
+    }();
+
+    // Flags for each result of INC and DEC, without carry
+    inline constexpr std::array<uint8_t, 256> INC_FLAGS = []
+    {
+        std::array<uint8_t, 256> table{};
+        for(size_t i = 0; i < table.size(); i++)
+        {
+            table[i] = packFlags(i == 0, false, (i & 0xF) == 0, false);
+        }
+        return table;
+    }();
+
+    inline constexpr std::array<uint8_t, 256> DEC_FLAGS = []
+    {
+        std::array<uint8_t, 256> table{};
+        for(size_t i = 0; i < table.size(); i++)
+        {
+            table[i] = packFlags(i == 0, true, (i & 0xF) == 0xF, false);
+        }
+        return table;
+    }();
+
+    // Result of DAA in the low byte and F in the high byte, indexed by A and
+    // the subtract, half carry, and carry flags (A | F >> 4 << 8).
+    inline constexpr std::array<uint16_t, 2048> DAA_TABLE = []
+    {
+        std::array<uint16_t, 2048> table{};
+        for(size_t i = 0; i < table.size(); i++)
+        {
+            uint8_t a = i & 0xFF;
+            bool subtract = i & 0x400;
+            bool half_carry = i & 0x200;
+            bool carry = i & 0x100;
+
+            // Taken from user AWJ @ https://forums.nesdev.org/viewtopic.php?t=15944
+            if(!subtract)
+            {  // after an addition, adjust if (half-)carry occurred or if result is out of bounds
+                if(carry || a > 0x99) { a += 0x60; carry = true; }
+                if(half_carry || (a & 0x0f) > 0x09) { a += 0x6; }
+            } else
+            {  // after a subtraction, only adjust if (half-)carry occurred
+                if(carry) { a -= 0x60; }
+                if(half_carry) { a -= 0x6; }
+            }
+
+            // the usual z flag, h flag is always cleared, n is unchanged
+            table[i] = a | (packFlags(a == 0, subtract, false, carry) << 8);
+        }
+        return table;
+    }();
+
+    // End Tables //
+
+
+
+    // Operations //
+
+    // 8-bit ALU operation on a. 0-7 are ADD ADC SUB SBC AND XOR OR CP.
+    // CP returns a unchanged.
+    template<uint8_t OPER>
+    constexpr Result operate(uint8_t a, uint8_t value, uint8_t f)
+    {
+        if constexpr(OPER == 0 || OPER == 1) // ADD, ADC
+        {
+            unsigned carry = (OPER == 1) ? (f & FLAG_CARRY) >> 4 : 0;
+            unsigned sum = a + value + carry;
+            return { static_cast<uint8_t>(sum), ADD_FLAGS[carryIndex(a, value, sum)] };
+
+        } else if constexpr(OPER == 2 || OPER == 3 || OPER == 7) { // SUB, SBC, CP
+
+            // A borrow wraps the difference, setting bit 8
+            unsigned carry = (OPER == 3) ? (f & FLAG_CARRY) >> 4 : 0;
+            unsigned dif = a - value - carry;
+            uint8_t flags = SUB_FLAGS[carryIndex(a, value, dif)];
+
+            // CP does not store the result
+            return { (OPER == 7) ? a : static_cast<uint8_t>(dif), flags };
+
+        } else if constexpr(OPER == 4) { // AND
+
+            uint8_t result = a & value;
+            return { result, static_cast<uint8_t>(ZERO_FLAGS[result] | FLAG_HALF_CARRY) };
+
+        } else { // XOR, OR
+
+            uint8_t result = (OPER == 5) ? (a ^ value) : (a | value);
+            return { result, ZERO_FLAGS[result] };
+        }
+    }
+
+    // Rotate/shift. 0-7 are RLC RRC RL RR SLA SRA SWAP SRL
+    template<uint8_t OPER>
+    constexpr Result rotate(uint8_t value, uint8_t f)
+    {
+        uint8_t old_msb = value >> 7;
+        uint8_t old_lsb = value & 1;
+        uint8_t old_carry = (f & FLAG_CARRY) >> 4;
+        uint8_t result;
+        uint8_t carry; // Bit 0 is the new carry
+
+        if constexpr(OPER == 0) { result = (value << 1) | old_msb; carry = old_msb; }
+        else if constexpr(OPER == 1) { result = (value >> 1) | (old_lsb << 7); carry = old_lsb; }
+        else if constexpr(OPER == 2) { result = (value << 1) | old_carry; carry = old_msb; }
+        else if constexpr(OPER == 3) { result = (value >> 1) | (old_carry << 7); carry = old_lsb; }
+        else if constexpr(OPER == 4) { result = value << 1; carry = old_msb; }
+        else if constexpr(OPER == 5) { result = (value >> 1) | (value & 0x80); carry = old_lsb; }
+        else if constexpr(OPER == 6) { result = (value >> 4) | (value << 4); carry = 0; }
+        else { result = value >> 1; carry = old_lsb; }
+
+        return { result, static_cast<uint8_t>(ZERO_FLAGS[result] | (carry << 4)) };
+    }
+
+    // INC r. Carry is unchanged
+    constexpr Result inc(uint8_t value, uint8_t f)
+    {
+        uint8_t sum = value + 1;
+        return { sum, static_cast<uint8_t>(INC_FLAGS[sum] | (f & FLAG_CARRY)) };
+    }
+
+    // DEC r. Carry is unchanged
+    constexpr Result dec(uint8_t value, uint8_t f)
+    {
+        uint8_t dif = value - 1;
+        return { dif, static_cast<uint8_t>(DEC_FLAGS[dif] | (f & FLAG_CARRY)) };
+    }
+
+    // DAA. Subtract is unchanged
+    constexpr Result daa(uint8_t a, uint8_t f)
+    {
+        uint16_t entry = DAA_TABLE[a | ((f >> 4) & 0b111) << 8];
+        return { static_cast<uint8_t>(entry), static_cast<uint8_t>(entry >> 8) };
+    }
+
+    // Flags for LD HL,SP+n and ADD SP,n. They are set from the unsigned
+    // addition of the low byte, zero and subtract are always reset.
+    constexpr uint8_t addSPFlags(uint16_t sp, uint8_t offset)
+    {
+        unsigned low = sp & 0xFF;
+        return ADD_FLAGS[carryIndex(low, offset, low + offset)]
+             & (FLAG_HALF_CARRY | FLAG_CARRY);
+    }
+
+    // End Operations //
+}
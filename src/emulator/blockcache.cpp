@@ -0,0 +1,121 @@
+#include "blockcache.hpp"
+
+template<typename Accuracy> BlockCache<Accuracy>::BlockCache() = default;
+template<typename Accuracy> BlockCache<Accuracy>::~BlockCache() = default;
+
+
+
+// Returns true for regions that can hold cached code: ROM, WRAM, and HRAM.
+// VRAM, ERAM, OAM, and ECHO RAM are always decoded from memory.
+template<typename Accuracy>
+bool BlockCache<Accuracy>::isCacheable(uint16_t address)
+{
+    return address <= 0x7FFF
+        || (address >= 0xC000 && address <= 0xDFFF)
+        || (address >= 0xFF80 && address <= 0xFFFE);
+}
+
+// Returns true if the region holding address can be written to
+template<typename Accuracy>
+bool BlockCache<Accuracy>::isWritable(uint16_t address)
+{
+    return address >= 0x8000;
+}
+
+// First address past the cacheable region that holds address
+template<typename Accuracy>
+uint32_t BlockCache<Accuracy>::regionEnd(uint16_t address)
+{
+    if(address <= 0x3FFF) { return 0x4000; }
+    if(address <= 0x7FFF) { return 0x8000; }
+    if(address <= 0xCFFF) { return 0xD000; }
+    if(address <= 0xDFFF) { return 0xE000; }
+    return 0xFFFF;
+}
+
+
+
+// Finds the block for key, or nullptr
+template<typename Accuracy>
+const Block<Accuracy>* BlockCache<Accuracy>::find(uint32_t key)
+{
+    const Block<Accuracy>*& slot = recent[key % RECENT_SIZE];
+    if(slot && slot->key == key) { return slot; }
+
+    auto it = blocks.find(key);
+    if(it == blocks.end()) { return nullptr; }
+
+    slot = &it->second;
+    return slot;
+}
+
+
+// Adds a block, and returns where it is stored
+template<typename Accuracy>
+const Block<Accuracy>* BlockCache<Accuracy>::insert(Block<Accuracy> block)
+{
+    uint32_t key = block.key;
+    erase(key);
+
+    if(isWritable(key & 0xFFFF))
+    {
+        for(int page = block.first_page; page <= block.last_page; page++)
+        {
+            page_blocks[page].push_back(key);
+        }
+    }
+
+    const Block<Accuracy>* stored = &blocks.emplace(key, std::move(block)).first->second;
+    recent[key % RECENT_SIZE] = stored;
+    return stored;
+}
+
+
+// Drops every block with bytes on page
+template<typename Accuracy>
+void BlockCache<Accuracy>::invalidatePage(uint8_t page)
+{
+    // Erasing a block spanning two pages also edits the other page's list, so
+    // take this page's list first
+    std::vector<uint32_t> keys;
+    keys.swap(page_blocks[page]);
+
+    for(uint32_t key : keys) { erase(key); }
+}
+
+
+// Drops every block
+template<typename Accuracy>
+void BlockCache<Accuracy>::clear()
+{
+    blocks.clear();
+    for(auto& keys : page_blocks) { keys.clear(); }
+    recent.fill(nullptr);
+}
+
+
+
+// Drops a block, and any references to it
+template<typename Accuracy>
+void BlockCache<Accuracy>::erase(uint32_t key)
+{
+    auto it = blocks.find(key);
+    if(it == blocks.end()) { return; }
+
+    const Block<Accuracy>& block = it->second;
+    if(isWritable(key & 0xFFFF))
+    {
+        for(int page = block.first_page; page <= block.last_page; page++)
+        {
+            std::erase(page_blocks[page], key);
+        }
+    }
+
+    const Block<Accuracy>*& slot = recent[key % RECENT_SIZE];
+    if(slot == &block) { slot = nullptr; }
+
+    blocks.erase(it);
+}
+
+template class BlockCache<FastAccuracy>;
+template class BlockCache<CycleAccuracy>;
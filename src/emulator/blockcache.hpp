@@ -0,0 +1,77 @@
+// Cache of decoded instructions, in straight-line blocks keyed by bank and
+// address. Code in ROM never changes for a given bank. Blocks in WRAM and
+// HRAM are dropped when their pages are written.
+#pragma once
+
+#include "../core.hpp"
+#include "gbdefs.hpp"
+#include "accuracy.hpp"
+#include <unordered_map>
+
+template<typename Accuracy> class CPU;
+class Memory;
+
+// Opcode handlers return the number of cycles used after the opcode fetch
+template<typename Accuracy>
+using OpHandler = int (*)(CPU<Accuracy>& cpu, Memory& mem, const Instruction& ins);
+
+// An instruction with its operands read and its handler looked up
+template<typename Accuracy>
+struct CachedOp
+{
+    OpHandler<Accuracy> handler;
+    Instruction ins;
+};
+
+template<typename Accuracy>
+struct Block
+{
+    uint32_t key;
+    uint8_t first_page, last_page; // Pages the block's bytes are on
+    std::vector<CachedOp<Accuracy>> ops;
+};
+
+// Holds the blocks for one CPU, whose handlers depend on its accuracy policy
+template<typename Accuracy>
+class BlockCache
+{
+public:
+    BlockCache();
+    ~BlockCache();
+
+    // Most instructions in a block. Blocks also end at unconditional jumps,
+    // calls, returns, HALT, and STOP.
+    static constexpr size_t MAX_BLOCK_OPS = 32;
+
+    // Combines the bank mapped at address with the address
+    static uint32_t makeKey(uint16_t bank, uint16_t address) { return (bank << 16) | address; }
+    // Returns true for regions that can hold cached code: ROM, WRAM, and HRAM.
+    // VRAM, ERAM, OAM, and ECHO RAM are always decoded from memory.
+    static bool isCacheable(uint16_t address);
+    // Returns true if the region holding address can be written to
+    static bool isWritable(uint16_t address);
+    // First address past the cacheable region that holds address
+    static uint32_t regionEnd(uint16_t address);
+
+    // Finds the block for key, or nullptr
+    const Block<Accuracy>* find(uint32_t key);
+    // Adds a block, and returns where it is stored
+    const Block<Accuracy>* insert(Block<Accuracy> block);
+    // Drops every block with bytes on page
+    void invalidatePage(uint8_t page);
+    // Drops every block
+    void clear();
+
+private:
+    std::unordered_map<uint32_t, Block<Accuracy>> blocks;
+    // Keys of the blocks with bytes on each writable page
+    std::array<std::vector<uint32_t>, 256> page_blocks;
+
+    // Recently found blocks, indexed by the low bits of the address. Saves a
+    // hash lookup for most jumps in hot loops.
+    static constexpr size_t RECENT_SIZE = 1024;
+    std::array<const Block<Accuracy>*, RECENT_SIZE> recent{};
+
+    // Drops a block, and any references to it
+    void erase(uint32_t key);
+};
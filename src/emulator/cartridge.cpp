@@ -1,15 +1,13 @@
 #include "cartridge.hpp"
 #include <filesystem>
 #include <exception>
+#include <fstream>
 
 using Logger::log, std::string, fmt::format;
 
 Cartridge::Cartridge() = default;
 
-Cartridge::~Cartridge()
-{
-    if(RomFile.is_open()) { RomFile.close(); }
-}
+Cartridge::~Cartridge() = default;
 
 // Initializes the file(s), performs checks, and gets the game title,
 // memory bank controller, and size of the ROM from the header.
@@ -30,11 +28,23 @@ void Cartridge::initCartridge(const string& _rom_file_path)
         throw std::invalid_argument("File is not a .gb or .gbc ROM!");
     }
 
-    RomFile.open(_rom_file_path, std::ios_base::in | std::ios_base::binary);
-
-    if(!RomFile)
+    // Map the ROM, only the pages that are used get read from disk
+    if(rom_mapping.open(_rom_file_path, 0, false))
     {
-        throw std::runtime_error("Could not open file!");
+        rom_data = rom_mapping.data();
+        rom_size = rom_mapping.size();
+    } else {
+        std::ifstream file(_rom_file_path, std::ios_base::in | std::ios_base::binary);
+
+        if(!file)
+        {
+            throw std::runtime_error("Could not open file!");
+        }
+
+        rom_buffer.resize(file_size(_rom_file_path));
+        file.read((char*)(rom_buffer.data()), rom_buffer.size());
+        rom_data = rom_buffer.data();
+        rom_size = rom_buffer.size();
     }
 
     rom_file_path = _rom_file_path;
@@ -43,19 +53,14 @@ void Cartridge::initCartridge(const string& _rom_file_path)
 
     // Read the ROM's header into a byte array
     std::array<uint8_t, 80> header{}; // Header is 80 bytes between $100-$14F
-    try {
-        RomFile.seekg(0x100);
-        RomFile.read((char*)(header.data()), 80);
-        RomFile.seekg(0); // Reset position
-
-    } catch(std::exception& ex) {
+    if(rom_size < 0x150)
+    {
         Logger::log("CART: Could not read ROM Header.",
                     Logger::logDEBUG);
-        Logger::log(ex.what(), Logger::logDEBUG);
 
-        // Rethrow with more descriptive message
         throw std::runtime_error("ROM is corrupt: Could not read ROM Header.");
     }
+    std::copy(rom_data + 0x100, rom_data + 0x150, header.begin());
 
     // Check the validity of the ROM's header
     if(!checkHeader(header))
@@ -64,6 +69,8 @@ void Cartridge::initCartridge(const string& _rom_file_path)
     }
 
     game_title = parseGameTitle(header);
+    // Global checksum at $014E, big-endian
+    checksum = (header.at(0x4E) << 8) | header.at(0x4F);
 
     // MBC Identifier at address $0147
     mbc = static_cast<BankController>(header.at(0x47));
@@ -120,59 +127,46 @@ void Cartridge::initCartridge(const string& _rom_file_path)
         }
     }
 
+    // Pad short ROMs, so every bank in the header can be read
+    size_t target_size = rom_bank_amount * 0x4000;
+    if(rom_size < target_size)
+    {
+        log(fmt::format("CART: ROM is smaller than its header says. "
+                        "Expected {:d} bytes, got {:d}. Padding with $FF.",
+                        target_size, rom_size),
+            Logger::logDEBUG);
+
+        rom_buffer.assign(rom_data, rom_data + rom_size);
+        rom_buffer.resize(target_size, 0xFF);
+        rom_mapping.close();
+
+        rom_data = rom_buffer.data();
+        rom_size = rom_buffer.size();
+    }
+
     // Now ready to call loadCartridge to load the game
 }
 
 
 
-// Loads the initialized cartridge into the specified memory object.
-void Cartridge::loadCartridge(Memory& mem)
+// Loads the initialized cartridge into the specified memory object. A
+// read-only save is loaded, but never written back.
+void Cartridge::loadCartridge(Memory& mem, bool read_only_save)
 {
     // Send save info to memory
-    mem.setERAM(rom_bank_amount,
+    mem.setERAM(ram_bank_amount,
                 persistent_memory,
                 sav_file_path,
-                mbc
+                read_only_save
     );
 
 
-    // Begin loading ROM into memory
-    try {
-        std::array<uint8_t, 0x4000> static_rom{};
-        RomFile.seekg(0);
-        RomFile.read((char*)(static_rom.data()), static_rom.size());
-
-        mem.loadROM0(static_rom);
-
-    } catch(std::exception& ex) {
+    // Memory reads the banks straight out of the ROM image
+    mem.loadROM(rom_data, rom_bank_amount);
 
-        throw std::runtime_error("ROM is corrupt: Could not read static ROM");
-    }
-
-    // Load ROM banks into memory
-    std::vector<MemoryBank> rom_banks{};
-    rom_banks.reserve(rom_bank_amount);
-    // Iterate through every bank, reading 16kb chunks into memory
-    // Subtract 1 because Static ROM (bank 1) is already loaded
-    for(int i = 0; i < rom_bank_amount - 1; i++)
-    {
-        try {
-            MemoryBank bank{};
-            bank.data.resize(0x4000);
-            RomFile.read((char*)(bank.data.data()), 0x4000);
-            rom_banks.push_back(bank);
-
-        } catch(std::exception& ex) {
-            throw std::runtime_error(
-                    "ROM is corrupt: Could not read all ROM banks.");
-        }
-    }
-
-    // Send banks to MMU
-    mem.loadROM1(rom_banks, rom_bank_amount);
-
-    // RomFile is no longer needed.
-    RomFile.close();
+    // The controller maps its power-on banks into memory
+    controller = makeMBCController(mbc, mem, rom_bank_amount, ram_bank_amount);
+    mem.setMBC(controller.get());
 }
 
 
@@ -180,6 +174,20 @@ void Cartridge::loadCartridge(Memory& mem)
 string Cartridge::getROMFilePath() { return rom_file_path; }
 string Cartridge::getSAVFilePath() { return sav_file_path; }
 string Cartridge::getGameTitle() { return game_title; }
+uint16_t Cartridge::getChecksum() const { return checksum; }
+
+
+
+// Copies the bank controller's registers in and out of a save state
+void Cartridge::saveState(StateWriter& writer) const
+{
+    if(controller) { controller->saveState(writer); }
+}
+
+void Cartridge::loadState(StateReader& reader)
+{
+    if(controller) { controller->loadState(reader); }
+}
 
 
 
@@ -234,5 +242,6 @@ void Cartridge::dumpCartridge()
                mbcToString(mbc), rom_bank_amount, ram_bank_amount, persistent_memory),
         Logger::logDEBUG
     );
+    if(controller) { controller->dumpMBC(); }
     log("--END CART DUMP--", Logger::logDEBUG);
 }
\ No newline at end of file
@@ -3,7 +3,8 @@
 #include "../core.hpp"
 #include "gbdefs.hpp"
 #include "memory.hpp"
-#include <fstream>
+#include "mbc.hpp"
+#include "../utility/mappedfile.hpp"
 
 class Memory;
 
@@ -17,13 +18,21 @@ public:
     // memory bank controller, and size of the ROM from the header.
     void initCartridge(const std::string& _rom_file_path);
 
-    // Loads the initialized cartridge into the specified memory object.
-    void loadCartridge(Memory& mem);
+    // Loads the initialized cartridge into the specified memory object. A
+    // read-only save is loaded, but never written back.
+    void loadCartridge(Memory& mem, bool read_only_save);
 
 
     std::string getROMFilePath();
     std::string getSAVFilePath();
     std::string getGameTitle();
+    // Gets the global checksum from the header, which save states are
+    // matched against
+    uint16_t getChecksum() const;
+
+    // Copies the bank controller's registers in and out of a save state
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
 
     // Writes cartridge information to the log
     void dumpCartridge();
@@ -31,11 +40,22 @@ public:
 private:
     std::string rom_file_path{};
     std::string sav_file_path{};
-    std::ifstream RomFile;
+
+    // The ROM image is mapped read-only from the file. If mapping fails, or
+    // the file is shorter than the header says, it is read into rom_buffer.
+    // Memory reads straight from rom_data, so it must outlive the Memory.
+    MappedFile rom_mapping;
+    std::vector<uint8_t> rom_buffer;
+    const uint8_t* rom_data = nullptr;
+    size_t rom_size = 0;
 
     std::string game_title{};
+    uint16_t checksum = 0;
 
     BankController mbc;
+    // Made by loadCartridge(). Memory sends writes to ROM to it, so it must
+    // outlive the Memory's use.
+    std::unique_ptr<MBCController> controller;
     uint16_t rom_bank_amount;
     uint16_t ram_bank_amount;
     bool persistent_memory;
@@ -1,14 +1,29 @@
 #include "cpu.hpp"
+#include "alu.hpp"
+#include <algorithm>
+#include <bit>
 
 using std::string, fmt::format, Logger::log;
 
-CPU::CPU() = default;
+template<typename Accuracy>
+CPU<Accuracy>::CPU(InterruptController& _interrupts) : interrupts(_interrupts) {}
 
-CPU::~CPU() = default;
+template<typename Accuracy>
+CPU<Accuracy>::~CPU() = default;
+
+
+// Sets what timed memory accesses bring up to date. Must be set before
+// executing with CycleAccuracy.
+template<typename Accuracy>
+void CPU<Accuracy>::setBusClock(BusClock* clock)
+{
+    bus_clock = clock;
+}
 
 
 // Initializes the CPU registers, using memory to fake the post-BIOS state
-void CPU::initCPU(Memory& mem)
+template<typename Accuracy>
+void CPU<Accuracy>::initCPU(Memory& mem)
 {
     uint8_t old_license = mem.readByte(0x14B);
     uint16_t new_license = mem.readByte(0x144);
@@ -48,8 +63,6 @@ void CPU::initCPU(Memory& mem)
     regs.pc = 0x0100;
     regs.sp = 0xFFFE;
 
-    flags.zero = true;
-
     // Set up memory-mapped registers
     // https://gbdev.io/pandocs/Power_Up_Sequence.html @ Hardware registers
     // THE MONOLITH
@@ -86,2088 +99,1379 @@ void CPU::initCPU(Memory& mem)
 }
 
 
-// Pulls the instruction from the program counter, and executes it.
-// Returns the number of cycles used.
-int CPU::execute(Memory& mem)
+// Instruction lengths in bytes, indexed by opcode
+static constexpr std::array<uint8_t, 256> OPCODE_LENGTHS = [] {
+    std::array<uint8_t, 256> table{};
+    for(int i = 0; i < 256; i++) { table[i] = OPCODE_INFO[i].length; }
+    return table;
+}();
+
+// Reads the instruction at address, along with its operand bytes
+template<typename Accuracy>
+Instruction CPU<Accuracy>::decode(Memory& mem, uint16_t address)
 {
-    int cycles = 0;
-    uint8_t opcode = mem.readByte(regs.pc);
-    log(format("CPU: Executing 0x{:02X} from ${:04X}.",
-               opcode, regs.pc),
-        Logger::logEXTREME
-    );
+    Instruction ins;
+    ins.origin = address;
+    ins.immediate = 0;
 
-    Instruction ins{};
-    ins.opcode = opcode;
-    ins.origin = regs.pc;
+    // Read straight from the page when the whole instruction is on it
+    const uint8_t* page = mem.getReadPage(address >> 8);
+    uint8_t offset = address & 0xFF;
+    if(page)
+    {
+        ins.opcode = page[offset];
+        ins.length = OPCODE_LENGTHS[ins.opcode];
 
-    regs.pc++;
-    flags.byteToFlags(regs.f);
+        if(offset + ins.length <= 0x100)
+        {
+            if(ins.length > 1) { ins.immediate = page[offset + 1]; }
+            if(ins.length > 2) { ins.immediate |= page[offset + 2] << 8; }
+            return ins;
+        }
+    }
 
-    bool done = false;
+    // Unmapped pages, and instructions that run onto the next page
+    ins.opcode = mem.readByte(address);
+    ins.length = OPCODE_LENGTHS[ins.opcode];
 
-    // Algorithmic Checks //
+    if(ins.length > 1) { ins.immediate = mem.readByte(address + 1); }
+    if(ins.length > 2) { ins.immediate |= mem.readByte(address + 2) << 8; }
 
-    // LD r1,r2 - Load Register 2 into Register 1
-    // Opcode 0x76 lies in this range and is a HALT instruction
-    if (opcode >= 0b01000000 && opcode <= 0b01111111 && opcode != 0x76)
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = toTarget((opcode & 0b00111000) >> 3);
-        ins.target2 = toTarget(opcode & 0b00000111);
+    return ins;
+}
 
-        if (ins.target1 != HL && ins.target2 != HL)
-        {
-            // Move the value of target2 into target1
-            uint8_t value = getByteReg(ins.target2);
-            setByteReg(ins.target1, value);
+// Dispatches a pending interrupt if IME is set, otherwise pulls the
+// instruction from the program counter and executes it. Returns the
+// number of cycles used, or 0 if the CPU is halted and no interrupt is
+// pending. Time can then skip to the next event.
+template<typename Accuracy>
+int CPU<Accuracy>::execute(Memory& mem)
+{
+    // HALT ends when an interrupt is both requested and enabled, even if
+    // interrupts are disabled. Until then, there is nothing to execute.
+    if(halted)
+    {
+        if(!interrupts.pending()) { return 0; }
+        halted = false;
+    }
 
-        } else if (ins.target1 == HL) { // HL is an address
+    if(interrupts_enabled && interrupts.pending()) { return dispatchInterrupt(mem); }
 
-            // Write to address $HL, value in t2
-            ins.t1_as_address = true;
+    // EI takes effect after the instruction that follows it
+    interrupts_enabled = next_interrupt_state;
 
-            uint8_t value = getByteReg(ins.target2);
-            mem.writeByte(getShortReg(HL), value);
-            cycles += 4;
+    // Follow the current block while PC stays on it, otherwise find the next
+    const CachedOp<Accuracy>* op;
+    if(block_next != block_end && block_next->ins.origin == regs.pc) { op = block_next++; }
+    else { op = enterBlock(mem); }
 
-        } else if(ins.target2 == HL) { // HL is an address
+    // The block can be dropped while its instruction runs, so work from copies
+    Instruction ins = op ? op->ins : decode(mem, regs.pc);
+    OpHandler<Accuracy> handler = op ? op->handler : op_table[ins.opcode];
+    TRACE_LOG("CPU: Executing 0x{:02X} from ${:04X}.", ins.opcode, ins.origin);
 
-            // Read to t1, value at address $HL
-            ins.t2_as_address = true;
+    regs.pc += ins.length;
 
-            uint8_t value = mem.readByte(getShortReg(HL));
-            setByteReg(ins.target1, value);
-            cycles += 4;
+    // Timed accesses follow the fetch
+    if constexpr(Accuracy::TIMED_ACCESSES) { access_cycles = 4 * ins.length; }
 
-        }
+    // Each fetched byte takes 4 cycles, the handler returns the rest
+    int cycles = 4 * ins.length + handler(*this, mem, ins);
 
-        done = true;
+    TRACE_LOG("CPU: Executed {:s}", insToString(ins));
+    TRACE_LOG("CPU: New state: {:s}", regsToString(regs));
+    if constexpr(TRACE_ENABLED) { trace.record({ins, regs}); }
 
-    } // END LD r1,r2
+    lastInstruction = ins;
 
-    // ADD A,r - Add register 'r' into A
-    if(!done && opcode >= 0b10000000 && opcode <= 0b10000111)
+    loop_cycles += cycles;
+    if(backward_branch)
     {
-        ins.mnemonic = "ADD";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
-
-        uint8_t value = 0;
-        uint8_t sum = regs.a;
+        backward_branch = false;
+        checkIdleLoop(mem, ins);
+    }
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+    return cycles;
+}
 
-        } else if(ins.target2 == HL) { // HL is an address
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
+// Pushes PC and jumps to the vector of the highest priority pending
+// interrupt. Returns the number of cycles used.
+template<typename Accuracy>
+int CPU<Accuracy>::dispatchInterrupt(Memory& mem)
+{
+    // The lowest bit has the highest priority. Vectors are $40, $48, ... $60.
+    uint8_t bit = std::countr_zero(interrupts.pending());
+    interrupts.acknowledge(bit);
+    interrupts_enabled = false;
+    next_interrupt_state = false;
+    TRACE_LOG("CPU: Dispatching interrupt {:d} from ${:04X}.", bit, regs.pc);
+
+    // Two wait cycles, the push, then the jump
+    if constexpr(Accuracy::TIMED_ACCESSES) { access_cycles = 0; }
+    busIdle();
+    busIdle();
+    int cycles = 12;
+    pushShort(mem, regs.pc, cycles);
+    regs.pc = 0x40 + bit * 8;
+
+    // The handler runs in the middle of any loop being tracked
+    resetIdleLoop();
 
-        }
+    return cycles;
+}
 
-        sum += value;
-        regs.a = sum;
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = Util::checkHCAdd(regs.a, value);
-        flags.carry = Util::checkOFAdd(regs.a, value);
 
-        done = true;
+// Dispatch Tables //
 
-    } // END ADD A,r
+template<typename Accuracy>
+template<size_t... OPS>
+constexpr std::array<OpHandler<Accuracy>, 256> CPU<Accuracy>::makeOpTable(std::index_sequence<OPS...>)
+{
+    return {{
+        [](CPU<Accuracy>& cpu, Memory& mem, const Instruction& ins) {
+            return cpu.decodeOp<OPS>(mem, ins);
+        }...
+    }};
+}
 
-    // ADC A,r - Add register 'r' + carry flag into A
-    if(!done && opcode >= 0b10001000 && opcode <= 0b10001111)
-    {
-        ins.mnemonic = "ADC";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+template<typename Accuracy>
+template<size_t... OPS>
+constexpr std::array<OpHandler<Accuracy>, 256> CPU<Accuracy>::makeCBTable(std::index_sequence<OPS...>)
+{
+    return {{
+        [](CPU<Accuracy>& cpu, Memory& mem, const Instruction& ins) {
+            return cpu.decodeCB<OPS>(mem, ins);
+        }...
+    }};
+}
 
-        uint8_t value = 0;
-        uint8_t sum = regs.a;
+template<typename Accuracy>
+const std::array<OpHandler<Accuracy>, 256> CPU<Accuracy>::op_table =
+    makeOpTable(std::make_index_sequence<256>{});
+template<typename Accuracy>
+const std::array<OpHandler<Accuracy>, 256> CPU<Accuracy>::cb_table =
+    makeCBTable(std::make_index_sequence<256>{});
+
+// Opcodes are split into the fields xxyyyzzz, and yyy is split into ppq.
+// See https://gbdev.io/gb-opcodes/optables/ for the full layout.
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::decodeOp(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t x = OP >> 6;
+    constexpr uint8_t y = (OP >> 3) & 0b111;
+    constexpr uint8_t z = OP & 0b111;
+    constexpr uint8_t q = y & 0b1;
+
+    // Block 0
+    if constexpr(OP == 0x00) { return opNOP(mem, ins); }
+    else if constexpr(OP == 0x08) { return opLDnnSP(mem, ins); }
+    else if constexpr(OP == 0x10) { return opSTOP(mem, ins); }
+    else if constexpr(x == 0 && z == 0) { return opJR<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 1 && q == 0) { return opLDrrnn<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 1 && q == 1) { return opADDHLrr<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 2 && q == 0) { return opLDindA<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 2 && q == 1) { return opLDAind<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 3 && q == 0) { return opINCrr<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 3 && q == 1) { return opDECrr<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 4) { return opINCr<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 5) { return opDECr<OP>(mem, ins); }
+    else if constexpr(x == 0 && z == 6) { return opLDrn<OP>(mem, ins); }
+    else if constexpr(x == 0 && y <= 3) { return opRotA<OP>(mem, ins); }
+    else if constexpr(OP == 0x27) { return opDAA(mem, ins); }
+    else if constexpr(OP == 0x2F) { return opCPL(mem, ins); }
+    else if constexpr(OP == 0x37) { return opSCF(mem, ins); }
+    else if constexpr(OP == 0x3F) { return opCCF(mem, ins); }
+
+    // Block 1. Opcode 0x76 lies in the LD r1,r2 range and is a HALT instruction
+    else if constexpr(OP == 0x76) { return opHALT(mem, ins); }
+    else if constexpr(x == 1) { return opLDrr<OP>(mem, ins); }
+
+    // Block 2
+    else if constexpr(x == 2) { return opALUr<OP>(mem, ins); }
+
+    // Block 3
+    else if constexpr(OP == 0xC9) { return opRET(mem, ins); }
+    else if constexpr(OP == 0xD9) { return opRETI(mem, ins); }
+    else if constexpr(z == 0 && y <= 3) { return opRETcc<OP>(mem, ins); }
+    else if constexpr(OP == 0xE0) { return opLDHnA(mem, ins); }
+    else if constexpr(OP == 0xE8) { return opADDSPe(mem, ins); }
+    else if constexpr(OP == 0xF0) { return opLDHAn(mem, ins); }
+    else if constexpr(OP == 0xF8) { return opLDHLSPe(mem, ins); }
+    else if constexpr(z == 1 && q == 0) { return opPOP<OP>(mem, ins); }
+    else if constexpr(OP == 0xE9) { return opJPHL(mem, ins); }
+    else if constexpr(OP == 0xF9) { return opLDSPHL(mem, ins); }
+    else if constexpr(OP == 0xC3 || (z == 2 && y <= 3)) { return opJP<OP>(mem, ins); }
+    else if constexpr(OP == 0xE2) { return opLDHCA(mem, ins); }
+    else if constexpr(OP == 0xEA) { return opLDnnA(mem, ins); }
+    else if constexpr(OP == 0xF2) { return opLDHAC(mem, ins); }
+    else if constexpr(OP == 0xFA) { return opLDAnn(mem, ins); }
+    else if constexpr(OP == 0xCB) { return opCB(mem, ins); }
+    else if constexpr(OP == 0xF3) { return opDI(mem, ins); }
+    else if constexpr(OP == 0xFB) { return opEI(mem, ins); }
+    else if constexpr(OP == 0xCD || (z == 4 && y <= 3)) { return opCALL<OP>(mem, ins); }
+    else if constexpr(z == 5 && q == 0) { return opPUSH<OP>(mem, ins); }
+    else if constexpr(z == 6) { return opALUn<OP>(mem, ins); }
+    else if constexpr(z == 7) { return opRST<OP>(mem, ins); }
+
+    // $D3, $DB, $DD, $E3, $E4, $EB, $EC, $ED, $F4, $FC, and $FD
+    else { return opIllegal(mem, ins); }
+}
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2) + flags.carry;
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::decodeCB(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t x = OP >> 6;
 
-        } else if(ins.target2 == HL) { // HL is an address
+    if constexpr(x == 0) { return cbRotate<OP>(mem, ins); }
+    else if constexpr(x == 1) { return cbBIT<OP>(mem, ins); }
+    else if constexpr(x == 2) { return cbRES<OP>(mem, ins); }
+    else { return cbSET<OP>(mem, ins); }
+}
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL)) + flags.carry;
-            cycles += 4;
+// End Dispatch Tables //
 
-        }
 
-        sum += value;
-        regs.a = sum;
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = Util::checkHCAdd(regs.a, value);
-        flags.carry = Util::checkOFAdd(regs.a, value);
+// Operand Helpers //
 
-        done = true;
-    } // END ADC A,r
+// Reads a byte for an instruction. Timed, it takes the next M-cycle.
+template<typename Accuracy>
+uint8_t CPU<Accuracy>::busRead(Memory& mem, uint16_t address)
+{
+    if constexpr(Accuracy::TIMED_ACCESSES)
+    {
+        access_cycles += 4;
+        bus_clock->catchUp(access_cycles);
+    }
+    return mem.readByte(address);
+}
 
-    // SUB A,r - Subtract register 'r' from A
-    if(!done && opcode >= 0b10010000 && opcode <= 0b10010111)
+// Writes a byte for an instruction. Timed, it takes the next M-cycle.
+template<typename Accuracy>
+void CPU<Accuracy>::busWrite(Memory& mem, uint16_t address, uint8_t data)
+{
+    if constexpr(Accuracy::TIMED_ACCESSES)
     {
-        ins.mnemonic = "SUB";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+        access_cycles += 4;
+        bus_clock->catchUp(access_cycles);
+    }
+    mem.writeByte(address, data);
+}
 
-        uint8_t value = 0;
-        uint8_t dif = regs.a;
+// Passes an M-cycle without an access, before a later timed access
+template<typename Accuracy>
+void CPU<Accuracy>::busIdle()
+{
+    if constexpr(Accuracy::TIMED_ACCESSES) { access_cycles += 4; }
+}
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+// Pushes a short onto the stack
+template<typename Accuracy>
+void CPU<Accuracy>::pushShort(Memory& mem, uint16_t value, int& cycles)
+{
+    uint8_t msb = 0, lsb = 0;
+    Util::U16toU8(value, msb, lsb);
+
+    regs.sp--;
+    busWrite(mem, regs.sp, msb);
+    regs.sp--;
+    busWrite(mem, regs.sp, lsb);
+    cycles += 8;
+}
 
-        } else if(ins.target2 == HL) { // HL is an address
+// Pops a short off of the stack
+template<typename Accuracy>
+uint16_t CPU<Accuracy>::popShort(Memory& mem, int& cycles)
+{
+    uint8_t lsb = busRead(mem, regs.sp);
+    regs.sp++;
+    uint8_t msb = busRead(mem, regs.sp);
+    regs.sp++;
+    cycles += 8;
+    return Util::U8toU16(msb, lsb);
+}
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
+// Reads the operand for a 3-bit register ID, where ID 6 is the byte at $HL
+template<typename Accuracy>
+template<uint8_t ID>
+uint8_t CPU<Accuracy>::readR8(Memory& mem, int& cycles)
+{
+    if constexpr(ID == 0b110)
+    {
+        cycles += 4;
+        return busRead(mem, regs.r16(RegisterSet::HL_SLOT));
+    } else {
+        return regs.r8(RegisterSet::R8_SLOTS[ID]);
+    }
+}
 
-        }
+// Writes the operand for a 3-bit register ID, where ID 6 is the byte at $HL
+template<typename Accuracy>
+template<uint8_t ID>
+void CPU<Accuracy>::writeR8(Memory& mem, uint8_t value, int& cycles)
+{
+    if constexpr(ID == 0b110)
+    {
+        busWrite(mem, regs.r16(RegisterSet::HL_SLOT), value);
+        cycles += 4;
+    } else {
+        regs.r8(RegisterSet::R8_SLOTS[ID]) = value;
+    }
+}
 
-        dif -= value;
-        regs.a = dif;
+// Reads a pair for a 2-bit pair ID: BC DE HL SP
+template<typename Accuracy>
+template<uint8_t ID>
+uint16_t CPU<Accuracy>::readR16() const
+{
+    if constexpr(ID == 0b11) { return regs.sp; }
+    else { return regs.r16(ID * 2); }
+}
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(regs.a, value);
-        flags.carry = Util::checkUFSub(regs.a, value);
+// Writes a pair for a 2-bit pair ID: BC DE HL SP
+template<typename Accuracy>
+template<uint8_t ID>
+void CPU<Accuracy>::writeR16(uint16_t value)
+{
+    if constexpr(ID == 0b11) { regs.sp = value; }
+    else { regs.setR16(ID * 2, value); }
+}
 
-        done = true;
+// Checks a branch condition. 0-3 are NZ, Z, NC, C. 4 is always true.
+template<typename Accuracy>
+template<uint8_t CC>
+bool CPU<Accuracy>::checkCondition() const
+{
+    if constexpr(CC == 0) { return !(regs.f & FLAG_ZERO); }
+    else if constexpr(CC == 1) { return regs.f & FLAG_ZERO; }
+    else if constexpr(CC == 2) { return !(regs.f & FLAG_CARRY); }
+    else if constexpr(CC == 3) { return regs.f & FLAG_CARRY; }
+    else { return true; }
+}
 
-    } // END SUB A,r
+// Performs an 8-bit ALU operation on A. 0-7 are ADD ADC SUB SBC AND XOR OR CP
+template<typename Accuracy>
+template<uint8_t OPER>
+void CPU<Accuracy>::alu(uint8_t value)
+{
+    ALU::Result result = ALU::operate<OPER>(regs.a, value, regs.f);
+    regs.a = result.value;
+    regs.f = result.f;
+}
 
-    // SBC A,r - Subtract (register 'r' + carry flag) from A
-    if(!done && opcode >= 0b10011000 && opcode <= 0b10011111)
-    {
-        ins.mnemonic = "SBC";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+// Performs a rotate/shift. 0-7 are RLC RRC RL RR SLA SRA SWAP SRL
+template<typename Accuracy>
+template<uint8_t OPER>
+uint8_t CPU<Accuracy>::rotate(uint8_t value)
+{
+    ALU::Result result = ALU::rotate<OPER>(value, regs.f);
+    regs.f = result.f;
+    return result.value;
+}
 
-        uint8_t value = 0;
-        uint8_t dif = regs.a;
+// End Operand Helpers //
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2) + flags.carry;
 
-        } else if(ins.target2 == HL) { // HL is an address
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL)) + flags.carry;
-            cycles += 4;
+// Load Instructions //
 
-        }
+// LD r1,r2 - Load Register 2 into Register 1
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opLDrr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t dst = (OP >> 3) & 0b111;
+    constexpr uint8_t src = OP & 0b111;
 
-        dif -= value;
-        regs.a = dif;
+    int cycles = 0;
+    writeR8<dst>(mem, readR8<src>(mem, cycles), cycles);
+    return cycles;
+}
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(regs.a, value);
-        flags.carry = Util::checkUFSub(regs.a, value);
+// LD r,n - Put immediate value 'n' into register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opLDrn(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t dst = (OP >> 3) & 0b111;
 
-        done = true;
+    int cycles = 0;
+    writeR8<dst>(mem, ins.imm8(), cycles);
+    return cycles;
+}
 
-    } // END SBC A,r
+// LD rr,nn - Load 16-bit immediate value into 16-bit register
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opLDrrnn(Memory& mem, const Instruction& ins)
+{
+    writeR16<(OP >> 4 & 0b11)>(ins.imm16());
+    return 0;
+}
 
-    // AND A,r - Mask A with value of register 'r' using AND
-    if(!done && opcode >= 0b10100000 && opcode <= 0b10100111)
-    {
-        ins.mnemonic = "AND";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+// LD (rr),A - Put A into byte at address in BC, DE, or HL. HL is then
+// incremented (LDI) or decremented (LDD).
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opLDindA(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t p = OP >> 4;
+    // LDI and LDD use HL
+    constexpr uint8_t slot = (p <= 2) ? p * 2 : RegisterSet::HL_SLOT;
 
-        uint8_t value = 0;
-        uint8_t val = regs.a;
+    uint16_t address = regs.r16(slot);
+    busWrite(mem, address, regs.a);
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+    if constexpr(p == 2) { regs.setR16(RegisterSet::HL_SLOT, address + 1); }
+    if constexpr(p == 3) { regs.setR16(RegisterSet::HL_SLOT, address - 1); }
 
-        } else if(ins.target2 == HL) { // HL is an address
+    return 4;
+}
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
+// LD A,(rr) - Put byte at address in BC, DE, or HL into A. HL is then
+// incremented (LDI) or decremented (LDD).
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opLDAind(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t p = OP >> 4;
+    // LDI and LDD use HL
+    constexpr uint8_t slot = (p <= 2) ? p * 2 : RegisterSet::HL_SLOT;
 
-        }
+    uint16_t address = regs.r16(slot);
+    regs.a = busRead(mem, address);
 
-        val &= value;
-        regs.a = val;
+    if constexpr(p == 2) { regs.setR16(RegisterSet::HL_SLOT, address + 1); }
+    if constexpr(p == 3) { regs.setR16(RegisterSet::HL_SLOT, address - 1); }
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = true;
-        flags.carry = false;
+    return 4;
+}
 
-        done = true;
+// LD (nn),SP - Put SP into the value at address given by 16-bit immediate value
+template<typename Accuracy>
+int CPU<Accuracy>::opLDnnSP(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint16_t address = ins.imm16();
 
-    } // END AND A,r
+    // Split SP into two bytes
+    uint8_t value_lsb = 0, value_msb = 0;
+    Util::U16toU8(regs.sp, value_msb, value_lsb);
 
-    // OR A,r - Mask A with value of register 'r' using OR
-    if(!done && opcode >= 0b10110000 && opcode <= 0b10110111)
-    {
-        ins.mnemonic = "OR";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+    busWrite(mem, address, value_lsb);
+    busWrite(mem, address + 1, value_msb);
+    cycles += 8;
 
-        uint8_t value = 0;
-        uint8_t val = regs.a;
+    return cycles;
+}
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+// LDH (n),A - Put value in A into value at address $FF00 + immediate byte
+template<typename Accuracy>
+int CPU<Accuracy>::opLDHnA(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint16_t address = 0xFF00 + ins.imm8();
+    busWrite(mem, address, regs.a);
+    cycles += 4;
 
-        } else if(ins.target2 == HL) { // HL is an address
+    return cycles;
+}
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
+// LDH A,(n) - Put value at address $FF00 + immediate value 'n' into register A
+template<typename Accuracy>
+int CPU<Accuracy>::opLDHAn(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint16_t address = 0xFF00 + ins.imm8();
+    regs.a = busRead(mem, address);
+    cycles += 4;
 
-        }
+    return cycles;
+}
+
+// LDH (C),A - Put value in A in value at address $FF00 + C
+template<typename Accuracy>
+int CPU<Accuracy>::opLDHCA(Memory& mem, const Instruction& ins)
+{
+    busWrite(mem, 0xFF00 + regs.c, regs.a);
+    return 4;
+}
 
-        val |= value;
-        regs.a = val;
+// LDH A,(C) - Put value at address $FF00 + C into A
+template<typename Accuracy>
+int CPU<Accuracy>::opLDHAC(Memory& mem, const Instruction& ins)
+{
+    regs.a = busRead(mem, 0xFF00 + regs.c);
+    return 4;
+}
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = true;
-        flags.carry = false;
+// LD (nn),A - Put A into byte at address in immediate 16-bit value
+template<typename Accuracy>
+int CPU<Accuracy>::opLDnnA(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint16_t address = ins.imm16();
+    busWrite(mem, address, regs.a);
+    cycles += 4;
 
-        done = true;
+    return cycles;
+}
 
-    } // END OR A,r
+// LD A,(nn) - Put byte at address in immediate 16-bit value into A
+template<typename Accuracy>
+int CPU<Accuracy>::opLDAnn(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint16_t address = ins.imm16();
+    regs.a = busRead(mem, address);
+    cycles += 4;
 
-    // XOR A,r - Mask A with value of register 'r' using XOR
-    if(!done && opcode >= 0b10101000 && opcode <= 0b10101111)
-    {
-        ins.mnemonic = "XOR";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+    return cycles;
+}
 
-        uint8_t value = 0;
-        uint8_t val = regs.a;
+// LD SP,HL - Put HL into SP
+template<typename Accuracy>
+int CPU<Accuracy>::opLDSPHL(Memory& mem, const Instruction& ins)
+{
+    regs.sp = regs.r16(RegisterSet::HL_SLOT);
+    return 4;
+}
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+// LD HL,SP+n - "Put SP + n effective address into HL" (SP + N) -> HL
+template<typename Accuracy>
+int CPU<Accuracy>::opLDHLSPe(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint8_t offset = ins.imm8();
 
-        } else if(ins.target2 == HL) { // HL is an address
+    regs.f = ALU::addSPFlags(regs.sp, offset);
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
+    regs.setR16(RegisterSet::HL_SLOT, regs.sp + Util::U8toS8(offset));
+    cycles += 4;
 
-        }
+    return cycles;
+}
 
-        val ^= value;
-        regs.a = val;
+// PUSH - Push 16-bit register onto stack, decrement SP twice
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opPUSH(Memory& mem, const Instruction& ins)
+{
+    // BC DE HL AF, the slot is the pair ID * 2
+    constexpr uint8_t slot = (OP >> 4 & 0b11) * 2;
 
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = true;
-        flags.carry = false;
+    int cycles = 4;
+    busIdle();
+    pushShort(mem, regs.r16(slot), cycles);
+    return cycles;
+}
 
-        done = true;
+// POP - Pop 16-bit value off of stack into 16-bit register, increment SP twice
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opPOP(Memory& mem, const Instruction& ins)
+{
+    // BC DE HL AF, the slot is the pair ID * 2
+    constexpr uint8_t slot = (OP >> 4 & 0b11) * 2;
 
-    } // END XOR A,r
+    int cycles = 0;
+    uint16_t value = popShort(mem, cycles);
 
-    // CP A,r - Compares A with value in register 'r'. (SUB without changing A)
-    if(!done && opcode >= 0b10111000 && opcode <= 0b10111111)
+    if constexpr(slot == RegisterSet::AF_SLOT)
     {
-        ins.mnemonic = "SUB";
-        ins.target1 = A;
-        ins.target2 = toTarget(opcode & 0b00000111);
+        // The lower nibble of F is always zero
+        regs.setR16(slot, value & 0xFFF0);
+    } else {
+        regs.setR16(slot, value);
+    }
 
-        uint8_t value = 0;
-        uint8_t dif = regs.a;
+    return cycles;
+}
 
-        if(ins.target2 != HL)
-        {
-            value = getByteReg(ins.target2);
+// End Load Instructions //
 
-        } else if(ins.target2 == HL) { // HL is an address
 
-            ins.t2_as_address = true;
-            value = mem.readByte(getShortReg(HL));
-            cycles += 4;
 
-        }
+// Arithmetic Instructions //
 
-        dif -= value;
+// ALU A,r - ADD/ADC/SUB/SBC/AND/XOR/OR/CP register 'r' with A
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opALUr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t oper = (OP >> 3) & 0b111;
+    constexpr uint8_t src = OP & 0b111;
 
-        flags.zero = (dif == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(dif, value);
-        flags.carry = Util::checkUFSub(dif, value);
+    int cycles = 0;
+    alu<oper>(readR8<src>(mem, cycles));
+    return cycles;
+}
 
-        done = true;
+// ALU A,n - ADD/ADC/SUB/SBC/AND/XOR/OR/CP immediate value 'n' with A
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opALUn(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t oper = (OP >> 3) & 0b111;
 
-    } // END CP A,r
+    int cycles = 0;
+    alu<oper>(ins.imm8());
+    return cycles;
+}
 
-    // End Algorithmic Checks //
+// INC r - Increment value in/at register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opINCr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t dst = (OP >> 3) & 0b111;
 
-    // Two-Byte instructions //
+    int cycles = 0;
+    ALU::Result result = ALU::inc(readR8<dst>(mem, cycles), regs.f);
+    writeR8<dst>(mem, result.value, cycles);
+    regs.f = result.f;
 
-    if(!done && opcode == 0xCB)
-    {
-        ins.two_byte = true;
+    return cycles;
+}
 
-        // New opcode is immediate value
-        opcode = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
+// DEC r - Decrement value in/at register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opDECr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t dst = (OP >> 3) & 0b111;
 
-        // Change opcode for logging
-        ins.opcode = 0xCB00 + opcode;
+    int cycles = 0;
+    ALU::Result result = ALU::dec(readR8<dst>(mem, cycles), regs.f);
+    writeR8<dst>(mem, result.value, cycles);
+    regs.f = result.f;
 
-        // ROTATE AND SHIFT //
+    return cycles;
+}
 
-        // SWAP r - Swap the upper and lower nibbles of a byte
-        if(opcode >= 0b00110000 && opcode <= 0b00110111)
-        {
-            ins.mnemonic = "SWAP";
-            ins.target1 = toTarget(opcode & 0b00000111);
+// INC rr - Increment value in register 'rr'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opINCrr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t pair = OP >> 4 & 0b11;
 
-            uint8_t value;
+    writeR16<pair>(readR16<pair>() + 1);
+    // Flags are not set
 
-            if(ins.target1 != HL)
-            {
-                value = getByteReg(ins.target1);
+    return 4;
+}
 
-                uint8_t unibble = value & 0b11110000;
-                uint8_t lnibble = value & 0b00001111;
+// DEC rr - Decrement value in register 'rr'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opDECrr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t pair = OP >> 4 & 0b11;
 
-                value = (unibble >> 8) | (lnibble << 8);
+    writeR16<pair>(readR16<pair>() - 1);
+    // Flags are not set
 
-                setByteReg(ins.target1, value);
+    return 4;
+}
 
-            } else { // HL is an address
+// ADD HL,rr - To HL, add HL + 16-bit register
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opADDHLrr(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t pair = OP >> 4 & 0b11;
 
-                ins.t1_as_address = true;
-                value = mem.readByte(getShortReg(HL));
-                cycles += 4;
+    uint16_t val1 = regs.r16(RegisterSet::HL_SLOT);
+    uint16_t val2 = readR16<pair>();
 
-                uint8_t unibble = value & 0b11110000;
-                uint8_t lnibble = value & 0b00001111;
+    // Zero is unchanged
+    regs.f = (regs.f & FLAG_ZERO)
+           | packFlags(false, false,
+                       ((val1 & 0x0FFF) + (val2 & 0x0FFF)) > 0x0FFF,
+                       Util::checkOFAdd(val1, val2));
 
-                value = (unibble >> 8) | (lnibble << 8);
+    regs.setR16(RegisterSet::HL_SLOT, val1 + val2);
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+    return 4;
+}
 
-            }
+// ADD SP,n - Add signed immediate value 'n' to SP
+template<typename Accuracy>
+int CPU<Accuracy>::opADDSPe(Memory& mem, const Instruction& ins)
+{
+    int cycles = 0;
+    uint8_t offset = ins.imm8();
 
-            // Zero is unchanged
-            flags.subtract = false;
-            flags.half_carry = false;
-            flags.carry = false;
+    regs.f = ALU::addSPFlags(regs.sp, offset);
 
-            done = true;
+    regs.sp += Util::U8toS8(offset);
+    cycles += 8;
 
-        } // END SWAP
+    return cycles;
+}
 
-        // RLC r - Shift register 'r' left, MSB to Carry flag
-        if(!done && opcode >= 0b00000000 && opcode <= 0b00000111)
-        {
-            ins.mnemonic = "RLC";
+//DAA - Retroactively adjusts A to a valid BCD result. This means something, and does something.
+template<typename Accuracy>
+int CPU<Accuracy>::opDAA(Memory& mem, const Instruction& ins)
+{
+    ALU::Result result = ALU::daa(regs.a, regs.f);
+    regs.a = result.value;
+    regs.f = result.f;
 
-            ins.target1 = toTarget(opcode & 0b00000111);
+    return 0;
+}
 
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
+// CPL - Flip all bits in A
+template<typename Accuracy>
+int CPU<Accuracy>::opCPL(Memory& mem, const Instruction& ins)
+{
+    regs.a = ~regs.a;
 
-                bool old_msb = (value >> 7) & 1;
-                value = (value << 1) | old_msb;
-                flags.carry = old_msb;
-                setByteReg(ins.target1, value);
+    regs.f |= FLAG_SUBTRACT | FLAG_HALF_CARRY;
 
-                flags.zero = (value == 0);
+    return 0;
+}
 
-            } else {
+// End Arithmetic Instructions //
 
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
 
-                bool old_msb = (value >> 7) & 1;
-                value = (value << 1) | old_msb;
-                flags.carry = old_msb;
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+// Rotate and Shift Instructions //
 
-                flags.zero = (value == 0);
-            }
+// RLCA/RRCA/RLA/RRA - Rotate A. Unlike the CB versions, zero is always reset
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opRotA(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t oper = (OP >> 3) & 0b111;
 
-            flags.subtract = false;
-            flags.half_carry = false;
+    regs.a = rotate<oper>(regs.a);
+    regs.f &= ~FLAG_ZERO;
 
-            done = true;
+    return 0;
+}
 
-        } // END RLC r
+// End Rotate and Shift Instructions //
 
-        // RL r - Shift register 'r' left, wrapped and set carry.
-        if(!done && opcode >= 0b00010000 && opcode <= 0b00010111)
-        {
-            ins.mnemonic = "RL";
 
-            ins.target1 = toTarget(opcode & 0b00000111);
 
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
+// Control Instructions //
 
-                bool old_msb = (value >> 7) & 1;
-                value = (value << 1) | flags.carry;
-                flags.carry = old_msb;
-                setByteReg(ins.target1, value);
+// NOP
+template<typename Accuracy>
+int CPU<Accuracy>::opNOP(Memory& mem, const Instruction& ins)
+{
+    return 0;
+}
 
-                flags.zero = (value == 0);
+//SCF - Set Carry flag
+template<typename Accuracy>
+int CPU<Accuracy>::opSCF(Memory& mem, const Instruction& ins)
+{
+    regs.f = (regs.f & FLAG_ZERO) | FLAG_CARRY;
 
-            } else {
+    return 0;
+}
 
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
+//CCF - Flip Carry flag
+template<typename Accuracy>
+int CPU<Accuracy>::opCCF(Memory& mem, const Instruction& ins)
+{
+    regs.f = (regs.f & (FLAG_ZERO | FLAG_CARRY)) ^ FLAG_CARRY;
 
-                bool old_msb = (value >> 7) & 1;
-                value = (value << 1) | flags.carry;
-                flags.carry = old_msb;
+    return 0;
+}
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+// HALT
+template<typename Accuracy>
+int CPU<Accuracy>::opHALT(Memory& mem, const Instruction& ins)
+{
+    halted = true;
+    return 0;
+}
 
-                flags.zero = (value == 0);
+// STOP
+template<typename Accuracy>
+int CPU<Accuracy>::opSTOP(Memory& mem, const Instruction& ins)
+{
+    // The padding byte after STOP is consumed by decode (length 2), but STOP
+    // only takes 4 cycles, so give back the cycles counted for it
+    stopped = true;
 
-            }
+    return -4;
+}
 
-            flags.subtract = false;
-            flags.half_carry = false;
+// DI - Disable Interrupts
+template<typename Accuracy>
+int CPU<Accuracy>::opDI(Memory& mem, const Instruction& ins)
+{
+    interrupts_enabled = false;
+    next_interrupt_state = false;
+    return 0;
+}
 
-            done = true;
+// EI - Enable Interrupts after next instruction is executed
+template<typename Accuracy>
+int CPU<Accuracy>::opEI(Memory& mem, const Instruction& ins)
+{
+    next_interrupt_state = true;
+    return 0;
+}
 
-        } // END RL r
+// CB - Two-byte instructions. The second byte is the opcode for cb_table
+template<typename Accuracy>
+int CPU<Accuracy>::opCB(Memory& mem, const Instruction& ins)
+{
+    return cb_table[ins.imm8()](*this, mem, ins);
+}
 
-        // RRC r - Shift register 'r' right, LSB to Carry flag
-        if(!done && opcode >= 0b00001000 && opcode <= 0b00001111)
-        {
-            ins.mnemonic = "RRC";
+// Opcodes that do not exist on the SM83. Treated as NOP.
+template<typename Accuracy>
+int CPU<Accuracy>::opIllegal(Memory& mem, const Instruction& ins)
+{
+    log(format("CPU: Unhandled instruction: 0x{:02X} at ${:04X}!",
+               ins.opcode,
+               ins.origin),
+        Logger::logDEBUG
+    );
 
-            ins.target1 = toTarget(opcode & 0b00000111);
+    return 0;
+}
 
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
+// End Control Instructions //
 
-                bool old_lsb = value & 1;
-                value = (value >> 1) | (old_lsb << 7);
-                flags.carry = old_lsb;
-                setByteReg(ins.target1, value);
 
-                flags.zero = (value == 0);
 
-            } else {
+// Jump Instructions //
 
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
+// JP nn,c - If condition met, jump to the immediate value 'nn'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opJP(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t cc = (OP == 0xC3) ? 4 : (OP >> 3) & 0b11;
 
-                bool old_lsb = value & 1;
-                value = (value >> 1) | (old_lsb << 7);
-                flags.carry = old_lsb;
+    int cycles = 0;
+    uint16_t address = ins.imm16();
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+    if(checkCondition<cc>())
+    {
+        regs.pc = address;
+        cycles += 4;
+        backward_branch = address <= ins.origin;
+    }
 
-                flags.zero = (value == 0);
-            }
+    return cycles;
+}
 
-            flags.subtract = false;
-            flags.half_carry = false;
+// JP HL - Jump to the address in HL
+template<typename Accuracy>
+int CPU<Accuracy>::opJPHL(Memory& mem, const Instruction& ins)
+{
+    regs.pc = regs.r16(RegisterSet::HL_SLOT);
+    return 0;
+}
 
-            done = true;
+// JR n,c - If condition met, jump to PC + 'n'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opJR(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t cc = (OP == 0x18) ? 4 : (OP >> 3) & 0b11;
 
-        } // END RRC
+    int cycles = 0;
+    int8_t offset = Util::U8toS8(ins.imm8());
 
-        // RR r - Shift register 'r' right, wrapped and set carry.
-        if(!done && opcode >= 0b00011000 && opcode <= 0b00011111)
-        {
-            ins.mnemonic = "RR";
+    if(checkCondition<cc>())
+    {
+        regs.pc += offset;
+        cycles += 4;
+        backward_branch = offset < 0;
+    }
 
-            ins.target1 = toTarget(opcode & 0b00000111);
+    return cycles;
+}
 
-            if(ins.target1 != HL)
-            {
-                byte value = getByteReg(ins.target1);
+// CALL - Push current PC onto stack, jump to address in immediate 16 bits
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opCALL(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t cc = (OP == 0xCD) ? 4 : (OP >> 3) & 0b11;
 
-                bool old_lsb = value & 1;
-                value = (value >> 1) | (flags.carry << 7);
-                flags.carry = old_lsb;
-                setByteReg(ins.target1, value);
+    int cycles = 0;
+    uint16_t address = ins.imm16();
 
-                flags.zero = (value == 0);
+    if(checkCondition<cc>())
+    {
+        cycles += 4;
+        busIdle();
+        pushShort(mem, regs.pc, cycles);
+        regs.pc = address;
+    }
 
-            } else {
+    return cycles;
+}
 
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
+// RET c - If condition met, pop from stack and jump to that address
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opRETcc(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t cc = (OP >> 3) & 0b11;
 
-                bool old_lsb = value & 1;
-                value = (value >> 1) | (flags.carry << 7);
-                flags.carry = old_lsb;
+    // The condition is checked in its own M-cycle
+    int cycles = 4;
+    busIdle();
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+    if(checkCondition<cc>())
+    {
+        regs.pc = popShort(mem, cycles);
+        cycles += 4;
+    }
 
-                flags.zero = (value == 0);
-            }
+    return cycles;
+}
 
-            flags.subtract = false;
-            flags.half_carry = false;
+// RET - Pop from stack and jump to that address
+template<typename Accuracy>
+int CPU<Accuracy>::opRET(Memory& mem, const Instruction& ins)
+{
+    int cycles = 4;
+    regs.pc = popShort(mem, cycles);
+    return cycles;
+}
 
-            done = true;
+// RETI - Pop from stack and jump to that address, then enable interrupts
+template<typename Accuracy>
+int CPU<Accuracy>::opRETI(Memory& mem, const Instruction& ins)
+{
+    int cycles = 4;
+    regs.pc = popShort(mem, cycles);
+    interrupts_enabled = true;
+    next_interrupt_state = true;
+    return cycles;
+}
 
-        } // END RR
+// RST n - Push current address onto stack, jump to vector
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::opRST(Memory& mem, const Instruction& ins)
+{
+    constexpr uint16_t vector = OP & 0b00111000;
 
-        // SLA r - Shift r left into carry, set LSB to 0
-        if(!done && opcode >= 0b00100000 && opcode <= 0b01000111)
-        {
-            ins.mnemonic = "SLA";
+    int cycles = 4;
+    busIdle();
+    pushShort(mem, regs.pc, cycles);
+    regs.pc = vector;
+    return cycles;
+}
 
-            ins.target1 = toTarget(opcode & 0b00000111);
+// End Jump Instructions //
 
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
 
-                bool old_msb = (value >> 7) & 1;
-                value = value << 1;
-                flags.carry = old_msb;
-                setByteReg(ins.target1, value);
 
-                flags.zero = (value == 0);
+// CB-prefixed Instructions //
 
-            } else {
+// RLC/RRC/RL/RR/SLA/SRA/SWAP/SRL r - Rotate or shift register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::cbRotate(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t oper = (OP >> 3) & 0b111;
+    constexpr uint8_t dst = OP & 0b111;
 
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
+    int cycles = 0;
+    writeR8<dst>(mem, rotate<oper>(readR8<dst>(mem, cycles)), cycles);
+    return cycles;
+}
 
-                bool old_msb = (value >> 7) & 1;
-                value = value << 1;
-                flags.carry = old_msb;
+// BIT b,r - Check bit 'b' in register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::cbBIT(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t bit = (OP >> 3) & 0b111;
+    constexpr uint8_t src = OP & 0b111;
 
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
+    int cycles = 0;
+    uint8_t value = readR8<src>(mem, cycles);
 
-                flags.zero = (value == 0);
-            }
+    // Zero is set if the bit is NOT set. Carry is unchanged.
+    regs.f = (regs.f & FLAG_CARRY) | FLAG_HALF_CARRY
+           | (((value >> bit) & 1) ? 0 : FLAG_ZERO);
 
-            flags.subtract = false;
-            flags.half_carry = false;
-
-            done = true;
-
-        } // END SLA
-
-        // SRA r - Shift r right into Carry, leave MSB as-is
-        if(opcode >= 0b00101000 && opcode <= 0b00101111)
-        {
-            ins.mnemonic = "SRA";
-
-            ins.target1 = toTarget(opcode & 0b00000111);
-
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
-
-                bool old_lsb = value & 1;
-                bool old_msb = (value >> 7) & 1;
-                value = (value >> 1) | (old_msb << 7);
-                flags.carry = old_lsb;
-                setByteReg(ins.target1, value);
-
-                flags.zero = (value == 0);
-
-            } else {
-
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
-
-                bool old_lsb = value & 1;
-                bool old_msb = (value >> 7) & 1;
-                value = (value >> 1) | (old_msb << 7);
-                flags.carry = old_lsb;
-
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
-
-                flags.zero = (value == 0);
-
-            }
-
-            flags.subtract = false;
-            flags.half_carry = false;
-
-            done = true;
-
-        } // END SRA
-
-        // SRL r - Shift r left into Carry, MSB set to 0
-        if(!done && opcode >= 0b00111000 && opcode <= 0b00111111)
-        {
-            ins.mnemonic = "SRL";
-
-            ins.target1 = toTarget(opcode & 0b00000111);
-
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
-
-                bool old_lsb = value & 1;
-                value = value >> 1;
-                flags.carry = old_lsb;
-                setByteReg(ins.target1, value);
-
-                flags.zero = (value == 0);
-
-            } else {
-
-                ins.t1_as_address = true;
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
-
-                bool old_lsb = value & 1;
-                value = value >> 1;
-                flags.carry = old_lsb;
-
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
-
-                flags.zero = (value == 0);
-
-            }
-
-            flags.subtract = false;
-            flags.half_carry = false;
-
-            done = true;
-
-        } // END SRL
-
-        // END ROTATE AND SHIFT //
-
-        // SINGLE-BIT //
-
-        // BIT b,r - Check bit 'b' in register 'r'
-        if(!done && opcode >= 0b01000000 && opcode <= 0b01111111)
-        {
-            ins.mnemonic = "BIT";
-
-            ins.target1 = toTarget(opcode & 0b00000111);
-            // Bit to check is direct value in middle 3 bits
-            uint8_t check_bit = ((opcode & 0b00111000) >> 3);
-            ins.target2 = toBITTarget(check_bit);
-
-            if(ins.target1 != HL)
-            {
-                // Shift value so check_bit is at position 0,
-                // then mask to only bit zero
-                flags.zero = (getByteReg(ins.target1) >> check_bit) & 1;
-
-            } else {
-
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
-                flags.zero = (value >> check_bit) & 1;
-            }
-
-            flags.subtract = false;
-            flags.half_carry = true;
-
-            done = true;
-
-        } // END BIT
-
-        // RES b,r - Reset bit 'b' in register 'r'
-        if(!done && opcode >= 0b10000000 && opcode <= 0b10111111)
-        {
-            ins.mnemonic = "RES";
-
-            ins.target1 = toTarget(opcode & 0b00000111);
-            // Bit to check is direct value in middle 3 bits
-            uint8_t check_bit = (opcode & 0b00111000) >> 3;
-            ins.target2 = toBITTarget(check_bit);
-
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
-
-                // Create a mask of all ones except check_bit
-                value &= ~(1 << check_bit);
-
-                setByteReg(ins.target1, value);
-
-            } else {
-
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
-
-                // Create a mask of all ones except check_bit
-                value &= ~(1 << check_bit);
-
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
-            }
-
-            done = true;
-
-        } // END RES
-
-        // SET b,r - Set bit 'b' in register 'r'
-        if(!done && opcode >= 0b11000000 && opcode <= 0b11111111)
-        {
-            ins.mnemonic = "SET";
-
-            ins.target1 = toTarget(opcode & 0b00000111);
-            // Bit to check is direct value in middle 3 bits
-            uint8_t check_bit = (opcode & 0b00111000) >> 3;
-            ins.target2 = toBITTarget(check_bit);
-
-            if(ins.target1 != HL)
-            {
-                uint8_t value = getByteReg(ins.target1);
-                value |= (1 << check_bit);
-                setByteReg(ins.target1, value);
-
-            } else {
-
-                uint8_t value = mem.readByte(getShortReg(HL));
-                cycles += 4;
-
-                value |= (1 << check_bit);
-
-                mem.writeByte(getShortReg(HL), value);
-                cycles += 4;
-            }
-
-            done = true;
-
-        } // END SET
-
-        // END SINGLE BIT //
-    }
-
-    // End Two-Byte instructions //
-
-    // THE BIG SWITCH
-    if (!done)
-    switch(opcode)
-    {
-    // NOP
-    case 0x00:
-    {
-        ins.mnemonic = "NOP";
-        done = true;
-        break;
-    } // END NOP
-
-    // Load Instructions //
-
-    // LDH A,n - Put value at address $FF00 + immediate value 'n' into register A
-    case 0xF0:
-    {
-        ins.mnemonic = "LDH";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-        ins.t2_as_address = true;
-
-        uint16_t address = 0xFF00 + Util::U8toS8(mem.readByte(regs.pc));
-        regs.pc++;
-        cycles += 4;
-
-        uint8_t value = mem.readByte(address);
-        regs.a = value;
-
-        done = true;
-
-        break;
-    } // END LD A,n
-
-    // LD (HL),n - Put immediate value 'n' into value at address HL
-    case 0x36:
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = HL;
-        ins.t1_as_address = true;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t value = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-
-        mem.writeByte(getShortReg(HL), value);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LD (HL),n
-
-    // LD (rr),A - Put A into byte at address in register 'rr'
-    case 0x02: case 0x12:
-    {
-        ins.mnemonic = "LD";
-        ins.target2 = A;
-        ins.t1_as_address = true;
-
-        switch (opcode)
-        {
-            case 0x02: ins.target1 = BC; break;
-            case 0x12: ins.target1 = DE; break;
-            default: break;
-        }
-
-        uint16_t address = getShortReg(ins.target1);
-        mem.writeByte(address, regs.a);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LD (rr),A
-
-    // LD (nn), A - Put A into byte at address in immediate 16-bit value
-    case 0xEA:
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = IMMEDIATE;
-        ins.t1_as_address = true;
-        ins.target2 = A;
-
-        uint8_t lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint8_t msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint16_t address = Util::U8toU16(msb, lsb);
-        mem.writeByte(address, regs.a);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LD (nn),A
-
-    // LD r,n - Put immediate value 'n' into register 'r'
-    case 0x06: case 0x0E: case 0x16: case 0x1E: case 0x26: case 0x2E: case 0x3E:
-    {
-        ins.mnemonic = "LD";
-        ins.target2 = IMMEDIATE;
-
-        // Middle 3 bits denote register
-        ins.target1 = toTarget((opcode & 0b00111000) >> 3);
-
-        uint8_t val = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        setByteReg(ins.target1, val);
-
-        done = true;
-
-        break;
-    } // END LD r,n
-
-    // LDH (C),A - Put value in A in value at address $FF00 + C
-    case 0xE2:
-    {
-        ins.mnemonic = "LDH";
-        ins.target1 = C;
-        ins.t1_as_address = true;
-        ins.target2 = A;
-
-        uint16_t address = 0xFF00 + regs.c;
-        mem.writeByte(address, regs.a);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LDH (C),A
-
-    // LDH A,(C) - Put value at address $FF00 + C into A
-    case 0xF2:
-    {
-        ins.mnemonic = "LDH";
-        ins.target1 = A;
-        ins.target2 = C;
-        ins.t2_as_address = true;
-
-        uint16_t address = 0xFF00 + regs.c;
-
-        uint8_t val = mem.readByte(address);
-        cycles += 4;
-        regs.a = val;
-
-        done = true;
-
-        break;
-    } // END LDH A,(C)
-
-    // LDH (n),A - Put value in A into value at address $FF00 + immediate byte
-    case 0xE0:
-    {
-        ins.mnemonic = "LDH";
-        ins.target1 = IMMEDIATE;
-        ins.t1_as_address = true;
-        ins.target2 = A;
-
-        uint16_t address = 0xFF00;
-        address += mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        mem.writeByte(address, regs.a);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LDH (n),A
-
-    // LD rr,nn - Load 16-bit immediate value into 16-bit register
-    case 0x01: case 0x11: case 0x21: case 0x31:
-    {
-        ins.mnemonic = "LD";
-        ins.target2 = IMMEDIATE;
-
-        // Get target1
-        switch (opcode)
-        {
-            case 0x01: ins.target1 = BC; break;
-            case 0x11: ins.target1 = DE; break;
-            case 0x21: ins.target1 = HL; break;
-            case 0x31: ins.target1 = SP; break;
-            default: break;
-        }
-
-        byte lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        byte msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint16_t val = Util::U8toU16(msb, lsb);
-
-        setShortReg(ins.target1, val);
-
-        done = true;
-
-        break;
-    } // END LD rr,nn
-
-        // LD SP,HL - Put HL into SP
-    case 0xF9:
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = SP;
-        ins.target2 = HL;
-
-        regs.sp = getShortReg(HL);
-
-        done = true;
-
-        break;
-    } // END LD SP,HL
-
-    // LD HL,SP+n - "Put SP + n effective address into HL" (SP + N) -> HL
-    case 0xF8:
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = HL;
-        ins.target2 = SP;
-
-        uint16_t val1 = regs.sp;
-        uint16_t val2 = mem.readByte(regs.pc);
-        uint16_t sum = val1 + val2;
-        regs.pc++;
-        cycles += 4;
-
-        setShortReg(HL, sum);
-
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = Util::checkHCAdd(val1, val2);
-        flags.carry = Util::checkOFAdd(val1, val2);
-
-        done = true;
-
-        break;
-    } // END LD HL,SP+n
-
-    // LD (nn),SP - Put SP into the value at address given by 16-bit immediate value
-    case 0x08:
-    {
-        ins.mnemonic = "LD";
-        ins.target1 = IMMEDIATE;
-        ins.t1_as_address = true;
-        ins.target2 = SP;
-
-        // Get address from immediate data
-        byte address_lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-        byte address_msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint16_t address = Util::U8toU16(address_msb, address_lsb);
-
-        // Split SP into two bytes
-        uint8_t value_lsb = 0, value_msb = 0;
-        Util::U16toU8(regs.sp, value_msb, value_lsb);
-
-        // Write split SP to memory
-        mem.writeByte(address, value_lsb);
-        address++;
-        cycles += 4;
-        mem.writeByte(address, value_msb);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END LD (nn),SP
-
-    // LDI (HL),A - Load into address at $HL, A. Increment HL
-    case 0x22:
-    {
-        ins.mnemonic = "LDI";
-        ins.target1 = HL;
-        ins.t1_as_address = true;
-        ins.target2 = A;
-
-        mem.writeByte(getShortReg(HL), regs.a);
-        cycles += 4;
-
-        setShortReg(HL, getShortReg(HL) + 1);
-
-        done = true;
-
-        break;
-    } // END LDI (HL),A
-
-    // LDI A,(HL) - Load into A, value at $HL. Increment HL
-    case 0x2A:
-    {
-        ins.mnemonic = "LDI";
-        ins.target1 = A;
-        ins.target2 = HL;
-        ins.t2_as_address = true;
-
-        uint8_t val = mem.readByte(getShortReg(HL));
-        cycles += 4;
-        regs.a = val;
-
-        setShortReg(HL, getShortReg(HL) + 1);
-
-        done = true;
-
-        break;
-    } // END LDI (HL),A
-
-    // LDD (HL), A - Load into A, value at $HL. Decrement HL.
-    case 0x32:
-    {
-        ins.mnemonic = "LDD";
-        ins.target1 = HL;
-        ins.t1_as_address = true;
-        ins.target2 = A;
-
-        mem.writeByte(getShortReg(HL), regs.a);
-        cycles += 4;
-
-        setShortReg(HL, getShortReg(HL) - 1);
-
-        done = true;
-
-        break;
-    } // END LDI (HL),A
-
-    // LDI A,(HL) - Load into A, value at $HL. Decrement HL.
-    case 0x3A:
-    {
-        ins.mnemonic = "LDD";
-        ins.target1 = A;
-        ins.target2 = HL;
-        ins.t2_as_address = true;
-
-        uint8_t val = mem.readByte(getShortReg(HL));
-        cycles += 4;
-        regs.a = val;
-
-        setShortReg(HL, getShortReg(HL) - 1);
-
-        done = true;
-
-        break;
-    } // END LDI (HL),A
-
-    // PUSH - Push 16-bit register onto stack, decrement SP twice
-    case 0xF5: case 0xC5: case 0xD5: case 0xE5:
-    {
-        ins.mnemonic = "PUSH";
-        ins.target1 = SP;
-        ins.t1_as_address = true;
-
-        // MSB
-        switch (opcode)
-        {
-            case 0xF5: ins.target2 = A; break;
-            case 0xC5: ins.target2 = B; break;
-            case 0xD5: ins.target2 = D; break;
-            case 0xE5: ins.target2 = H; break;
-            default: break;
-        }
-
-        regs.sp--;
-        uint8_t msb = getByteReg(ins.target2);
-        mem.writeByte(regs.sp, msb);
-        cycles += 4;
-
-        // LSB
-        switch (opcode)
-        {
-            case 0xF5: ins.target2 = F; break;
-            case 0xC5: ins.target2 = C; break;
-            case 0xD5: ins.target2 = E; break;
-            case 0xE5: ins.target2 = L; break;
-            default: break;
-        }
-
-        regs.sp--;
-        byte lsb = getByteReg(ins.target2);
-        mem.writeByte(regs.sp, lsb);
-        cycles += 4;
-
-        done = true;
-
-        break;
-    } // END PUSH
-
-    // POP - Pop 16-bit value off of stack into 16-bit register, increment SP twice
-    case 0xF1: case 0xC1: case 0xD1: case 0xE1:
-    {
-        ins.mnemonic = "POP";
-        ins.target2 = SP;
-        ins.t2_as_address = true;
-
-        // LSB
-        switch (opcode)
-        {
-            case 0xF1: ins.target1 = F; break;
-            case 0xC1: ins.target1 = C; break;
-            case 0xD1: ins.target1 = E; break;
-            case 0xE1: ins.target1 = L; break;
-            default: break;
-        }
-
-        regs.sp++;
-        byte val = mem.readByte(regs.sp);
-        cycles += 4;
-
-        setByteReg(ins.target1, val);
-
-        // MSB
-        switch (opcode)
-        {
-            case 0xF1: ins.target1 = A; break;
-            case 0xC1: ins.target1 = B; break;
-            case 0xD1: ins.target1 = D; break;
-            case 0xE1: ins.target1 = H; break;
-            default: break;
-        }
-
-        regs.sp++;
-        val = mem.readByte(regs.sp);
-        cycles += 4;
-
-        setByteReg(ins.target1, val);
-
-        // Update flags in case AF was loaded
-        regs.f = flags.flagsToByte();
-
-        done = true;
-
-        break;
-
-    } // END POP
-
-    // End Load Instructions //
-
-
-
-    // Arithmetic Instructions //
-
-    // ADD A,n
-    case 0xC6:
-    {
-        ins.mnemonic = "ADD";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        regs.pc++;
-        uint8_t val1 = mem.readByte(regs.pc);
-        cycles += 4;
-
-        uint8_t val2 = regs.a;
-
-        uint8_t sum = val1 + val2;
-
-        regs.a = sum;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = Util::checkHCAdd(val1, val2);
-        flags.carry = Util::checkOFAdd(val1, val2);
-
-        done = true;
-
-        break;
-    } // END ADD A,n
-
-    // CP A,n - Compares A with value in register 'r'. (SUB without changing A)
-    case 0xFE:
-    {
-        ins.mnemonic = "CP";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        regs.pc++;
-        uint8_t val = mem.readByte(regs.pc);
-        cycles += 4;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(regs.a, val);
-        flags.carry = Util::checkUFSub(regs.a, val);
-
-        done = true;
-
-        break;
-    } // END CP A,n
-
-    // ADD A,n - Add (immediate value 'n' + carry flag) to A
-    case 0xCE:
-    {
-        ins.mnemonic = "ADC";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t val1 = regs.a;
-        uint8_t val2 = mem.readByte(regs.pc) + flags.carry;
-        regs.pc++;
-        cycles += 4;
-
-        uint8_t sum = val1 + val2;
-
-        regs.a = sum;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCAdd(val1, val2);
-        flags.carry = Util::checkOFAdd(val1, val2);
-
-        done = true;
-
-        break;
-    } // END ADC A,n
-
-    // SBC A,n - Subtract (immediate value 'n' + carry flag) from A
-    case 0xDE:
-    {
-        ins.mnemonic = "SBC";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t val1 = regs.a;
-        uint8_t val2 = mem.readByte(regs.pc) + flags.carry;
-        regs.pc++;
-        cycles += 4;
-
-        uint8_t dif = val1 - val2;
-
-        regs.a = dif;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(val1, val2);
-        flags.carry = Util::checkUFSub(val1, val2);
-
-        done = true;
-
-        break;
-    } // END SBC A,n
-
-    // AND A,n
-    case 0xE6:
-    {
-        ins.mnemonic = "AND";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t val = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        regs.a &= val;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = true;
-        flags.carry = false;
-
-        done = true;
-
-        break;
-    } // END ADD A,n
-
-    // OR A,n
-    case 0xF6:
-    {
-        ins.mnemonic = "OR";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t val = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        regs.a |= val;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = true;
-        flags.carry = false;
-
-        done = true;
-
-        break;
-    } // END OR A,n
-
-    // XOR A,n
-    case 0xEE:
-    {
-        ins.mnemonic = "XOR";
-        ins.target1 = A;
-        ins.target2 = IMMEDIATE;
-
-        uint8_t val = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        regs.a ^= val;
-
-        flags.zero = (regs.a == 0);
-        flags.subtract = false;
-        flags.half_carry = true;
-        flags.carry = false;
-
-        done = true;
-
-        break;
-    } // END XOR A,n
-
-    // ADD HL,rr - To HL, add HL + 16-bit register
-    case 0x09: case 0x19: case 0x29: case 0x39:
-    {
-        ins.mnemonic = "ADD";
-
-        switch(opcode)
-        {
-            case 0x09: ins.target2 = BC; break;
-            case 0x19: ins.target2 = DE; break;
-            case 0x29: ins.target2 = HL; break;
-            case 0x39: ins.target2 = SP; break;
-            default: break;
-        }
-
-        uint16_t val1 = getShortReg(HL);
-        uint16_t val2 = getShortReg(ins.target2);
-
-        uint16_t sum = val1 + val2;
-
-        setShortReg(HL, sum);
-
-        // Flags are not set
-
-        done = true;
-
-        break;
-    } // END ADD HL,rr
-
-    // ADD SP,nn
-    case 0xE8:
-    {
-        ins.mnemonic = "ADD";
-        ins.target1 = SP;
-        ins.target2 = IMMEDIATE;
-
-        // Get Immediate value
-        byte lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-        byte msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint16_t val1 = regs.sp;
-        uint16_t val2 = Util::U8toU16(msb, lsb);
-
-        uint16_t sum = val1 + val2;
-
-        regs.sp = sum;
-
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = Util::checkHCAdd(val1 & 0xFF, val2 & 0xFF);
-        flags.carry = Util::checkOFAdd(val1, val2);
-
-        done = true;
-
-        break;
-    } // END ADD SP,nn
-
-    // INC r - Increment value in/at register 'r'
-    case 0x04: case 0x0C: case 0x14: case 0x1C: case 0x24: case 0x2C: case 0x34: case 0x3C:
-    {
-        ins.mnemonic = "INC";
-
-        // Middle 3 bits define Target 1
-        ins.target1 = toTarget((byte) ((opcode & 0b00111000) >> 3));
-
-        if (ins.target1 != HL) {
-            uint8_t sum = getByteReg(ins.target1);
-            sum++;
-            setByteReg(ins.target1, sum);
-
-            flags.zero = (sum == 0);
-            flags.subtract = false;
-            flags.half_carry = Util::checkHCAdd(sum, 1);
-
-        } else {
-
-            ins.t1_as_address = true;
-            uint8_t sum = mem.readByte(getShortReg(HL));
-            cycles += 4;
-
-            sum++;
-
-            mem.writeByte(getShortReg(HL), sum);
-            cycles += 4;
-
-            flags.zero = (sum == 0);
-            flags.subtract = false;
-            flags.half_carry = Util::checkHCAdd(sum, 1);
-            // Carry is unchanged
-        }
-
-        done = true;
-
-        break;
-    } // END INC r
-
-    // INC rr - Increment value in register 'rr'
-    case 0x03: case 0x13: case 0x23: case 0x33:
-    {
-        ins.mnemonic = "INC";
-
-        switch (opcode)
-        {
-            case 0x03: ins.target1 = BC; break;
-            case 0x13: ins.target1 = DE; break;
-            case 0x23: ins.target1 = HL; break;
-            case 0x33: ins.target1 = SP; break;
-            default: break;
-        }
-
-        uint16_t sum = getShortReg(ins.target1);
-        sum++;
-        setShortReg(ins.target1, sum);
-
-        // Flags are not set
-
-        done = true;
-
-        break;
-    } // END INC rr
-
-    // DEC r - Decrement value in/at register 'r'
-    case 0x05: case 0x0D: case 0x15: case 0x1D:
-    case 0x25: case 0x2D: case 0x35: case 0x3D:
-    {
-        ins.mnemonic = "DEC";
-
-        // Middle 3 bits define Target 1
-        ins.target1 = toTarget((byte) ((opcode & 0b00111000) >> 3));
-
-        uint8_t dif;
-        if (ins.target1 != HL) {
-            dif = getByteReg(ins.target1);
-            dif--;
-            setByteReg(ins.target1, dif);
-
-        } else {
-
-            ins.t1_as_address = true;
-            dif = mem.readByte(getShortReg(HL));
-            cycles += 4;
-
-            dif--;
-
-            mem.writeByte(getShortReg(HL), dif);
-            cycles += 4;
-        }
-
-        flags.zero = (dif == 0);
-        flags.subtract = true;
-        flags.half_carry = Util::checkHCSub(dif, 1);
-        // Carry is unchanged
-
-        done = true;
-
-        break;
-    } // END DEC r
-
-    // DEC rr
-    case 0x0B: case 0x1B: case 0x2B: case 0x3B:
-    {
-        ins.mnemonic = "DEC";
-
-        switch (opcode)
-        {
-            case 0x0B: ins.target1 = BC; break;
-            case 0x1B: ins.target1 = DE; break;
-            case 0x2B: ins.target1 = HL; break;
-            case 0x3B: ins.target1 = SP; break;
-            default: break;
-        }
-
-        uint16_t dif = getShortReg(ins.target1);
-        dif--;
-        setShortReg(ins.target1, dif);
-
-        // Flags are not set
-
-        done = true;
-
-        break;
-    } // END DEC rr
-
-    //DAA - Retroactively adjusts A to a valid BCD result. This means something, and does something.
-    case 0x27:
-    {
-        ins.mnemonic = "DAA";
-        ins.target1 = A;
-
-        // Taken from user AWJ @ https://forums.nesdev.org/viewtopic.php?t=15944
-        if (!flags.zero)
-        {  // after an addition, adjust if (half-)carry occurred or if result is out of bounds
-            if (flags.carry || regs.a > 0x99) { regs.a += 0x60; flags.carry = true; }
-            if (flags.half_carry || (regs.a & 0x0f) > 0x09) { regs.a += 0x6; }
-        } else
-        {  // after a subtraction, only adjust if (half-)carry occurred
-            if (flags.carry) { regs.a -= 0x60; }
-            if (flags.half_carry) { regs.a -= 0x60; }
-        }
-        // these flags are always updated
-        flags.zero = (regs.a == 0); // the usual z flag
-        flags.half_carry = false; // h flag is always cleared
-
-        done = true;
-
-        break;
-    } // END DAA
-
-        // CPL - Flip all bits in A
-    case 0x2F:
-    {
-        ins.mnemonic = "CPL";
-        ins.target1 = A;
-
-        regs.a = ~regs.a;
-
-        flags.subtract = true;
-        flags.half_carry = true;
-
-        done = true;
-
-        break;
-    } // END CPL
-
-    // End Arithmetic Instructions //
+    return cycles;
+}
 
+// RES b,r - Reset bit 'b' in register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::cbRES(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t bit = (OP >> 3) & 0b111;
+    constexpr uint8_t dst = OP & 0b111;
 
+    int cycles = 0;
+    uint8_t value = readR8<dst>(mem, cycles);
+    writeR8<dst>(mem, value & ~(1 << bit), cycles);
+    return cycles;
+}
 
-    // Control Instructions //
+// SET b,r - Set bit 'b' in register 'r'
+template<typename Accuracy>
+template<uint8_t OP>
+int CPU<Accuracy>::cbSET(Memory& mem, const Instruction& ins)
+{
+    constexpr uint8_t bit = (OP >> 3) & 0b111;
+    constexpr uint8_t dst = OP & 0b111;
 
-    //CCF - Flip Carry flag
-    case 0x3F:
-    {
-        ins.mnemonic = "CCF";
-        ins.target1 = F;
+    int cycles = 0;
+    uint8_t value = readR8<dst>(mem, cycles);
+    writeR8<dst>(mem, value | (1 << bit), cycles);
+    return cycles;
+}
 
-        flags.carry = !flags.carry;
+// End CB-prefixed Instructions //
 
-        done = true;
 
-        break;
-    } // END CCF
 
-        //SCF - Set Carry flag
-    case 0x37:
-    {
-        ins.mnemonic = "SCF";
-        ins.target1 = F;
 
-        flags.carry = true;
 
-        done = true;
+// Block Cache //
 
-        break;
-    } // END SCF
+// Returns true if an instruction always leaves the straight-line path, or
+// stops the CPU. Conditional jumps don't end a block, execute() notices when
+// they are taken.
+static constexpr bool endsBlock(uint8_t opcode)
+{
+    return opcode == 0xC3 || opcode == 0x18 || opcode == 0xCD // JP, JR, CALL
+        || opcode == 0xC9 || opcode == 0xD9 || opcode == 0xE9 // RET, RETI, JP HL
+        || (opcode & 0xC7) == 0xC7 // RST
+        || opcode == 0x76 || opcode == 0x10; // HALT, STOP
+}
 
-        // HALT
-    case 0x76:
-    {
-        ins.mnemonic = "HALT";
 
-        halted = true;
+// Finds or builds the block at PC, and starts following it. Returns its
+// first instruction, or nullptr if PC is not in cacheable memory.
+template<typename Accuracy>
+const CachedOp<Accuracy>* CPU<Accuracy>::enterBlock(Memory& mem)
+{
+    block_next = nullptr;
+    block_end = nullptr;
 
-        done = true;
+    if(!Cache::isCacheable(regs.pc)) { return nullptr; }
 
-        break;
-    } // END HALT
+    uint32_t key = Cache::makeKey(mem.getBank(regs.pc), regs.pc);
+    const Block<Accuracy>* block = block_cache.find(key);
+    if(!block) { block = buildBlock(mem, key); }
+    if(!block) { return nullptr; }
 
-    // STOP
-    case 0x10:
-    {
-        if(mem.readByte(regs.pc + 1) == 0)
-        {
-            ins.mnemonic = "STOP";
+    block_next = block->ops.data() + 1;
+    block_end = block->ops.data() + block->ops.size();
+    return block->ops.data();
+}
 
-            Program::setProgramState(Program::STOPPED);
 
-            done = true;
-        }
+// Decodes a block starting at the address in key, and caches it
+template<typename Accuracy>
+const Block<Accuracy>* CPU<Accuracy>::buildBlock(Memory& mem, uint32_t key)
+{
+    uint16_t start = key & 0xFFFF;
+    uint32_t region_end = Cache::regionEnd(start);
 
-        break;
-    } // END STOP
+    Block<Accuracy> block{key, static_cast<uint8_t>(start >> 8), 0, {}};
+    uint32_t address = start;
 
-    // DI - Disable Interrupts after next instruction is executed
-    case 0xF3:
+    while(block.ops.size() < Cache::MAX_BLOCK_OPS)
     {
-        ins.mnemonic = "DI";
-        next_interrupt_state = false;
+        Instruction ins = decode(mem, address);
 
-        done = true;
+        // An instruction running off the end of the region is decoded from
+        // memory every time
+        if(address + ins.length > region_end) { break; }
 
-        break;
-    } // END DI
+        block.ops.push_back({ op_table[ins.opcode], ins });
+        address += ins.length;
 
-    // EI - Enable Interrupts after next instruction is executed
-    case 0xFB:
-    {
-        ins.mnemonic = "EI";
-        next_interrupt_state = true;
-
-        done = true;
-
-        break;
-    } // END EI
+        if(endsBlock(ins.opcode)) { break; }
+    }
 
-    // End Control Instructions //
+    if(block.ops.empty()) { return nullptr; }
+    block.last_page = (address - 1) >> 8;
 
-    // JP nn,c - If condition met, jump to the immediate value 'nn'
-    case 0xC3: case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+    // Writes to RAM under the block must drop it
+    if(Cache::isWritable(start))
     {
-        ins.mnemonic = "JP";
-        ins.target1 = IMMEDIATE;
-
-        bool condition_met = true;
-
-        switch (opcode)
+        for(int page = block.first_page; page <= block.last_page; page++)
         {
-            case 0xC2: condition_met = !flags.zero; break;
-            case 0xCA: condition_met = flags.zero; break;
-            case 0xD2: condition_met = !flags.carry; break;
-            case 0xDA: condition_met = flags.carry; break;
-            default: break;
+            mem.watchPage(page);
         }
+    }
 
-        uint8_t lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-        uint8_t msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-
-        uint16_t  address = Util::U8toU16(msb, lsb);
-
-        if (condition_met) { regs.pc = address; }
-
-        done = true;
-
-        break;
-    } // END JP nn,c
+    return block_cache.insert(std::move(block));
+}
 
-    // JR n,c - If condition met, jump to PC + 'n'
-    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
-    {
-        ins.mnemonic = "JR";
-        ins.target1 = IMMEDIATE;
 
-        bool condition_met = true;
+// Drops cached blocks on a page that has been written
+template<typename Accuracy>
+void CPU<Accuracy>::pageWritten(uint8_t page)
+{
+    block_cache.invalidatePage(page);
+    block_next = nullptr;
+    block_end = nullptr;
+}
 
-        switch (opcode)
-        {
-            case 0x20: condition_met = !flags.zero; break;
-            case 0x28: condition_met = flags.zero; break;
-            case 0x30: condition_met = !flags.carry; break;
-            case 0x38: condition_met = flags.carry; break;
-            default: break;
-        }
 
-        uint16_t address = regs.pc;
+// Stops following the current block, which may have been switched out
+template<typename Accuracy>
+void CPU<Accuracy>::bankSwitched()
+{
+    block_next = nullptr;
+    block_end = nullptr;
 
-        address += Util::U8toS8(mem.readByte(regs.pc));
-        if (condition_met) { regs.pc = address; }
-        regs.pc++;
-        cycles += 4;
+#ifdef MOONGB_JIT
+    jit_context.exit = 1;
+#endif
+}
 
-        done = true;
+// End Block Cache //
 
-        break;
-    } // END JR n,c
 
-    // CALL - Push current PC onto stack, jump to address in immediate 16 bits
-    case 0xCD: case 0xC4: case 0xCC: case 0xD4: case 0xDC:
-    {
-        ins.mnemonic = "CALL";
-        ins.target1 = IMMEDIATE;
 
-        bool condition_met = true;
 
-        switch(opcode)
-        {
-            case 0xC4: condition_met = !flags.zero; break;
-            case 0xCC: condition_met = flags.zero; break;
-            case 0xD4: condition_met = !flags.carry; break;
-            case 0xDC: condition_met = flags.carry; break;
-            default: break;
-        }
 
-        // Get address from nn
-        uint8_t lsb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
-        uint8_t msb = mem.readByte(regs.pc);
-        regs.pc++;
-        cycles += 4;
+#ifdef MOONGB_JIT
+// Compiled Code //
 
-        uint16_t jump_address = Util::U8toU16(msb, lsb);
-
-        if(condition_met)
+// Runs compiled code from PC, chaining blocks until PC leaves compiled
+// ROM code, the clock reaches limit or the next deadline, or an idle loop
+// is found. The scheduler's clock is advanced as it goes. Returns the
+// number of instructions run, or 0 if PC isn't in compiled code.
+template<typename Accuracy>
+uint64_t CPU<Accuracy>::runCompiled(Memory& mem, Scheduler& scheduler, uint64_t limit)
+    requires (!Accuracy::TIMED_ACCESSES)
+{
+    // Compiled code doesn't fill the trace
+    if constexpr(TRACE_ENABLED) { return 0; }
+
+    jit_context = {
+        &regs, this, &mem,
+        scheduler.clockAddress(), scheduler.nextDeadlineAddress(), limit,
+        nullptr, 0, nullptr, 0
+    };
+
+    // Only ROM is compiled. Code in RAM can be rewritten under a block.
+    // Interrupt dispatch and the EI delay are left to execute().
+    while(!halted && !stopped && regs.pc <= 0x7FFF
+          && interrupts_enabled == next_interrupt_state
+          && !(interrupts_enabled && interrupts.pending()))
+    {
+        uint32_t key = Cache::makeKey(mem.getBank(regs.pc), regs.pc);
+
+        bool hot = false;
+        JIT::CompiledBlock compiled = jit.find(key, hot);
+        if(!compiled && hot)
         {
-            // Break PC into bytes
-            uint8_t pclsb = 0, pcmsb = 0;
-            Util::U16toU8(regs.pc, pclsb, pcmsb);
-
-            // Push MSB
-            regs.sp--;
-            mem.writeByte(regs.sp, pcmsb);
-            cycles += 4;
-
-            // Push LSB
-            regs.sp--;
-            mem.writeByte(regs.sp, pclsb);
-            cycles += 4;
-
-            // Jump to address
-            regs.pc = jump_address;
+            const Block<Accuracy>* block = block_cache.find(key);
+            if(!block) { block = buildBlock(mem, key); }
+            if(block) { compiled = jit.compile(*block); }
         }
-
-        done = true;
-
-        break;
-    } // END CALL
-
-    // RET - Pop from stack and jump to that address
-    case 0xC9: case 0xC0: case 0xC8: case 0xD0: case 0xD8:
-    {
-        ins.mnemonic = "RET";
-        ins.target1 = IMMEDIATE;
-
-        bool condition_met = true;
-
-        switch(opcode)
+        if(!compiled) { break; }
+
+        // Compiled code only has to watch for interrupts while IME is set
+        static constexpr uint8_t NO_INTERRUPTS = 0;
+        jit_context.interrupts = interrupts_enabled ? interrupts.pendingAddress()
+                                                    : &NO_INTERRUPTS;
+
+        uint64_t start = scheduler.now();
+        jit_context.exit = 0;
+        compiled(&jit_context);
+
+        // Compiled code exits right after a taken branch, so the bookkeeping
+        // execute() does per instruction only needs doing for the last one
+        lastInstruction = *jit_context.last;
+        loop_cycles += scheduler.now() - start;
+        if(backward_branch)
         {
-            case 0xC0: condition_met = !flags.zero; break;
-            case 0xC8: condition_met = flags.zero; break;
-            case 0xD0: condition_met = !flags.carry; break;
-            case 0xD8: condition_met = flags.carry; break;
-            default: break;
+            backward_branch = false;
+            checkIdleLoop(mem, lastInstruction);
         }
 
-        if(condition_met)
+        if(idle_period != 0 || jit_context.exit
+           || scheduler.now() >= std::min(scheduler.nextDeadline(), limit))
         {
-            // POP address
-            regs.sp++;
-            uint8_t lsb = mem.readByte(regs.sp);
-            cycles += 4;
-
-            regs.sp++;
-            uint8_t msb = mem.readByte(regs.sp);
-            cycles += 4;
-
-            uint16_t value = Util::U8toU16(msb, lsb);
-
-            // Jump to address
-            regs.pc = value;
+            break;
         }
+    }
 
-        done = true;
-
-        break;
-    } // END RET
-
-    // RETI - Pop from stack and jump to that address, then enable interrupts
-    case 0xD9:
-    {
-        ins.mnemonic = "RET";
-        ins.target1 = IMMEDIATE;
-
-        // POP address
-        regs.sp++;
-        uint8_t lsb = mem.readByte(regs.sp);
-        cycles += 4;
-
-        regs.sp++;
-        uint8_t msb = mem.readByte(regs.sp);
-        cycles += 4;
-
-        uint16_t value = Util::U8toU16(msb, lsb);
-
-        next_interrupt_state = true;
-
-        // Jump to address
-        regs.pc = value;
-
-        done = true;
-
-        break;
-
-    } // END RETI
-
-    // RST n - Push current address onto stack, jump to vector
-    case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
-    {
-        ins.mnemonic = "RST";
-
-        uint16_t vector;
-
-        // Get jump location
-        switch(opcode)
-        {
-            case 0xC7: vector = 0x00; break;
-            case 0xCF: vector = 0x08; break;
-            case 0xD7: vector = 0x10; break;
-            case 0xDF: vector = 0x18; break;
-            case 0xE7: vector = 0x20; break;
-            case 0xEF: vector = 0x28; break;
-            case 0xF7: vector = 0x30; break;
-            case 0xFF: vector = 0x38; break;
-            default: break;
-        } // END SWITCH
-
-        // Break PC into bytes
-        uint8_t lsb = 0, msb = 0;
-        Util::U16toU8(regs.pc, lsb, msb);
-
-        // Push MSB
-        regs.sp--;
-        mem.writeByte(regs.sp, msb);
-        cycles += 4;
-
-        // Push LSB
-        regs.sp--;
-        mem.writeByte(regs.sp, lsb);
-        cycles += 4;
-
-        // Jump to address
-        regs.pc = vector;
-
-        done = true;
-
-        break;
-
-    } // END RST n
-
-    // End Jump Instructions //
-
-
+    // The interpreter's place in its block is stale
+    block_next = nullptr;
+    block_end = nullptr;
 
-    // End Rotate and Shift Instructions //
+    return jit_context.instructions;
+}
 
-    // RLCA - Shift A left - MSB to Carry flag and LSB
-    case 0x07:
-    {
-        ins.mnemonic = "RLCA";
-        ins.target1 = A;
+// End Compiled Code //
+#endif
 
-        uint8_t value = regs.a;
 
-        bool old_msb = (value >> 7) & 1;
-        value = (value << 1) | old_msb;
-        flags.carry = old_msb;
-        regs.a = value;
 
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = false;
 
-        done = true;
 
-        break;
-    } // END RLCA
+// Idle Loop Detection //
 
-    // RRCA - Shift A right - old LSB to carry flag and MSB
-    case 0x0F:
+// Checks whether the backward jump just taken closes an idle loop
+template<typename Accuracy>
+void CPU<Accuracy>::checkIdleLoop(Memory& mem, const Instruction& ins)
+{
+    if(idle_tracking && ins.origin == idle_branch)
     {
-        ins.mnemonic = "RRCA";
-        ins.target1 = A;
-
-        uint8_t value = regs.a;
-
-        bool old_lsb = value & 1;
-        value = (value >> 1) | (old_lsb << 7);
-        flags.carry = old_lsb;
-        regs.a = value;
-
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = false;
+        if(!idle_candidate) { return; }
 
-        done = true;
+        // Nothing was written, so if the registers haven't changed either, the
+        // next iteration will do exactly the same
+        if(regs == idle_regs) { idle_period = loop_cycles; }
 
-        break;
-    } // END RRCA
-
-    // RLA - Shift A left - LSB to Carry flag, MSB to old Carry flag
-    case 0x17:
-    {
-        ins.mnemonic = "RLA";
-        ins.target1 = A;
-
-        uint8_t value = regs.a;
+    } else {
 
-        bool old_msb = (value >> 7) & 1;
-        value = (value << 1) | flags.carry;
-        flags.carry = old_msb;
-        regs.a = value;
+        idle_branch = ins.origin;
+        idle_tracking = true;
+        idle_period = 0;
+        idle_candidate = regs.pc <= ins.origin
+                      && ins.origin - regs.pc <= IDLE_LOOP_MAX_LENGTH
+                      && isIdleLoopBody(mem, regs.pc, ins.origin);
+    }
 
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = false;
+    idle_regs = regs;
+    loop_cycles = 0;
+}
 
-        done = true;
 
-        break;
-    } // END RLA
+// Returns true if the code from start up to end can't write to memory or
+// change control flow
+template<typename Accuracy>
+bool CPU<Accuracy>::isIdleLoopBody(Memory& mem, uint16_t start, uint16_t end)
+{
+    uint16_t address = start;
+    while(address < end)
+    {
+        Instruction ins = decode(mem, address);
+        uint8_t op = ins.opcode;
+
+        bool allowed =
+            op == 0x00 // NOP
+            || (op < 0x40 && (op & 0b111) == 0b110 && op != 0x36) // LD r,n
+            || (op < 0x40 && (op & 0b111) == 0b010 && (op & 0x08)) // LD A,(rr)
+            || (op < 0x40 && (op & 0b110) == 0b100 && op != 0x34 && op != 0x35) // INC/DEC r
+            || (op < 0x40 && (op & 0b111) == 0b011) // INC/DEC rr
+            || (op < 0x40 && (op & 0b111) == 0b111) // Rotate A, DAA, CPL, SCF, CCF
+            || (op >= 0x40 && op < 0x80 && (op & 0xF8) != 0x70) // LD r,r', not LD (HL),r or HALT
+            || (op >= 0x80 && op < 0xC0) // ALU A,r
+            || (op >= 0xC0 && (op & 0b111) == 0b110) // ALU A,n
+            || op == 0xF0 || op == 0xF2 || op == 0xFA // LDH A,(n), LD A,(C), LD A,(nn)
+            // CB ops on registers, and BIT on (HL)
+            || (op == 0xCB && ((ins.imm8() & 0b111) != 0b110
+                               || (ins.imm8() >= 0x40 && ins.imm8() < 0x80)));
+
+        if(!allowed) { return false; }
+
+        address += ins.length;
+    }
 
-    // RRA - Shift A right - LSB to Carry flag, MSB to old Carry flag
-    case 0x1F:
-    {
-        ins.mnemonic = "RRA";
-        ins.target1 = A;
+    return address == end;
+}
 
-        byte value = regs.a;
 
-        bool old_lsb = value & 1;
-        value = (value >> 1) | (flags.carry << 7);
-        flags.carry = old_lsb;
-        regs.a = value;
+// Forgets the idle loop, after it has been skipped or when memory may have
+// changed under it
+template<typename Accuracy>
+void CPU<Accuracy>::resetIdleLoop()
+{
+    idle_tracking = false;
+    idle_period = 0;
+}
 
-        flags.zero = false;
-        flags.subtract = false;
-        flags.half_carry = false;
+// End Idle Loop Detection //
 
-        done = true;
 
-        break;
-    } // END RRA
 
-    // End Rotate and Shift Instructions //
 
 
-    // End Jump Instructions //
+// Returns true if a STOP instruction has been executed
+template<typename Accuracy>
+bool CPU<Accuracy>::isStopped() const
+{
+    return stopped;
+}
 
-    default: break;
-    } // END THE BIG SWITCH
+// Gets the register state, for comparing against another CPU
+template<typename Accuracy>
+const RegisterSet& CPU<Accuracy>::getRegisters() const
+{
+    return regs;
+}
 
-    // Log stuff
-    if(!done)
-    {
-        log(format("CPU: Unhandled instruction: 0x{:02X} at ${:04X}!",
-                   opcode,
-                   ins.origin),
-            Logger::logDEBUG
-        );
+// Gets the last instruction executed
+template<typename Accuracy>
+const Instruction& CPU<Accuracy>::getLastInstruction() const
+{
+    return lastInstruction;
+}
 
-    } else {
-        log(format("CPU: Executed {:s}", insToString(ins)), Logger::logEXTREME);
-        log(format("CPU: New state: {:s}", regsToString(regs)), Logger::logEXTREME);
-    }
 
-    // Set up for next step
-    regs.f = flags.flagsToByte();
-    cycles += 4;
 
-    lastInstruction = ins;
+// Copies the registers, IME, and HALT/STOP in and out of a save state.
+// Loading drops the cached blocks, since RAM may now hold other code.
+template<typename Accuracy>
+void CPU<Accuracy>::saveState(StateWriter& writer) const
+{
+    writer.write(regs);
+    writer.write(lastInstruction);
+    writer.write(halted);
+    writer.write(stopped);
+    writer.write(interrupts_enabled);
+    writer.write(next_interrupt_state);
+}
 
-    return cycles;
+template<typename Accuracy>
+void CPU<Accuracy>::loadState(StateReader& reader)
+{
+    reader.read(regs);
+    reader.read(lastInstruction);
+    reader.read(halted);
+    reader.read(stopped);
+    reader.read(interrupts_enabled);
+    reader.read(next_interrupt_state);
+
+    // Compiled code is only made from ROM, which can't have changed, so it
+    // is kept
+    block_cache.clear();
+    block_next = nullptr;
+    block_end = nullptr;
+    backward_branch = false;
+    resetIdleLoop();
 }
 
 
+
 // Logs CPU information
-void CPU::dumpCPU()
+template<typename Accuracy>
+void CPU<Accuracy>::dumpCPU()
 {
     log("--BEGIN CPU DUMP--", Logger::logDEBUG);
     log(format("Register State: {:s}", regsToString(regs)), Logger::logDEBUG);
     log(format("Last Instruction: {:s}", insToString(lastInstruction)),
         Logger::logDEBUG
     );
+    if constexpr(TRACE_ENABLED) { trace.dumpTrace(); }
     log("--END CPU DUMP--", Logger::logDEBUG);
-}
\ No newline at end of file
+}
+
+template class CPU<FastAccuracy>;
+template class CPU<CycleAccuracy>;
@@ -3,165 +3,243 @@
 #include "../core.hpp"
 #include "gbdefs.hpp"
 #include "memory.hpp"
-#include "../program/program.hpp"
-
-class CPU
+#include "trace.hpp"
+#include "blockcache.hpp"
+#include "jit.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+#include "accuracy.hpp"
+#include "savestate.hpp"
+#include <utility>
+#include <type_traits>
+#include <variant>
+
+// The SM83 core. Accuracy decides whether memory accesses are timed, see
+// accuracy.hpp.
+template<typename Accuracy>
+class CPU : public CodeWatcher
 {
 public:
-    CPU();
+    CPU(InterruptController& _interrupts);
     ~CPU();
 
+    // Sets what timed memory accesses bring up to date. Must be set before
+    // executing with CycleAccuracy.
+    void setBusClock(BusClock* clock);
+
     // Initializes the CPU registers, using memory to fake the post-BIOS state
     void initCPU(Memory& mem);
 
-    // Pulls the instruction from the program counter, and executes it.
-    // Returns the number of cycles used.
+    // Dispatches a pending interrupt if IME is set, otherwise pulls the
+    // instruction from the program counter and executes it. Returns the
+    // number of cycles used, or 0 if the CPU is halted and no interrupt is
+    // pending. Time can then skip to the next event.
     int execute(Memory& mem);
 
-    // Gets a byte from an 8-bit register
-    inline uint8_t getByteReg(TargetID target) const;
-    // Sets an 8-bit register to a value
-    inline void setByteReg(TargetID target, uint8_t value);
-    // Gets a short from a 16-bit register
-    inline uint16_t getShortReg(TargetID target) const;
-    // Sets a 16-bit register to a value
-    inline void setShortReg(TargetID target, uint16_t value);
+    // Reads the instruction at address, along with its operand bytes
+    Instruction decode(Memory& mem, uint16_t address);
+
+    // Drops cached blocks on a page that has been written
+    void pageWritten(uint8_t page) override;
+    // Stops following the current block, which may have been switched out
+    void bankSwitched() override;
+
+#ifdef MOONGB_JIT
+    // Runs compiled code from PC, chaining blocks until PC leaves compiled
+    // ROM code, the clock reaches limit or the next deadline, or an idle loop
+    // is found. The scheduler's clock is advanced as it goes. Returns the
+    // number of instructions run, or 0 if PC isn't in compiled code. Compiled
+    // code can't time accesses, so only the FastAccuracy core has this.
+    uint64_t runCompiled(Memory& mem, Scheduler& scheduler, uint64_t limit)
+        requires (!Accuracy::TIMED_ACCESSES);
+#endif
+
+    // Returns true if a STOP instruction has been executed
+    bool isStopped() const;
+    // Gets the register state, for comparing against another CPU
+    const RegisterSet& getRegisters() const;
+    // Gets the last instruction executed
+    const Instruction& getLastInstruction() const;
+
+    // Copies the registers, IME, and HALT/STOP in and out of a save state.
+    // Loading drops the cached blocks, since RAM may now hold other code.
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
 
     // Logs CPU information
     void dumpCPU();
 
+    // Cycles per iteration if the CPU has been found spinning in an idle loop,
+    // or 0. Checked after every instruction, so it is defined here.
+    int getIdlePeriod() const { return idle_period; }
+    // Forgets the idle loop, after it has been skipped or when memory may have
+    // changed under it
+    void resetIdleLoop();
+
 private:
     RegisterSet regs{};
-    FlagRegister flags{};
 
-    Instruction lastInstruction;
+    Instruction lastInstruction{};
+    // Only takes up space when built with MOONGB_TRACE
+    [[no_unique_address]]
+    std::conditional_t<TRACE_ENABLED, TraceBuffer, EmptyTraceBuffer> trace;
+
+    InterruptController& interrupts;
 
     bool halted = false;
+    bool stopped = false;
+    // IME. EI sets next_interrupt_state, which is copied into IME after the
+    // following instruction's interrupt check. DI and RETI set both.
     bool interrupts_enabled = false;
     bool next_interrupt_state = false;
 
-    // Converts a 3-bit ID to a TargetID
-    inline static TargetID toTarget(uint8_t id);
-    // Converts a BIT target to a TargetID
-    inline static TargetID toBITTarget(uint8_t bit);
+    // Pushes PC and jumps to the vector of the highest priority pending
+    // interrupt. Returns the number of cycles used.
+    int dispatchInterrupt(Memory& mem);
+
+    // Idle loop detection. A short backward branch over a body that can't
+    // write to memory is a candidate. If the registers are the same every time
+    // the branch is taken, the loop will spin until an event changes what it
+    // reads.
+    static constexpr uint16_t IDLE_LOOP_MAX_LENGTH = 16;
+    bool backward_branch = false; // Set by jumps, checked after the instruction
+    bool idle_candidate = false;
+    bool idle_tracking = false; // idle_branch and idle_regs are set
+    uint16_t idle_branch = 0; // Address of the jump that closes the loop
+    RegisterSet idle_regs{}; // Registers when the jump was last taken
+    int loop_cycles = 0; // Cycles since the jump was last taken
+    int idle_period = 0;
+
+    // Checks whether the backward jump just taken closes an idle loop
+    void checkIdleLoop(Memory& mem, const Instruction& ins);
+    // Returns true if the code from start up to end can't write to memory or
+    // change control flow
+    bool isIdleLoopBody(Memory& mem, uint16_t start, uint16_t end);
+
+    // Decoded blocks. execute() follows the current block while PC stays on
+    // it, from block_next up to block_end.
+    using Cache = BlockCache<Accuracy>;
+    Cache block_cache;
+    const CachedOp<Accuracy>* block_next = nullptr;
+    const CachedOp<Accuracy>* block_end = nullptr;
+
+    // Finds or builds the block at PC, and starts following it. Returns its
+    // first instruction, or nullptr if PC is not in cacheable memory.
+    const CachedOp<Accuracy>* enterBlock(Memory& mem);
+    // Decodes a block starting at the address in key, and caches it
+    const Block<Accuracy>* buildBlock(Memory& mem, uint32_t key);
+
+#ifdef MOONGB_JIT
+    // The code buffer is only allocated for the core that can use it
+    [[no_unique_address]]
+    std::conditional_t<Accuracy::TIMED_ACCESSES, std::monostate, JIT> jit;
+    JIT::Context jit_context{};
+#endif
+
+    // Timed accesses. access_cycles is how far into the current instruction
+    // the last access ended. Unused with FastAccuracy.
+    BusClock* bus_clock = nullptr;
+    int access_cycles = 0;
+
+    // Dispatch tables indexed by opcode, built at compile time
+    static const std::array<OpHandler<Accuracy>, 256> op_table;
+    static const std::array<OpHandler<Accuracy>, 256> cb_table;
+
+    template<size_t... OPS>
+    static constexpr std::array<OpHandler<Accuracy>, 256> makeOpTable(std::index_sequence<OPS...>);
+    template<size_t... OPS>
+    static constexpr std::array<OpHandler<Accuracy>, 256> makeCBTable(std::index_sequence<OPS...>);
+
+    // Selects the handler for an opcode at compile time
+    template<uint8_t OP> int decodeOp(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int decodeCB(Memory& mem, const Instruction& ins);
+
+    // Operand helpers //
+
+    // Reads a byte for an instruction. Timed, it takes the next M-cycle.
+    inline uint8_t busRead(Memory& mem, uint16_t address);
+    // Writes a byte for an instruction. Timed, it takes the next M-cycle.
+    inline void busWrite(Memory& mem, uint16_t address, uint8_t data);
+    // Passes an M-cycle without an access, before a later timed access
+    inline void busIdle();
+    // Pushes a short onto the stack
+    inline void pushShort(Memory& mem, uint16_t value, int& cycles);
+    // Pops a short off of the stack
+    inline uint16_t popShort(Memory& mem, int& cycles);
+    // Reads the operand for a 3-bit register ID, where ID 6 is the byte at $HL
+    template<uint8_t ID> uint8_t readR8(Memory& mem, int& cycles);
+    // Writes the operand for a 3-bit register ID, where ID 6 is the byte at $HL
+    template<uint8_t ID> void writeR8(Memory& mem, uint8_t value, int& cycles);
+    // Reads a pair for a 2-bit pair ID: BC DE HL SP
+    template<uint8_t ID> uint16_t readR16() const;
+    // Writes a pair for a 2-bit pair ID: BC DE HL SP
+    template<uint8_t ID> void writeR16(uint16_t value);
+    // Checks a branch condition. 0-3 are NZ, Z, NC, C. 4 is always true.
+    template<uint8_t CC> bool checkCondition() const;
+    // Performs an 8-bit ALU operation on A. 0-7 are ADD ADC SUB SBC AND XOR OR CP
+    template<uint8_t OPER> void alu(uint8_t value);
+    // Performs a rotate/shift. 0-7 are RLC RRC RL RR SLA SRA SWAP SRL
+    template<uint8_t OPER> uint8_t rotate(uint8_t value);
+
+    // Opcode handlers //
+
+    // Load Instructions
+    template<uint8_t OP> int opLDrr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opLDrn(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opLDrrnn(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opLDindA(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opLDAind(Memory& mem, const Instruction& ins);
+    int opLDnnSP(Memory& mem, const Instruction& ins);
+    int opLDHnA(Memory& mem, const Instruction& ins);
+    int opLDHAn(Memory& mem, const Instruction& ins);
+    int opLDHCA(Memory& mem, const Instruction& ins);
+    int opLDHAC(Memory& mem, const Instruction& ins);
+    int opLDnnA(Memory& mem, const Instruction& ins);
+    int opLDAnn(Memory& mem, const Instruction& ins);
+    int opLDSPHL(Memory& mem, const Instruction& ins);
+    int opLDHLSPe(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opPUSH(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opPOP(Memory& mem, const Instruction& ins);
+
+    // Arithmetic Instructions
+    template<uint8_t OP> int opALUr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opALUn(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opINCr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opDECr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opINCrr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opDECrr(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opADDHLrr(Memory& mem, const Instruction& ins);
+    int opADDSPe(Memory& mem, const Instruction& ins);
+    int opDAA(Memory& mem, const Instruction& ins);
+    int opCPL(Memory& mem, const Instruction& ins);
+
+    // Rotate and Shift Instructions
+    template<uint8_t OP> int opRotA(Memory& mem, const Instruction& ins);
+
+    // Control Instructions
+    int opNOP(Memory& mem, const Instruction& ins);
+    int opSCF(Memory& mem, const Instruction& ins);
+    int opCCF(Memory& mem, const Instruction& ins);
+    int opHALT(Memory& mem, const Instruction& ins);
+    int opSTOP(Memory& mem, const Instruction& ins);
+    int opDI(Memory& mem, const Instruction& ins);
+    int opEI(Memory& mem, const Instruction& ins);
+    int opCB(Memory& mem, const Instruction& ins);
+    int opIllegal(Memory& mem, const Instruction& ins);
+
+    // Jump Instructions
+    template<uint8_t OP> int opJP(Memory& mem, const Instruction& ins);
+    int opJPHL(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opJR(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opCALL(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opRETcc(Memory& mem, const Instruction& ins);
+    int opRET(Memory& mem, const Instruction& ins);
+    int opRETI(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int opRST(Memory& mem, const Instruction& ins);
+
+    // CB-prefixed Instructions
+    template<uint8_t OP> int cbRotate(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int cbBIT(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int cbRES(Memory& mem, const Instruction& ins);
+    template<uint8_t OP> int cbSET(Memory& mem, const Instruction& ins);
 };
-
-
-
-TargetID CPU::toTarget(uint8_t id)
-{
-    // 111 = RegA // 000 = RegB // 001 = RegC // 010 = RegD
-    // 011 = RegE // 100 = RegH // 101 = RegL // 110 = (HL)
-    switch (id & 0b00000111)
-    {
-        case 0b111: return A;
-        case 0b000: return B;
-        case 0b001: return C;
-        case 0b010: return D;
-        case 0b011: return E;
-        case 0b100: return H;
-        case 0b101: return L;
-        case 0b110: return HL;
-    }
-    return NOTARGET; // Should be impossible, but just in case.
-}
-
-TargetID CPU::toBITTarget(uint8_t bit)
-{
-    switch(bit & 0b00000111)
-    {
-        case 0b000: return BIT0;
-        case 0b001: return BIT1;
-        case 0b010: return BIT2;
-        case 0b011: return BIT3;
-        case 0b100: return BIT4;
-        case 0b101: return BIT5;
-        case 0b110: return BIT6;
-        case 0b111: return BIT7;
-    }
-    return NOTARGET; // Should be impossible, but just in case
-}
-
-// Gets a byte from an 8-bit register
-uint8_t CPU::getByteReg(TargetID target) const
-{
-    switch(target)
-    {
-    case A: return regs.a;
-    case F: return regs.f;
-    case B: return regs.b;
-    case C: return regs.c;
-    case D: return regs.d;
-    case E: return regs.e;
-    case H: return regs.h;
-    case L: return regs.l;
-    default:
-    {
-        throw std::invalid_argument(
-            "Attempted read of invalid target in getByteReg()"
-        );
-    }
-    }
-}
-
-// Sets an 8-bit register to a value
-void CPU::setByteReg(TargetID target, uint8_t value)
-{
-    switch(target)
-    {
-    case A: regs.a = value; return;
-    case F: regs.f = value; return;
-    case B: regs.b = value; return;
-    case C: regs.c = value; return;
-    case D: regs.d = value; return;
-    case E: regs.e = value; return;
-    case H: regs.h = value; return;
-    case L: regs.l = value; return;
-    default:
-    {
-        throw std::invalid_argument(
-            "Attempted write of invalid target in setByteReg()"
-        );
-    }
-    }
-}
-
-// Gets a short from a 16-bit register
-uint16_t CPU::getShortReg(TargetID target) const
-{
-    switch(target)
-    {
-    case AF: return Util::U8toU16(regs.a, regs.f);
-    case BC: return Util::U8toU16(regs.b, regs.c);
-    case DE: return Util::U8toU16(regs.d, regs.e);
-    case HL: return Util::U8toU16(regs.h, regs.l);
-    case SP: return regs.sp;
-    case PC: return regs.pc;
-    default:
-    {
-        throw std::invalid_argument(
-                "Attempted read of invalid target in getShortReg()"
-        );
-    }
-    }
-}
-
-// Sets a 16-bit register to a value
-void CPU::setShortReg(TargetID target, uint16_t value)
-{
-    switch(target)
-    {
-    case AF: Util::U16toU8(value, regs.a, regs.f); break;
-    case BC: Util::U16toU8(value, regs.b, regs.c); break;
-    case DE: Util::U16toU8(value, regs.d, regs.e); break;
-    case HL: Util::U16toU8(value, regs.h, regs.l); break;
-    case SP: regs.sp = value; break;
-    case PC: regs.pc = value; break;
-    default:
-    {
-        throw std::invalid_argument(
-            "Attempted write of invalid target in setShortReg()"
-        );
-    }
-    }
-}
\ No newline at end of file
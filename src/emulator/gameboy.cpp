@@ -1,54 +1,447 @@
 #include "gameboy.hpp"
+#include <algorithm>
 
-using Logger::log, std::string;
+using Logger::log, std::string, fmt::format;
 
 // Caller should catch std::invalid_argument and std::runtime_exception
-Gameboy::Gameboy(const string& _rom_file_path)
+template<typename Accuracy>
+Gameboy<Accuracy>::Gameboy(const string& _rom_file_path) : Gameboy(_rom_file_path, false) {}
+
+// Loads the system. A read-only save is loaded, but never written back.
+template<typename Accuracy>
+Gameboy<Accuracy>::Gameboy(const string& _rom_file_path, bool read_only_save)
 {
-    cycles_per_frame = 70256;
-    cycle = 0;
+    // 154 scanlines of 456 cycles
+    cycles_per_frame = 70224;
+    frame_start = 0;
 
     log("SYSTEM: Begin loading ROM from: " + _rom_file_path, Logger::logDEBUG);
 
     rom_file_path = _rom_file_path;
     cart.initCartridge(rom_file_path);
-    cart.loadCartridge(mem);
+    cart.loadCartridge(mem, read_only_save);
+    // DMA ($FF46) is not handled by the PPU
+    mem.mapIO(0xFF40, 0xFF45, &ppu);
+    mem.mapIO(0xFF47, 0xFF4B, &ppu);
+    mem.mapIO(0xFF04, 0xFF07, &timer);
+    mem.mapIO(0xFF0F, 0xFF0F, &interrupts);
+    mem.mapIO(0xFFFF, 0xFFFF, &interrupts);
+    mem.setCodeWatcher(&cpu);
+    cpu.setBusClock(this);
     cpu.initCPU(mem);
     game_title = cart.getGameTitle();
 
+    std::vector<uint8_t> state;
+    saveState(state);
+    state_size = state.size();
+
     log("SYSTEM: Successfully loaded " + game_title, Logger::logDEBUG);
 }
 
-Gameboy::~Gameboy() = default;
+template<typename Accuracy>
+Gameboy<Accuracy>::~Gameboy() = default;
 
 
 
 // Steps the components by one CPU instruction
-void Gameboy::step()
+template<typename Accuracy>
+void Gameboy<Accuracy>::step()
 {
+    if constexpr(Accuracy::TIMED_ACCESSES) { instruction_start = scheduler.now(); }
     int cycles = cpu.execute(mem);
-    ppu.step(cycles, mem);
-    cycle += cycles;
+
+    if(cycles != 0)
+    {
+        finishInstruction(cycles);
+        instruction_count++;
+    } else {
+        // Halted, only an event can wake the CPU
+        uint64_t deadline = scheduler.nextDeadline();
+        scheduler.advance(deadline == Scheduler::NEVER ? 4 : deadline - scheduler.now());
+    }
+
+    runEvents();
 }
 
 
 
-string Gameboy::getRomFilePath() const { return rom_file_path; }
-string Gameboy::getGameTitle() const { return game_title; }
-int Gameboy::getCycle() const { return cycle; }
-int Gameboy::getCyclesPerFrame() const { return cycles_per_frame; }
+// Steps the components until a full frame has been emulated
+template<typename Accuracy>
+void Gameboy<Accuracy>::runFrame()
+{
+    uint64_t frame_end = frame_start + cycles_per_frame;
+
+    while(scheduler.now() < frame_end && !cpu.isStopped())
+    {
+        // Components only need attention at their deadlines. An instruction
+        // can schedule an earlier one, so the deadline is checked every time.
+        uint64_t deadline;
+        while(scheduler.now() < (deadline = std::min(scheduler.nextDeadline(), frame_end))
+           && !cpu.isStopped())
+        {
+#ifdef MOONGB_JIT
+            // Compiled code runs up to the deadline by itself, and returns 0
+            // when PC isn't in compiled code. Only the fast core has it.
+            if constexpr(!Accuracy::TIMED_ACCESSES)
+            {
+                if(jit_mode != JITMode::OFF)
+                {
+                    uint64_t instructions = cpu.runCompiled(mem, scheduler, frame_end);
+                    if(instructions != 0)
+                    {
+                        instruction_count += instructions;
+                        if(shadow) { checkShadow(); }
+
+                        // The code run may have moved the deadline
+                        if(cpu.getIdlePeriod() != 0)
+                        {
+                            skipIdleLoop(std::min(scheduler.nextDeadline(), frame_end));
+                        }
+                        continue;
+                    }
+                }
+            }
+#endif
 
-void Gameboy::resetCycle()
+            if constexpr(Accuracy::TIMED_ACCESSES) { instruction_start = scheduler.now(); }
+            int cycles = cpu.execute(mem);
+
+            // A halted CPU waits for an interrupt, and only events can request
+            // one. Skip straight to the next event.
+            if(cycles == 0)
+            {
+                scheduler.advance(deadline - scheduler.now());
+                break;
+            }
+
+            finishInstruction(cycles);
+            instruction_count++;
+
+            if(cpu.getIdlePeriod() != 0) { skipIdleLoop(deadline); }
+        }
+
+        runEvents();
+    }
+    resetCycle();
+
+    // Keep the .sav file close to the game's state, in case of a crash
+    frames_since_flush++;
+    if(frames_since_flush >= SAV_FLUSH_INTERVAL)
+    {
+        mem.flushERAM();
+        frames_since_flush = 0;
+    }
+}
+
+
+
+// Fires the events that are due, catching up the components that own them
+template<typename Accuracy>
+void Gameboy<Accuracy>::runEvents()
+{
+    EventType type;
+    while(scheduler.popDue(type))
+    {
+        // Whatever an idle loop was polling may have changed
+        cpu.resetIdleLoop();
+
+        switch(type)
+        {
+            case EventType::PPU: ppu.update(mem); break;
+            case EventType::TIMER: timer.update(); break;
+            default: break;
+        }
+    }
+}
+
+
+
+// Skips whole iterations of the CPU's idle loop, stopping short of limit
+template<typename Accuracy>
+void Gameboy<Accuracy>::skipIdleLoop(uint64_t limit)
 {
-    cycle -= cycles_per_frame;
-    if(cycle < 0) { cycle = 0; }
+    uint64_t period = cpu.getIdlePeriod();
+    cpu.resetIdleLoop();
+
+    // DIV and TIMA change without an event, so a loop polling them has to
+    // see each change
+    limit = std::min(limit, timer.takePolledChange());
+
+    // The loop only reads memory, which can't change before the next event.
+    // Running the last iteration normally lets it see the event's changes
+    // at the same cycle it would have otherwise.
+    if(scheduler.now() >= limit) { return; }
+
+    uint64_t skipped = (limit - scheduler.now() - 1) / period * period;
+    scheduler.advance(skipped);
+    idle_cycles_skipped += skipped;
 }
 
+
+
+// Brings the system up to a timed memory access
+template<typename Accuracy>
+void Gameboy<Accuracy>::catchUp(int cycles)
+{
+    scheduler.advance(instruction_start + cycles - scheduler.now());
+    runEvents();
+}
+
+
+// Advances the clock to the end of an instruction. Timed accesses will have
+// moved it part of the way already.
+template<typename Accuracy>
+void Gameboy<Accuracy>::finishInstruction(int cycles)
+{
+    if constexpr(Accuracy::TIMED_ACCESSES)
+    {
+        scheduler.advance(instruction_start + cycles - scheduler.now());
+    } else {
+        scheduler.advance(cycles);
+    }
+}
+
+
+
+// Sets how the CPU runs code. Returns false if built without MOONGB_JIT,
+// if DIFFERENTIAL is set after the system has started running, or if the
+// system times memory accesses.
+template<typename Accuracy>
+bool Gameboy<Accuracy>::setJITMode(JITMode mode)
+{
+    if(Accuracy::TIMED_ACCESSES && mode != JITMode::OFF)
+    {
+        log("SYSTEM: Compiled code can't time memory accesses, only the "
+            "interpreter can be used.", Logger::logERROR);
+        return false;
+    }
+
+#ifdef MOONGB_JIT
+    if(mode == JITMode::DIFFERENTIAL && !shadow)
+    {
+        // The copy has to start from the same state
+        if(scheduler.now() != 0)
+        {
+            log("SYSTEM: Differential mode must be set before running!",
+                Logger::logERROR);
+            return false;
+        }
+
+        shadow = std::unique_ptr<Gameboy>(new Gameboy(rom_file_path, true));
+    }
+
+    if(mode != JITMode::DIFFERENTIAL) { shadow.reset(); }
+    jit_mode = mode;
+    return true;
+#else
+    if(mode == JITMode::OFF) { return true; }
+
+    log("SYSTEM: Built without MOONGB_JIT, only the interpreter can be used.",
+        Logger::logERROR);
+    return false;
+#endif
+}
+
+
+// Steps the shadow up to this system's clock, and compares the CPUs
+template<typename Accuracy>
+void Gameboy<Accuracy>::checkShadow()
+{
+    // Mirrors runFrame(), which fires due events before each instruction
+    while(shadow->scheduler.now() < scheduler.now() && !shadow->isStopped())
+    {
+        shadow->runEvents();
+        shadow->step();
+    }
+
+    if(shadow->scheduler.now() == scheduler.now()
+       && shadow->cpu.getRegisters() == cpu.getRegisters())
+    {
+        return;
+    }
+
+    jit_mismatches++;
+    log(format("SYSTEM: Compiled code disagrees with the interpreter after {:s}. "
+               "Compiled: {:s} at cycle {:d} | Interpreted: {:s} at cycle {:d}",
+               insToString(cpu.getLastInstruction()),
+               regsToString(cpu.getRegisters()), scheduler.now(),
+               regsToString(shadow->cpu.getRegisters()), shadow->scheduler.now()),
+        Logger::logERROR);
+
+    // Every later comparison would fail too
+    shadow.reset();
+    jit_mode = JITMode::ON;
+}
+
+
+
+// Returns true if the CPU has executed a STOP instruction
+template<typename Accuracy>
+bool Gameboy<Accuracy>::isStopped() const
+{
+    return cpu.isStopped();
+}
+
+
+
+// Gets the last frame drawn by the PPU
+template<typename Accuracy>
+const FrameBuffer& Gameboy<Accuracy>::getFrameBuffer() const
+{
+    return ppu.getFrameBuffer();
+}
+
+
+
+template<typename Accuracy> string Gameboy<Accuracy>::getRomFilePath() const { return rom_file_path; }
+template<typename Accuracy> string Gameboy<Accuracy>::getGameTitle() const { return game_title; }
+template<typename Accuracy> int Gameboy<Accuracy>::getCycle() const { return static_cast<int>(scheduler.now() - frame_start); }
+template<typename Accuracy> int Gameboy<Accuracy>::getCyclesPerFrame() const { return cycles_per_frame; }
+template<typename Accuracy> uint64_t Gameboy<Accuracy>::getInstructionCount() const { return instruction_count; }
+template<typename Accuracy> uint64_t Gameboy<Accuracy>::getTotalCycles() const { return scheduler.now(); }
+template<typename Accuracy> uint64_t Gameboy<Accuracy>::getIdleCyclesSkipped() const { return idle_cycles_skipped; }
+template<typename Accuracy> uint64_t Gameboy<Accuracy>::getJITMismatches() const { return jit_mismatches; }
+
+template<typename Accuracy>
+void Gameboy<Accuracy>::resetCycle()
+{
+    // Cycles past the end of the frame count towards the next one
+    frame_start = std::min(frame_start + cycles_per_frame, scheduler.now());
+}
+
+// Snapshots the whole system into state, replacing its contents. Passing
+// the same vector every time reuses its allocation.
+template<typename Accuracy>
+void Gameboy<Accuracy>::saveState(std::vector<uint8_t>& state) const
+{
+    state.clear();
+    StateWriter writer(state);
+
+    writer.write(SAVE_STATE_MAGIC);
+    writer.write(SAVE_STATE_VERSION);
+    writer.write(cart.getChecksum());
+    // The total size is filled in once everything has been written
+    size_t size_offset = state.size();
+    writer.write(uint32_t{0});
+
+    writeComponents(writer);
+
+    uint32_t size = state.size();
+    std::memcpy(state.data() + size_offset, &size, sizeof(size));
+}
+
+
+// Restores a state saved from the same ROM, by either accuracy policy.
+// Returns false, leaving the system as it was, if the state is for another
+// ROM or version, or is corrupt. The battery save on disk isn't changed until
+// the game writes to cartridge RAM.
+template<typename Accuracy>
+bool Gameboy<Accuracy>::loadState(const std::vector<uint8_t>& state)
+{
+    StateReader reader(state);
+
+    // The header is checked before anything is changed. The rest of a state
+    // of the right size can't run out part way through, but can hold an
+    // invalid flag or mode.
+    try {
+        std::array<char, 4> magic;
+        uint32_t version, size;
+        uint16_t checksum;
+        reader.read(magic);
+        reader.read(version);
+        reader.read(checksum);
+        reader.read(size);
+
+        if(magic != SAVE_STATE_MAGIC || size != state.size())
+        {
+            log("SYSTEM: Not a save state, or the state is corrupt!", Logger::logERROR);
+            return false;
+        }
+        if(version != SAVE_STATE_VERSION)
+        {
+            log(format("SYSTEM: Save state is from version {:d}, expected {:d}!",
+                       version, SAVE_STATE_VERSION),
+                Logger::logERROR);
+            return false;
+        }
+        if(checksum != cart.getChecksum() || size != state_size)
+        {
+            log("SYSTEM: Save state is for a different ROM!", Logger::logERROR);
+            return false;
+        }
+
+    } catch(std::out_of_range& ex) {
+        log(format("SYSTEM: Could not load save state: {:s}", ex.what()),
+            Logger::logERROR);
+        return false;
+    }
+
+    // Kept to put back if a field turns out to be corrupt
+    undo_state.clear();
+    StateWriter undo_writer(undo_state);
+    writeComponents(undo_writer);
+
+    try {
+        readComponents(reader);
+
+    } catch(std::out_of_range& ex) {
+        log(format("SYSTEM: Could not load save state: {:s}", ex.what()),
+            Logger::logERROR);
+
+        StateReader undo_reader(undo_state);
+        readComponents(undo_reader);
+        return false;
+    }
+
+    instruction_start = scheduler.now();
+
+    // The interpreter-only copy has to follow
+    if(shadow) { shadow->loadState(state); }
+
+    return true;
+}
+
+
+// Copies every component in and out of a state, after the header
+template<typename Accuracy>
+void Gameboy<Accuracy>::writeComponents(StateWriter& writer) const
+{
+    writer.write(frame_start);
+    scheduler.saveState(writer);
+    interrupts.saveState(writer);
+    cpu.saveState(writer);
+    ppu.saveState(writer);
+    timer.saveState(writer);
+    mem.saveState(writer);
+    cart.saveState(writer);
+}
+
+template<typename Accuracy>
+void Gameboy<Accuracy>::readComponents(StateReader& reader)
+{
+    reader.read(frame_start);
+    scheduler.loadState(reader);
+    interrupts.loadState(reader);
+    cpu.loadState(reader);
+    ppu.loadState(reader);
+    timer.loadState(reader);
+    mem.loadState(reader);
+    cart.loadState(reader);
+}
+
+
+
 // Dumps emulated system info to the log
-void Gameboy::dumpSystem()
+template<typename Accuracy>
+void Gameboy<Accuracy>::dumpSystem()
 {
     cpu.dumpCPU();
+    interrupts.dumpInterrupts();
     ppu.dumpPPU();
+    timer.dumpTimer();
     cart.dumpCartridge();
     mem.dumpMemory();
-}
\ No newline at end of file
+}
+
+template class Gameboy<FastAccuracy>;
+template class Gameboy<CycleAccuracy>;
@@ -6,36 +6,164 @@
 #include "memory.hpp"
 #include "ppu.hpp"
 #include "cartridge.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+#include "timer.hpp"
+#include "accuracy.hpp"
+#include "savestate.hpp"
+#include <memory>
 
-class Gameboy
+// How the CPU runs code
+enum class JITMode
+{
+    OFF, // Interpreter only
+    ON, // Hot blocks of ROM code are compiled
+    DIFFERENTIAL, // Compiled, and checked against an interpreter-only copy
+};
+
+// What the frontend and the benchmark drive a system through, whichever
+// accuracy policy it was built with
+class Emulator
 {
 public:
-    // Caller should catch std::invalid_argument and std::runtime_exception
-    Gameboy(const std::string& _rom_file_path);
-    ~Gameboy();
+    virtual ~Emulator() = default;
 
     // Steps the components by one CPU instruction
-    void step();
+    virtual void step() = 0;
+    // Steps the components until a full frame has been emulated
+    virtual void runFrame() = 0;
+    // Returns true if the CPU has executed a STOP instruction
+    virtual bool isStopped() const = 0;
+    // Gets the last frame drawn by the PPU
+    virtual const FrameBuffer& getFrameBuffer() const = 0;
 
-    std::string getRomFilePath() const;
-    std::string getGameTitle() const;
+    virtual std::string getRomFilePath() const = 0;
+    virtual std::string getGameTitle() const = 0;
 
-    int getCycle() const; // Gets the current cycle in the frame
-    int getCyclesPerFrame() const; // Gets the number of cycles in a frame
-    void resetCycle(); // Wraps the cycles back to 0
+    virtual int getCycle() const = 0; // Gets the current cycle in the frame
+    virtual int getCyclesPerFrame() const = 0; // Gets the number of cycles in a frame
+    virtual void resetCycle() = 0; // Wraps the cycles back to 0
+
+    // Totals since the system was created, for benchmarking
+    virtual uint64_t getInstructionCount() const = 0;
+    virtual uint64_t getTotalCycles() const = 0;
+    // Cycles fast-forwarded through idle loops instead of being executed
+    virtual uint64_t getIdleCyclesSkipped() const = 0;
+
+    // Sets how the CPU runs code. Returns false if built without MOONGB_JIT,
+    // if DIFFERENTIAL is set after the system has started running, or if the
+    // system times memory accesses.
+    virtual bool setJITMode(JITMode mode) = 0;
+    // Times compiled code has disagreed with the interpreter
+    virtual uint64_t getJITMismatches() const = 0;
+
+    // Snapshots the whole system into state, replacing its contents. Passing
+    // the same vector every time reuses its allocation.
+    virtual void saveState(std::vector<uint8_t>& state) const = 0;
+    // Restores a state saved from the same ROM, by either accuracy policy.
+    // Returns false, leaving the system as it was, if the state is for
+    // another ROM or version, or is corrupt. The battery save on disk isn't
+    // changed until the game writes to cartridge RAM.
+    virtual bool loadState(const std::vector<uint8_t>& state) = 0;
 
     // Dumps emulated system info to the log
-    void dumpSystem();
+    virtual void dumpSystem() = 0;
+};
+
+// Accuracy is FastAccuracy or CycleAccuracy, see accuracy.hpp. Both are built
+// into the core, so either can be picked when a ROM is loaded.
+template<typename Accuracy>
+class Gameboy : public Emulator, public BusClock
+{
+public:
+    // Caller should catch std::invalid_argument and std::runtime_exception
+    Gameboy(const std::string& _rom_file_path);
+    ~Gameboy() override;
+
+    void step() override;
+    void runFrame() override;
+    bool isStopped() const override;
+    const FrameBuffer& getFrameBuffer() const override;
+
+    std::string getRomFilePath() const override;
+    std::string getGameTitle() const override;
+
+    int getCycle() const override;
+    int getCyclesPerFrame() const override;
+    void resetCycle() override;
+
+    uint64_t getInstructionCount() const override;
+    uint64_t getTotalCycles() const override;
+    uint64_t getIdleCyclesSkipped() const override;
+
+    bool setJITMode(JITMode mode) override;
+    uint64_t getJITMismatches() const override;
+
+    void saveState(std::vector<uint8_t>& state) const override;
+    bool loadState(const std::vector<uint8_t>& state) override;
+
+    void dumpSystem() override;
+
+    // Brings the system up to a timed memory access
+    void catchUp(int cycles) override;
 
 private:
+    // Loads the system. A read-only save is loaded, but never written back.
+    Gameboy(const std::string& _rom_file_path, bool read_only_save);
+
     std::string rom_file_path;
     std::string game_title;
 
     int cycles_per_frame;
-    int cycle;
+    uint64_t frame_start; // Scheduler cycle the current frame started on
 
-    CPU cpu;
-    PPU ppu;
-    Memory mem;
+    uint64_t instruction_count = 0;
+    uint64_t idle_cycles_skipped = 0;
+
+    // Every state this system saves is the same size, which only depends on
+    // the cartridge. Set once loaded, so loadState() can reject a state
+    // before changing anything.
+    size_t state_size = 0;
+    // The system as it was before loading a state. A corrupt field is only
+    // found part way through a load, so it is restored from this.
+    std::vector<uint8_t> undo_state;
+
+    // Copies every component in and out of a state, after the header
+    void writeComponents(StateWriter& writer) const;
+    void readComponents(StateReader& reader);
+
+    // Frames between writing ERAM back to the .sav file
+    static constexpr int SAV_FLUSH_INTERVAL = 60;
+    int frames_since_flush = 0;
+
+    // Fires the events that are due, catching up the components that own them
+    void runEvents();
+    // Skips whole iterations of the CPU's idle loop, stopping short of limit
+    void skipIdleLoop(uint64_t limit);
+
+    // Cycle the current instruction started on. Only kept for timed accesses.
+    uint64_t instruction_start = 0;
+    // Advances the clock to the end of an instruction. Timed accesses will
+    // have moved it part of the way already.
+    void finishInstruction(int cycles);
+
+    JITMode jit_mode = JITMode::OFF;
+    // Differential mode steps a copy of the system with the interpreter
+    // alongside this one, and compares the registers whenever compiled code
+    // returns. Comparing stops at the first mismatch.
+    std::unique_ptr<Gameboy> shadow;
+    uint64_t jit_mismatches = 0;
+
+    // Steps the shadow up to this system's clock, and compares the CPUs
+    void checkShadow();
+
+    Scheduler scheduler;
+    InterruptController interrupts;
+    CPU<Accuracy> cpu{interrupts};
+    PPU ppu{scheduler, interrupts};
+    Timer timer{scheduler, interrupts};
+    // Memory points into the cartridge's ROM image and bank controller, so
+    // the cartridge is declared first, to be destroyed after it
     Cartridge cart;
+    Memory mem;
 };
\ No newline at end of file
@@ -4,27 +4,83 @@
 #include "../core.hpp"
 #include "../utility/mathutil.hpp"
 #include "../program/logger.hpp"
+#include <bit>
+#include <cstddef>
+#include <cstring>
 
 static constexpr uint32_t GB_X_RES = 160;
 static constexpr uint32_t GB_Y_RES = 144;
 
+// A frame of palette indexes (0-3), as output by the PPU
+using FrameBuffer = std::array<uint8_t, GB_X_RES * GB_Y_RES>;
+
 // Previous implementations used anonymous structs to implicitly define combined
 // regs, which was fine in C, but is undefined in C++.
 // Although it usually works, compiler warnings are annoying.
+//
+// The 8-bit registers are stored as little-endian pairs (C B, E D, L H, F A).
+// The 3-bit register field of an opcode maps straight to a byte slot, and a
+// pair is a single 16-bit load from its low byte's slot.
 struct RegisterSet
 {
-    uint8_t a;
-    uint8_t f;
-    uint8_t b;
     uint8_t c;
-    uint8_t d;
+    uint8_t b;
     uint8_t e;
-    uint8_t h;
+    uint8_t d;
     uint8_t l;
+    uint8_t h;
+    uint8_t f;
+    uint8_t a;
     uint16_t sp;
     uint16_t pc;
+
+    bool operator==(const RegisterSet& other) const = default;
+
+    // Byte slot for each 3-bit register field: B C D E H L (HL) A.
+    // (HL) is not a register, and has no slot.
+    static constexpr std::array<uint8_t, 8> R8_SLOTS = { 1, 0, 3, 2, 5, 4, 0xFF, 7 };
+    // Slot of each pair's low byte. For the 2-bit pair field (BC DE HL, then
+    // SP or AF), the slot is field * 2.
+    static constexpr uint8_t BC_SLOT = 0;
+    static constexpr uint8_t DE_SLOT = 2;
+    static constexpr uint8_t HL_SLOT = 4;
+    static constexpr uint8_t AF_SLOT = 6;
+
+    uint8_t& r8(size_t slot) { return reinterpret_cast<uint8_t*>(this)[slot]; }
+
+    uint16_t r16(size_t slot) const
+    {
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(this) + slot;
+        if constexpr(std::endian::native == std::endian::little)
+        {
+            uint16_t value;
+            std::memcpy(&value, bytes, sizeof(value));
+            return value;
+        } else {
+            return bytes[0] | (bytes[1] << 8);
+        }
+    }
+
+    void setR16(size_t slot, uint16_t value)
+    {
+        uint8_t* bytes = reinterpret_cast<uint8_t*>(this) + slot;
+        if constexpr(std::endian::native == std::endian::little)
+        {
+            std::memcpy(bytes, &value, sizeof(value));
+        } else {
+            bytes[0] = value & 0xFF;
+            bytes[1] = value >> 8;
+        }
+    }
 };
 
+static_assert(offsetof(RegisterSet, b) == RegisterSet::R8_SLOTS[0]
+              && offsetof(RegisterSet, e) == RegisterSet::R8_SLOTS[3]
+              && offsetof(RegisterSet, l) == RegisterSet::R8_SLOTS[5]
+              && offsetof(RegisterSet, a) == RegisterSet::R8_SLOTS[7]
+              && offsetof(RegisterSet, f) == RegisterSet::AF_SLOT,
+              "RegisterSet must not be padded");
+
 // Targets used by the CPU for decode/execute
 enum TargetID
 {
@@ -36,6 +92,19 @@ enum TargetID
     BIT0, BIT1, BIT2, BIT3, BIT4, BIT5, BIT6, BIT7
 };
 
+// Masks for each flag in the F register. The lower nibble of F is always 0.
+static constexpr uint8_t FLAG_ZERO = 0x80;
+static constexpr uint8_t FLAG_SUBTRACT = 0x40;
+static constexpr uint8_t FLAG_HALF_CARRY = 0x20;
+static constexpr uint8_t FLAG_CARRY = 0x10;
+
+// Packs four flags into an F register value
+constexpr uint8_t packFlags(bool zero, bool subtract, bool half_carry, bool carry)
+{
+    return (zero ? FLAG_ZERO : 0) | (subtract ? FLAG_SUBTRACT : 0)
+         | (half_carry ? FLAG_HALF_CARRY : 0) | (carry ? FLAG_CARRY : 0);
+}
+
 // Human-readable representation of the F register
 class FlagRegister
 {
@@ -111,26 +180,147 @@ enum BankController
     // Probably not emulating GB Camera
 };
 
-// The Gameboy's memory is split among several banks
-struct MemoryBank
+// A decoded instruction. Kept as plain data so that decoding one costs no
+// allocations. Use insToString() to disassemble it.
+struct Instruction
 {
-    std::vector<uint8_t> data;
-    bool is_locked;
+    uint16_t origin;    // Address of the opcode
+    uint16_t immediate; // Little-endian bytes after the opcode. $CB: 2nd opcode
+    uint8_t opcode;
+    uint8_t length;     // Length in bytes, including the opcode
+
+    uint8_t imm8() const { return immediate & 0xFF; }
+    uint16_t imm16() const { return immediate; }
 };
 
-// Used for logging.
-struct Instruction
+// Disassembly information for an opcode, only used when printing
+struct OpcodeInfo
 {
-    std::string mnemonic;
+    const char* mnemonic;
     TargetID target1;
     TargetID target2;
     bool t1_as_address;
     bool t2_as_address;
-    uint16_t origin;
-    uint16_t opcode;
-    bool two_byte;
+    uint8_t length; // Length in bytes, including the opcode
 };
 
+// Builds the OpcodeInfo for an unprefixed opcode. Opcodes are split into the
+// fields xxyyyzzz, and yyy is split into ppq.
+constexpr OpcodeInfo describeOpcode(uint8_t op)
+{
+    const TargetID r8[8] = { B, C, D, E, H, L, HL, A };
+    const TargetID r16[4] = { BC, DE, HL, SP };
+    const TargetID r16_stack[4] = { BC, DE, HL, AF };
+    const char* alu[8] = { "ADD", "ADC", "SUB", "SBC", "AND", "XOR", "OR", "CP" };
+    const char* rot_a[8] = { "RLCA", "RRCA", "RLA", "RRA", "DAA", "CPL", "SCF", "CCF" };
+    const char* jr[5] = { "JR NZ,", "JR Z,", "JR NC,", "JR C,", "JR" };
+    const char* jp[5] = { "JP NZ,", "JP Z,", "JP NC,", "JP C,", "JP" };
+    const char* call[5] = { "CALL NZ,", "CALL Z,", "CALL NC,", "CALL C,", "CALL" };
+    const char* ret[4] = { "RET NZ", "RET Z", "RET NC", "RET C" };
+    const char* rst[8] = { "RST $00", "RST $08", "RST $10", "RST $18",
+                           "RST $20", "RST $28", "RST $30", "RST $38" };
+
+    uint8_t x = op >> 6;
+    uint8_t y = (op >> 3) & 0b111;
+    uint8_t z = op & 0b111;
+    uint8_t p = y >> 1;
+    uint8_t q = y & 0b1;
+
+    // Block 0
+    if(op == 0x00) { return { "NOP", NOTARGET, NOTARGET, false, false, 1 }; }
+    if(op == 0x08) { return { "LD", IMMEDIATE, SP, true, false, 3 }; }
+    if(op == 0x10) { return { "STOP", NOTARGET, NOTARGET, false, false, 2 }; }
+    if(x == 0 && z == 0) { return { jr[op == 0x18 ? 4 : y - 4], IMMEDIATE, NOTARGET, false, false, 2 }; }
+    if(x == 0 && z == 1) {
+        if(q == 0) { return { "LD", r16[p], IMMEDIATE, false, false, 3 }; }
+        return { "ADD", HL, r16[p], false, false, 1 };
+    }
+    if(x == 0 && z == 2) {
+        const char* mnemonic = (p == 2) ? "LDI" : (p == 3) ? "LDD" : "LD";
+        TargetID target = (p == 0) ? BC : (p == 1) ? DE : HL;
+        if(q == 0) { return { mnemonic, target, A, true, false, 1 }; }
+        return { mnemonic, A, target, false, true, 1 };
+    }
+    if(x == 0 && z == 3) { return { q ? "DEC" : "INC", r16[p], NOTARGET, false, false, 1 }; }
+    if(x == 0 && z == 4) { return { "INC", r8[y], NOTARGET, y == 6, false, 1 }; }
+    if(x == 0 && z == 5) { return { "DEC", r8[y], NOTARGET, y == 6, false, 1 }; }
+    if(x == 0 && z == 6) { return { "LD", r8[y], IMMEDIATE, y == 6, false, 2 }; }
+    if(x == 0 && z == 7) { return { rot_a[y], y <= 5 ? A : F, NOTARGET, false, false, 1 }; }
+
+    // Block 1. Opcode 0x76 lies in the LD r1,r2 range and is a HALT instruction
+    if(op == 0x76) { return { "HALT", NOTARGET, NOTARGET, false, false, 1 }; }
+    if(x == 1) { return { "LD", r8[y], r8[z], y == 6, z == 6, 1 }; }
+
+    // Block 2
+    if(x == 2) { return { alu[y], A, r8[z], false, z == 6, 1 }; }
+
+    // Block 3
+    switch(op)
+    {
+        case 0xC9: return { "RET", NOTARGET, NOTARGET, false, false, 1 };
+        case 0xD9: return { "RETI", NOTARGET, NOTARGET, false, false, 1 };
+        case 0xE0: return { "LDH", IMMEDIATE, A, true, false, 2 };
+        case 0xE8: return { "ADD", SP, IMMEDIATE, false, false, 2 };
+        case 0xF0: return { "LDH", A, IMMEDIATE, false, true, 2 };
+        case 0xF8: return { "LD HL, SP +", IMMEDIATE, NOTARGET, false, false, 2 };
+        case 0xE9: return { "JP", HL, NOTARGET, false, false, 1 };
+        case 0xF9: return { "LD", SP, HL, false, false, 1 };
+        case 0xC3: return { jp[4], IMMEDIATE, NOTARGET, false, false, 3 };
+        case 0xE2: return { "LDH", C, A, true, false, 1 };
+        case 0xEA: return { "LD", IMMEDIATE, A, true, false, 3 };
+        case 0xF2: return { "LDH", A, C, false, true, 1 };
+        case 0xFA: return { "LD", A, IMMEDIATE, false, true, 3 };
+        case 0xCB: return { "PREFIX CB", NOTARGET, NOTARGET, false, false, 2 };
+        case 0xF3: return { "DI", NOTARGET, NOTARGET, false, false, 1 };
+        case 0xFB: return { "EI", NOTARGET, NOTARGET, false, false, 1 };
+        case 0xCD: return { call[4], IMMEDIATE, NOTARGET, false, false, 3 };
+        default: break;
+    }
+    if(z == 0 && y <= 3) { return { ret[y], NOTARGET, NOTARGET, false, false, 1 }; }
+    if(z == 1 && q == 0) { return { "POP", r16_stack[p], NOTARGET, false, false, 1 }; }
+    if(z == 2 && y <= 3) { return { jp[y], IMMEDIATE, NOTARGET, false, false, 3 }; }
+    if(z == 4 && y <= 3) { return { call[y], IMMEDIATE, NOTARGET, false, false, 3 }; }
+    if(z == 5 && q == 0) { return { "PUSH", r16_stack[p], NOTARGET, false, false, 1 }; }
+    if(z == 6) { return { alu[y], A, IMMEDIATE, false, false, 2 }; }
+    if(z == 7) { return { rst[y], NOTARGET, NOTARGET, false, false, 1 }; }
+
+    // $D3, $DB, $DD, $E3, $E4, $EB, $EC, $ED, $F4, $FC, and $FD do not exist
+    return { "???", NOTARGET, NOTARGET, false, false, 1 };
+}
+
+// Builds the OpcodeInfo for a $CB-prefixed opcode
+constexpr OpcodeInfo describeCBOpcode(uint8_t op)
+{
+    const TargetID r8[8] = { B, C, D, E, H, L, HL, A };
+    const TargetID bits[8] = { BIT0, BIT1, BIT2, BIT3, BIT4, BIT5, BIT6, BIT7 };
+    const char* rot[8] = { "RLC", "RRC", "RL", "RR", "SLA", "SRA", "SWAP", "SRL" };
+
+    uint8_t x = op >> 6;
+    uint8_t y = (op >> 3) & 0b111;
+    uint8_t z = op & 0b111;
+
+    switch(x)
+    {
+        case 0: return { rot[y], r8[z], NOTARGET, z == 6, false, 2 };
+        case 1: return { "BIT", bits[y], r8[z], false, z == 6, 2 };
+        case 2: return { "RES", bits[y], r8[z], false, z == 6, 2 };
+        default: return { "SET", bits[y], r8[z], false, z == 6, 2 };
+    }
+}
+
+// Disassembly tables, indexed by opcode
+inline constexpr std::array<OpcodeInfo, 256> OPCODE_INFO = [] {
+    std::array<OpcodeInfo, 256> table{};
+    for(int i = 0; i < 256; i++) { table[i] = describeOpcode(i); }
+    return table;
+}();
+
+inline constexpr std::array<OpcodeInfo, 256> CB_OPCODE_INFO = [] {
+    std::array<OpcodeInfo, 256> table{};
+    for(int i = 0; i < 256; i++) { table[i] = describeCBOpcode(i); }
+    return table;
+}();
+
 // targetToString stuff
 inline std::string targetToString(TargetID target)
 {
@@ -194,45 +384,43 @@ inline std::string mbcToString(BankController mbc)
     return "ERROR";
 }
 
-inline std::string insToString(Instruction inst)
+inline std::string insToString(const Instruction& inst)
 {
     using std::string, fmt::format;
 
-    string t1;
-    if(inst.target1 != NOTARGET)
+    bool prefixed = (inst.opcode == 0xCB);
+    const OpcodeInfo& info = prefixed ? CB_OPCODE_INFO[inst.imm8()]
+                                      : OPCODE_INFO[inst.opcode];
+
+    auto targetString = [&](TargetID target, bool as_address)
     {
-        if(inst.target1 == IMMEDIATE)
+        string output;
+        if(target == IMMEDIATE)
         {
-            t1 = "n";
+            output = (inst.length == 3) ? format("${:04X}", inst.imm16())
+                                        : format("${:02X}", inst.imm8());
         } else {
-            if(inst.t1_as_address)
-            {
-                t1 = format("[{}]", targetToString(inst.target1));
-            } else {
-                t1 = targetToString(inst.target1);
-            }
+            output = targetToString(target);
         }
+        return as_address ? format("[{}]", output) : output;
+    };
+
+    string t1;
+    if(info.target1 != NOTARGET)
+    {
+        t1 = targetString(info.target1, info.t1_as_address);
     }
 
     string t2;
-    if(inst.target2 != NOTARGET)
+    if(info.target2 != NOTARGET)
     {
-        if(inst.target2 == IMMEDIATE)
-        {
-            t2 = ", n";
-        } else {
-            if(inst.t2_as_address)
-            {
-                t2 = format(", [{}]", targetToString(inst.target2));
-            } else {
-                t2 = ", " + targetToString(inst.target2);
-            }
-        }
+        t2 = ", " + targetString(info.target2, info.t2_as_address);
     }
 
     // Format in Intel-like assembly syntax
     return format("{} {}{} | Origin ${:04X} | Opcode 0x{:02X}",
-                  inst.mnemonic, t1, t2, inst.origin, inst.opcode);
+                  info.mnemonic, t1, t2, inst.origin,
+                  prefixed ? 0xCB00 | inst.imm8() : inst.opcode);
 }
 
 inline std::string regsToString(RegisterSet regs)
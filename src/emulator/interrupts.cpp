@@ -0,0 +1,76 @@
+#include "interrupts.hpp"
+
+using Logger::log, fmt::format;
+
+InterruptController::InterruptController() = default;
+InterruptController::~InterruptController() = default;
+
+
+
+// IF and IE access, for Memory
+uint8_t InterruptController::readIO(uint16_t address)
+{
+    // The unused upper bits of IF read as 1
+    if(address == 0xFF0F) { return IF | 0xE0; }
+    return IE;
+}
+
+void InterruptController::writeIO(uint16_t address, uint8_t data)
+{
+    if(address == 0xFF0F) { IF = data & 0x1F; }
+    else { IE = data; }
+
+    updatePending();
+}
+
+
+
+// Sets a source's bit in IF
+void InterruptController::request(Source source)
+{
+    IF |= 1 << source;
+    updatePending();
+}
+
+// Clears a bit in IF, once the CPU has dispatched it
+void InterruptController::acknowledge(uint8_t bit)
+{
+    IF &= ~(1 << bit);
+    updatePending();
+}
+
+
+
+// Recomputes pending_mask after IF or IE changes
+void InterruptController::updatePending()
+{
+    pending_mask = IF & IE & 0x1F;
+}
+
+
+
+// Copies IF and IE in and out of a save state
+void InterruptController::saveState(StateWriter& writer) const
+{
+    writer.write(IF);
+    writer.write(IE);
+}
+
+void InterruptController::loadState(StateReader& reader)
+{
+    reader.read(IF);
+    reader.read(IE);
+    updatePending();
+}
+
+
+
+// Dumps IF and IE to the log
+void InterruptController::dumpInterrupts()
+{
+    log("--BEGIN INTERRUPT DUMP--", Logger::logDEBUG);
+    log(format("IF: 0b{:08b}, IE: 0b{:08b}, Pending: 0b{:08b}",
+               IF, IE, pending_mask),
+        Logger::logDEBUG);
+    log("--END INTERRUPT DUMP--", Logger::logDEBUG);
+}
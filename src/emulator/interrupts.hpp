@@ -0,0 +1,55 @@
+// Owns IF ($FF0F) and IE ($FFFF). IF & IE is kept as a cached mask, updated
+// only when either register is written or a source raises its line, so the
+// CPU checks for a pending interrupt with one test per instruction.
+#pragma once
+
+#include "../core.hpp"
+#include "memory.hpp"
+#include "savestate.hpp"
+
+class InterruptController : public IODevice
+{
+public:
+    InterruptController();
+    ~InterruptController();
+
+    // Bits of IF and IE, in priority order
+    enum Source : uint8_t
+    {
+        VBLANK = 0,
+        STAT = 1,
+        TIMER = 2,
+        SERIAL = 3,
+        JOYPAD = 4,
+    };
+
+    // IF and IE access, for Memory
+    uint8_t readIO(uint16_t address) override;
+    void writeIO(uint16_t address, uint8_t data) override;
+
+    // Sets a source's bit in IF
+    void request(Source source);
+    // Clears a bit in IF, once the CPU has dispatched it
+    void acknowledge(uint8_t bit);
+
+    // Interrupts both requested and enabled (IF & IE), one bit per source.
+    // Checked before every instruction, so it is defined here.
+    uint8_t pending() const { return pending_mask; }
+    // Compiled CPU code polls the mask directly
+    const uint8_t* pendingAddress() const { return &pending_mask; }
+
+    // Copies IF and IE in and out of a save state
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
+
+    // Dumps IF and IE to the log
+    void dumpInterrupts();
+
+private:
+    uint8_t IF = 0; // Interrupt Flag - $FF0F, low 5 bits
+    uint8_t IE = 0; // Interrupt Enable - $FFFF, all 8 bits are kept
+    uint8_t pending_mask = 0;
+
+    // Recomputes pending_mask after IF or IE changes
+    void updatePending();
+};
@@ -0,0 +1,323 @@
+#include "jit.hpp"
+
+#ifdef MOONGB_JIT
+
+#include <cstddef>
+#include <cstring>
+#include <sys/mman.h>
+
+using Logger::log;
+
+JIT::JIT()
+{
+    void* memory = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(memory == MAP_FAILED)
+    {
+        log("JIT: Could not allocate the code buffer! Only the interpreter "
+            "will be used.", Logger::logERROR);
+        return;
+    }
+
+    code = static_cast<uint8_t*>(memory);
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+}
+
+JIT::~JIT()
+{
+    if(code) { munmap(code, CODE_SIZE); }
+}
+
+
+
+// Returns false if the code buffer could not be allocated
+bool JIT::isAvailable() const
+{
+    return code != nullptr;
+}
+
+
+
+// Gets the compiled code for the block at key, or nullptr. Each miss
+// counts towards compiling it, and sets hot once it is worth doing.
+JIT::CompiledBlock JIT::find(uint32_t key, bool& hot)
+{
+    Slot& slot = slots[key % SLOT_COUNT];
+    if(slot.key != key) { slot = {key, 0, nullptr}; }
+    if(slot.block) { return slot.block; }
+
+    slot.heat++;
+    hot = slot.heat >= HOT_THRESHOLD;
+    return nullptr;
+}
+
+
+// Translates a block, and stores it under the block's key. Returns
+// nullptr if there is no room.
+JIT::CompiledBlock JIT::compile(const Block<FastAccuracy>& block)
+{
+    if(!code) { return nullptr; }
+
+    // Starting over is simpler than tracking which blocks are still in use
+    if(code_used + MAX_BLOCK_SIZE > CODE_SIZE) { clear(); }
+
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_WRITE);
+    uint8_t* start = code + code_used;
+    uint8_t* entry = emitBlock(block, start);
+    mprotect(code, CODE_SIZE, PROT_READ | PROT_EXEC);
+
+    // emitBlock leaves the end of the code in code_used
+    CompiledBlock compiled = reinterpret_cast<CompiledBlock>(entry);
+
+    Slot& slot = slots[block.key % SLOT_COUNT];
+    slot = {block.key, slot.key == block.key ? slot.heat : 0, compiled};
+    return compiled;
+}
+
+
+// Drops all compiled code. Must not be called while it runs.
+void JIT::clear()
+{
+    code_used = 0;
+    slots.fill({});
+}
+
+
+
+// Code Generation //
+
+// Registers held for the whole block. All are callee-saved, so they survive
+// the calls to the handlers.
+//   rbx: RegisterSet*    r12: CPU*    r13: Memory*
+//   r14: Context*        r15: Scheduler clock
+namespace
+{
+
+constexpr uint8_t REGS_PC = offsetof(RegisterSet, pc);
+constexpr uint8_t CTX_REGS = offsetof(JIT::Context, regs);
+constexpr uint8_t CTX_CPU = offsetof(JIT::Context, cpu);
+constexpr uint8_t CTX_MEM = offsetof(JIT::Context, mem);
+constexpr uint8_t CTX_CLOCK = offsetof(JIT::Context, clock);
+constexpr uint8_t CTX_NEXT_DEADLINE = offsetof(JIT::Context, next_deadline);
+constexpr uint8_t CTX_LIMIT = offsetof(JIT::Context, limit);
+constexpr uint8_t CTX_INTERRUPTS = offsetof(JIT::Context, interrupts);
+constexpr uint8_t CTX_INSTRUCTIONS = offsetof(JIT::Context, instructions);
+constexpr uint8_t CTX_LAST = offsetof(JIT::Context, last);
+constexpr uint8_t CTX_EXIT = offsetof(JIT::Context, exit);
+
+static_assert(sizeof(JIT::Context) < 0x80, "Context fields use 8-bit displacements");
+
+// Appends machine code to a buffer
+class Emitter
+{
+public:
+    explicit Emitter(uint8_t* _out) : out(_out) {}
+
+    uint8_t* here() const { return out; }
+
+    void bytes(std::initializer_list<uint8_t> values)
+    {
+        for(uint8_t value : values) { *out++ = value; }
+    }
+
+    template<typename T>
+    void imm(T value)
+    {
+        std::memcpy(out, &value, sizeof(value));
+        out += sizeof(value);
+    }
+
+    // Emits a jump displacement to fill in later, and returns where it is
+    uint8_t* rel32()
+    {
+        uint8_t* at = out;
+        imm<int32_t>(0);
+        return at;
+    }
+
+    // Points the displacement at at to target
+    static void patch(uint8_t* at, const uint8_t* target)
+    {
+        int32_t rel = static_cast<int32_t>(target - (at + 4));
+        std::memcpy(at, &rel, sizeof(rel));
+    }
+
+private:
+    uint8_t* out;
+};
+
+// Returns true if an instruction is translated outright. These only touch
+// the registers, so they can't switch banks or move a deadline.
+bool isInlined(uint8_t opcode)
+{
+    uint8_t dst = (opcode >> 3) & 0b111;
+    uint8_t src = opcode & 0b111;
+
+    return opcode == 0x00 // NOP
+        || (opcode >= 0x40 && opcode < 0x80 && dst != 6 && src != 6) // LD r,r'
+        || ((opcode & 0xC7) == 0x06 && dst != 6); // LD r,n
+}
+
+// Returns true if the next instruction has to go through the interpreter.
+// EI sets IME after it.
+bool endsCompiled(uint8_t opcode)
+{
+    return opcode == 0xFB;
+}
+
+// Emits an inlined instruction. Leaves its cycles in eax.
+void emitInlined(Emitter& e, const Instruction& ins)
+{
+    uint8_t dst = RegisterSet::R8_SLOTS[(ins.opcode >> 3) & 0b111];
+    uint8_t src = RegisterSet::R8_SLOTS[ins.opcode & 0b111];
+
+    if(ins.opcode >= 0x40 && ins.opcode < 0x80)
+    {
+        e.bytes({ 0x8A, 0x4B, src }); // mov cl, [rbx + src]
+        e.bytes({ 0x88, 0x4B, dst }); // mov [rbx + dst], cl
+
+    } else if(ins.opcode != 0x00) {
+
+        e.bytes({ 0xC6, 0x43, dst, ins.imm8() }); // mov byte [rbx + dst], n
+    }
+
+    e.bytes({ 0xB8 }); // mov eax, cycles
+    e.imm<uint32_t>(4 * ins.length);
+}
+
+// Emits a call to an instruction's handler. Leaves its cycles in eax.
+void emitCall(Emitter& e, OpHandler<FastAccuracy> handler, const Instruction* ins)
+{
+    e.bytes({ 0x4C, 0x89, 0xE7 }); // mov rdi, r12
+    e.bytes({ 0x4C, 0x89, 0xEE }); // mov rsi, r13
+    e.bytes({ 0x48, 0xBA }); // mov rdx, ins
+    e.imm(reinterpret_cast<uint64_t>(ins));
+    e.bytes({ 0x48, 0xB8 }); // mov rax, handler
+    e.imm(reinterpret_cast<uint64_t>(handler));
+    e.bytes({ 0xFF, 0xD0 }); // call rax
+
+    // Each fetched byte takes 4 cycles, the handler returns the rest
+    e.bytes({ 0x05 }); // add eax, fetch cycles
+    e.imm<uint32_t>(4 * ins->length);
+}
+
+} // namespace
+
+
+// Writes the host code for block at out. Returns the entry point.
+uint8_t* JIT::emitBlock(const Block<FastAccuracy>& block, uint8_t* out)
+{
+    size_t count = block.ops.size();
+    for(size_t i = 0; i < count; i++)
+    {
+        if(endsCompiled(block.ops[i].ins.opcode)) { count = i + 1; }
+    }
+
+    // The handlers take the instructions by reference, so keep copies next to
+    // the code. The block cache can drop its own while the code runs.
+    Instruction* instructions = reinterpret_cast<Instruction*>(out);
+    for(size_t i = 0; i < count; i++)
+    {
+        std::memcpy(&instructions[i], &block.ops[i].ins, sizeof(Instruction));
+    }
+
+    uint8_t* entry = out + count * sizeof(Instruction);
+    entry += (16 - reinterpret_cast<uintptr_t>(entry) % 16) % 16;
+    Emitter e(entry);
+
+    // Prologue. Six pushes and the return address leave the stack 8 bytes off
+    // the 16 the calls need.
+    e.bytes({ 0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });
+    e.bytes({ 0x48, 0x83, 0xEC, 0x08 }); // sub rsp, 8
+    e.bytes({ 0x49, 0x89, 0xFE }); // mov r14, rdi
+    e.bytes({ 0x49, 0x8B, 0x5E, CTX_REGS }); // mov rbx, [r14 + regs]
+    e.bytes({ 0x4D, 0x8B, 0x66, CTX_CPU }); // mov r12, [r14 + cpu]
+    e.bytes({ 0x4D, 0x8B, 0x6E, CTX_MEM }); // mov r13, [r14 + mem]
+    e.bytes({ 0x4D, 0x8B, 0x7E, CTX_CLOCK }); // mov r15, [r14 + clock]
+
+    // Every exit goes through a stub that records the last instruction run.
+    // Jumps to the stubs are filled in once they have been placed.
+    std::vector<std::pair<uint8_t*, size_t>> exits;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        const Instruction& ins = instructions[i];
+
+        // A taken branch leaves the block
+        if(i > 0)
+        {
+            e.bytes({ 0x66, 0x81, 0x7B, REGS_PC }); // cmp word [rbx + pc], origin
+            e.imm<uint16_t>(ins.origin);
+            e.bytes({ 0x0F, 0x85 }); // jne exit
+            exits.push_back({ e.rel32(), i - 1 });
+        }
+
+        e.bytes({ 0x66, 0xC7, 0x43, REGS_PC }); // mov word [rbx + pc], next
+        e.imm<uint16_t>(ins.origin + ins.length);
+
+        bool inlined = isInlined(ins.opcode);
+        if(inlined) { emitInlined(e, ins); }
+        else { emitCall(e, block.ops[i].handler, &ins); }
+
+        e.bytes({ 0x49, 0x01, 0x07 }); // add [r15], rax
+        e.bytes({ 0x49, 0xFF, 0x46, CTX_INSTRUCTIONS }); // inc qword [r14 + instructions]
+
+        // Memory writes can switch banks, schedule an earlier event, or
+        // request an interrupt
+        if(!inlined)
+        {
+            e.bytes({ 0x41, 0x80, 0x7E, CTX_EXIT, 0x00 }); // cmp byte [r14 + exit], 0
+            e.bytes({ 0x0F, 0x85 }); // jne exit
+            exits.push_back({ e.rel32(), i });
+            e.bytes({ 0x49, 0x8B, 0x56, CTX_INTERRUPTS }); // mov rdx, [r14 + interrupts]
+            e.bytes({ 0x80, 0x3A, 0x00 }); // cmp byte [rdx], 0
+            e.bytes({ 0x0F, 0x85 }); // jne exit
+            exits.push_back({ e.rel32(), i });
+        }
+
+        e.bytes({ 0x49, 0x8B, 0x07 }); // mov rax, [r15]
+        e.bytes({ 0x49, 0x3B, 0x46, CTX_LIMIT }); // cmp rax, [r14 + limit]
+        e.bytes({ 0x0F, 0x83 }); // jae exit
+        exits.push_back({ e.rel32(), i });
+        e.bytes({ 0x49, 0x8B, 0x56, CTX_NEXT_DEADLINE }); // mov rdx, [r14 + next_deadline]
+        e.bytes({ 0x48, 0x3B, 0x02 }); // cmp rax, [rdx]
+        e.bytes({ 0x0F, 0x83 }); // jae exit
+        exits.push_back({ e.rel32(), i });
+    }
+
+    e.bytes({ 0xE9 }); // jmp exit
+    exits.push_back({ e.rel32(), count - 1 });
+
+    // Exit stubs, one per instruction
+    std::vector<uint8_t*> stubs(count);
+    std::vector<uint8_t*> stub_jumps(count);
+    for(size_t i = 0; i < count; i++)
+    {
+        stubs[i] = e.here();
+        e.bytes({ 0x48, 0xB8 }); // mov rax, instruction
+        e.imm(reinterpret_cast<uint64_t>(&instructions[i]));
+        e.bytes({ 0xE9 }); // jmp epilogue
+        stub_jumps[i] = e.rel32();
+    }
+
+    // Epilogue
+    uint8_t* epilogue = e.here();
+    e.bytes({ 0x49, 0x89, 0x46, CTX_LAST }); // mov [r14 + last], rax
+    e.bytes({ 0x48, 0x83, 0xC4, 0x08 }); // add rsp, 8
+    e.bytes({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B });
+    e.bytes({ 0xC3 }); // ret
+
+    for(auto& [at, index] : exits) { Emitter::patch(at, stubs[index]); }
+    for(uint8_t* at : stub_jumps) { Emitter::patch(at, epilogue); }
+
+    // Keep the next block's entry aligned
+    code_used = e.here() - code;
+    code_used += (16 - code_used % 16) % 16;
+
+    return entry;
+}
+
+// End Code Generation //
+
+#endif // MOONGB_JIT
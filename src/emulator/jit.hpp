@@ -0,0 +1,82 @@
+// Optional x86-64 backend for the CPU. Hot blocks of ROM code are translated
+// into host code that calls each instruction's handler directly, with the PC
+// updates, cycle counting, and deadline checks done inline between them.
+// Register loads are translated outright. Code in RAM can change under a
+// block, so it is always left to the interpreter.
+//
+// Only built with MOONGB_JIT, on x86-64 Linux. Compiled code times whole
+// instructions, so only the FastAccuracy core uses it.
+#pragma once
+
+#include "../core.hpp"
+#include "gbdefs.hpp"
+#include "blockcache.hpp"
+
+#ifdef MOONGB_JIT
+
+class JIT
+{
+public:
+    JIT();
+    ~JIT();
+
+    // Everything compiled code reads or updates while it runs
+    struct Context
+    {
+        RegisterSet* regs;
+        CPU<FastAccuracy>* cpu;
+        Memory* mem;
+        uint64_t* clock; // Advanced after every instruction
+        // Compiled code returns once the clock reaches either of these
+        const uint64_t* next_deadline;
+        uint64_t limit;
+        // Compiled code returns once this is nonzero. Points at the pending
+        // interrupt mask while IME is set.
+        const uint8_t* interrupts;
+        uint64_t instructions; // Counted up by compiled code
+        const Instruction* last; // Last instruction run
+        uint8_t exit; // Set to return after the current instruction
+    };
+
+    using CompiledBlock = void (*)(Context* context);
+
+    // Blocks looked up this many times are compiled
+    static constexpr uint32_t HOT_THRESHOLD = 16;
+
+    // Returns false if the code buffer could not be allocated
+    bool isAvailable() const;
+
+    // Gets the compiled code for the block at key, or nullptr. Each miss
+    // counts towards compiling it, and sets hot once it is worth doing.
+    CompiledBlock find(uint32_t key, bool& hot);
+    // Translates a block, and stores it under the block's key. Returns
+    // nullptr if there is no room.
+    CompiledBlock compile(const Block<FastAccuracy>& block);
+    // Drops all compiled code. Must not be called while it runs.
+    void clear();
+
+private:
+    // Executable memory for the compiled code, and the instructions it points
+    // at. Writable only while compiling.
+    static constexpr size_t CODE_SIZE = 4 * 1024 * 1024;
+    // More than the largest block could need
+    static constexpr size_t MAX_BLOCK_SIZE = 16 * 1024;
+    uint8_t* code = nullptr;
+    size_t code_used = 0;
+
+    // Recently looked up blocks, indexed by the low bits of the address. A
+    // block pushed out of its slot is compiled again if it gets hot again.
+    struct Slot
+    {
+        uint32_t key = UINT32_MAX;
+        uint32_t heat = 0;
+        CompiledBlock block = nullptr;
+    };
+    static constexpr size_t SLOT_COUNT = 4096;
+    std::array<Slot, SLOT_COUNT> slots{};
+
+    // Writes the host code for block at out. Returns the entry point.
+    uint8_t* emitBlock(const Block<FastAccuracy>& block, uint8_t* out);
+};
+
+#endif // MOONGB_JIT
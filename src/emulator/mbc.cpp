@@ -0,0 +1,302 @@
+#include "mbc.hpp"
+#include "memory.hpp"
+
+using Logger::log, fmt::format;
+
+MBCController::MBCController(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount)
+    : mem(_mem), rom_bank_amount(_rom_bank_amount), ram_bank_amount(_ram_bank_amount) {}
+
+
+// Handle ERAM accesses while Memory's ERAM is disabled. Reads are open
+// bus unless the controller maps something else there.
+uint8_t MBCController::readRAM(uint16_t address)
+{
+    return 0xFF;
+}
+
+void MBCController::writeRAM(uint16_t address, uint8_t data) {}
+
+
+// Wraps a bank number to the banks that exist, like the unconnected
+// upper bank lines do on hardware
+uint16_t MBCController::wrapROMBank(uint16_t bank) const
+{
+    return bank & (rom_bank_amount - 1);
+}
+
+uint8_t MBCController::wrapRAMBank(uint8_t bank) const
+{
+    return ram_bank_amount == 0 ? 0 : bank & (ram_bank_amount - 1);
+}
+
+
+
+// Makes the controller for a cartridge type. Returns nullptr for cartridges
+// without one, and for controllers that aren't emulated.
+std::unique_ptr<MBCController> makeMBCController(BankController type,
+                                                 Memory& mem,
+                                                 uint16_t rom_bank_amount,
+                                                 uint16_t ram_bank_amount)
+{
+    switch(type)
+    {
+        case NONE: case NONE_RAM: case NONE_BAT_RAM: return nullptr;
+
+        case MBC1: case MBC1_RAM: case MBC1_BAT_RAM:
+        {
+            return std::make_unique<MBC1Controller>(mem, rom_bank_amount, ram_bank_amount);
+        }
+
+        case MBC3: case MBC3_RAM: case MBC3_BAT_RAM:
+        case MBC3_BAT_TIMER: case MBC3_BAT_RAM_TIMER:
+        {
+            return std::make_unique<MBC3Controller>(mem, rom_bank_amount, ram_bank_amount);
+        }
+
+        case MBC5: case MBC5_RAM: case MBC5_BAT_RAM:
+        {
+            return std::make_unique<MBC5Controller>(mem, rom_bank_amount, ram_bank_amount, false);
+        }
+
+        case MBC5_RUMBLE: case MBC5_RUMBLE_RAM: case MBC5_RUMBLE_BAT_RAM:
+        {
+            return std::make_unique<MBC5Controller>(mem, rom_bank_amount, ram_bank_amount, true);
+        }
+
+        default:
+        {
+            log(format("MBC: {:s} is not emulated! Banks will not switch.",
+                       mbcToString(type)),
+                Logger::logERROR);
+            return nullptr;
+        }
+    }
+}
+
+
+
+// MBC1 //
+
+MBC1Controller::MBC1Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount)
+    : MBCController(_mem, _rom_bank_amount, _ram_bank_amount)
+{
+    mapBanks();
+}
+
+
+void MBC1Controller::writeROM(uint16_t address, uint8_t data)
+{
+    switch(address >> 13)
+    {
+        // $0000-$1FFF: RAM enable, $A in the lower nibble enables
+        case 0: ram_enabled = (data & 0x0F) == 0x0A; break;
+        // $2000-$3FFF: Lower 5 ROM bank bits
+        case 1: bank_low = (data & 0x1F) == 0 ? 1 : data & 0x1F; break;
+        // $4000-$5FFF: Upper 2 ROM bank bits, or the RAM bank
+        case 2: bank_high = data & 0x03; break;
+        // $6000-$7FFF: Banking mode
+        case 3: advanced_mode = data & 0x01; break;
+    }
+
+    mapBanks();
+}
+
+
+// Points Memory at the banks the registers select
+void MBC1Controller::mapBanks()
+{
+    mem.setROM0Index(advanced_mode ? wrapROMBank(bank_high << 5) : 0);
+    mem.setROM1Index(wrapROMBank((bank_high << 5) | bank_low));
+    mem.setERAMIndex(advanced_mode ? wrapRAMBank(bank_high) : 0);
+    mem.setERAMEnabled(ram_enabled);
+}
+
+
+// Copies the bank registers in and out of a save state
+void MBC1Controller::saveState(StateWriter& writer) const
+{
+    writer.write(ram_enabled);
+    writer.write(bank_low);
+    writer.write(bank_high);
+    writer.write(advanced_mode);
+}
+
+void MBC1Controller::loadState(StateReader& reader)
+{
+    reader.read(ram_enabled);
+    reader.read(bank_low);
+    reader.read(bank_high);
+    reader.read(advanced_mode);
+    mapBanks();
+}
+
+
+void MBC1Controller::dumpMBC()
+{
+    log(format("MBC1: RAM Enabled: {} | Bank Low: {:d} | Bank High: {:d} | Mode: {:d}",
+               ram_enabled, bank_low, bank_high, advanced_mode ? 1 : 0),
+        Logger::logDEBUG);
+}
+
+// End MBC1 //
+
+
+
+// MBC3 //
+
+MBC3Controller::MBC3Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount)
+    : MBCController(_mem, _rom_bank_amount, _ram_bank_amount)
+{
+    mapBanks();
+}
+
+
+void MBC3Controller::writeROM(uint16_t address, uint8_t data)
+{
+    switch(address >> 13)
+    {
+        // $0000-$1FFF: RAM and clock enable
+        case 0: ram_enabled = (data & 0x0F) == 0x0A; break;
+        // $2000-$3FFF: 7-bit ROM bank
+        case 1: rom_bank = (data & 0x7F) == 0 ? 1 : data & 0x7F; break;
+        // $4000-$5FFF: RAM bank or clock register
+        case 2: ram_select = data; break;
+        // $6000-$7FFF: Writing 0 then 1 latches the clock
+        case 3:
+        {
+            if(last_latch_write == 0x00 && data == 0x01) { rtc_latched = rtc; }
+            last_latch_write = data;
+            return;
+        }
+    }
+
+    mapBanks();
+}
+
+
+// Only reached while a clock register is selected, or RAM is disabled
+uint8_t MBC3Controller::readRAM(uint16_t address)
+{
+    if(!ram_enabled || ram_select < 0x08 || ram_select > 0x0C) { return 0xFF; }
+    return rtc_latched[ram_select - 0x08];
+}
+
+void MBC3Controller::writeRAM(uint16_t address, uint8_t data)
+{
+    if(!ram_enabled || ram_select < 0x08 || ram_select > 0x0C) { return; }
+    rtc[ram_select - 0x08] = data;
+}
+
+
+// Points Memory at the banks the registers select
+void MBC3Controller::mapBanks()
+{
+    mem.setROM1Index(wrapROMBank(rom_bank));
+
+    // The clock registers are handled by readRAM() and writeRAM()
+    bool ram_selected = ram_select <= 0x07;
+    if(ram_selected) { mem.setERAMIndex(wrapRAMBank(ram_select)); }
+    mem.setERAMEnabled(ram_enabled && ram_selected);
+}
+
+
+// Copies the bank registers and the clock in and out of a save state
+void MBC3Controller::saveState(StateWriter& writer) const
+{
+    writer.write(ram_enabled);
+    writer.write(rom_bank);
+    writer.write(ram_select);
+    writer.write(rtc);
+    writer.write(rtc_latched);
+    writer.write(last_latch_write);
+}
+
+void MBC3Controller::loadState(StateReader& reader)
+{
+    reader.read(ram_enabled);
+    reader.read(rom_bank);
+    reader.read(ram_select);
+    reader.read(rtc);
+    reader.read(rtc_latched);
+    reader.read(last_latch_write);
+    mapBanks();
+}
+
+
+void MBC3Controller::dumpMBC()
+{
+    log(format("MBC3: RAM Enabled: {} | ROM Bank: {:d} | RAM Select: ${:02X} | "
+               "Clock: {:d}:{:d}:{:d} Day {:d}",
+               ram_enabled, rom_bank, ram_select,
+               rtc[2], rtc[1], rtc[0], rtc[3] | ((rtc[4] & 0x01) << 8)),
+        Logger::logDEBUG);
+}
+
+// End MBC3 //
+
+
+
+// MBC5 //
+
+MBC5Controller::MBC5Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount,
+                               bool _has_rumble)
+    : MBCController(_mem, _rom_bank_amount, _ram_bank_amount), has_rumble(_has_rumble)
+{
+    mapBanks();
+}
+
+
+void MBC5Controller::writeROM(uint16_t address, uint8_t data)
+{
+    switch(address >> 12)
+    {
+        // $0000-$1FFF: RAM enable, only $0A enables
+        case 0: case 1: ram_enabled = data == 0x0A; break;
+        // $2000-$2FFF: Lower 8 ROM bank bits
+        case 2: rom_bank = (rom_bank & 0x100) | data; break;
+        // $3000-$3FFF: 9th ROM bank bit
+        case 3: rom_bank = (rom_bank & 0xFF) | ((data & 0x01) << 8); break;
+        // $4000-$5FFF: RAM bank
+        case 4: case 5: ram_bank = data & (has_rumble ? 0x07 : 0x0F); break;
+        // $6000-$7FFF: Nothing
+        default: return;
+    }
+
+    mapBanks();
+}
+
+
+// Points Memory at the banks the registers select
+void MBC5Controller::mapBanks()
+{
+    mem.setROM1Index(wrapROMBank(rom_bank));
+    mem.setERAMIndex(wrapRAMBank(ram_bank));
+    mem.setERAMEnabled(ram_enabled);
+}
+
+
+// Copies the bank registers in and out of a save state
+void MBC5Controller::saveState(StateWriter& writer) const
+{
+    writer.write(ram_enabled);
+    writer.write(rom_bank);
+    writer.write(ram_bank);
+}
+
+void MBC5Controller::loadState(StateReader& reader)
+{
+    reader.read(ram_enabled);
+    reader.read(rom_bank);
+    reader.read(ram_bank);
+    mapBanks();
+}
+
+
+void MBC5Controller::dumpMBC()
+{
+    log(format("MBC5: RAM Enabled: {} | ROM Bank: {:d} | RAM Bank: {:d}",
+               ram_enabled, rom_bank, ram_bank),
+        Logger::logDEBUG);
+}
+
+// End MBC5 //
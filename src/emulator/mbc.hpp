@@ -0,0 +1,133 @@
+// Memory bank controllers. Cartridges bigger than 32KiB switch banks by
+// writing to the ROM area. A controller decodes those writes, and repoints
+// Memory's banks, so reads from the banks never leave the fast path.
+#pragma once
+
+#include "../core.hpp"
+#include "gbdefs.hpp"
+#include "savestate.hpp"
+#include <memory>
+
+class Memory;
+
+class MBCController
+{
+public:
+    // Bank amounts come from the header, and are always powers of 2
+    MBCController(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount);
+    virtual ~MBCController() = default;
+
+    // Handles a write to $0000-$7FFF
+    virtual void writeROM(uint16_t address, uint8_t data) = 0;
+    // Handle ERAM accesses while Memory's ERAM is disabled. Reads are open
+    // bus unless the controller maps something else there.
+    virtual uint8_t readRAM(uint16_t address);
+    virtual void writeRAM(uint16_t address, uint8_t data);
+
+    // Copies the bank registers in and out of a save state. Loading maps the
+    // banks they select.
+    virtual void saveState(StateWriter& writer) const = 0;
+    virtual void loadState(StateReader& reader) = 0;
+
+    // Logs the bank registers
+    virtual void dumpMBC() = 0;
+
+protected:
+    Memory& mem;
+    uint16_t rom_bank_amount;
+    uint16_t ram_bank_amount;
+
+    // Wraps a bank number to the banks that exist, like the unconnected
+    // upper bank lines do on hardware
+    uint16_t wrapROMBank(uint16_t bank) const;
+    uint8_t wrapRAMBank(uint8_t bank) const;
+};
+
+// Makes the controller for a cartridge type. Returns nullptr for cartridges
+// without one, and for controllers that aren't emulated.
+std::unique_ptr<MBCController> makeMBCController(BankController type,
+                                                 Memory& mem,
+                                                 uint16_t rom_bank_amount,
+                                                 uint16_t ram_bank_amount);
+
+
+
+// Up to 2MiB ROM and 32KiB RAM. The 2-bit register selects either the upper
+// ROM bank bits, or in mode 1, the RAM bank and the bank mapped to ROM0.
+class MBC1Controller : public MBCController
+{
+public:
+    MBC1Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount);
+
+    void writeROM(uint16_t address, uint8_t data) override;
+    void saveState(StateWriter& writer) const override;
+    void loadState(StateReader& reader) override;
+    void dumpMBC() override;
+
+private:
+    bool ram_enabled = false;
+    uint8_t bank_low = 1; // 5 bits, 0 reads as 1
+    uint8_t bank_high = 0; // 2 bits
+    bool advanced_mode = false;
+
+    // Points Memory at the banks the registers select
+    void mapBanks();
+};
+
+
+
+// Up to 2MiB ROM and 32KiB RAM, with an optional real time clock. The clock
+// registers are mapped over ERAM when selected.
+class MBC3Controller : public MBCController
+{
+public:
+    MBC3Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount);
+
+    void writeROM(uint16_t address, uint8_t data) override;
+    uint8_t readRAM(uint16_t address) override;
+    void writeRAM(uint16_t address, uint8_t data) override;
+    void saveState(StateWriter& writer) const override;
+    void loadState(StateReader& reader) override;
+    void dumpMBC() override;
+
+private:
+    bool ram_enabled = false;
+    uint8_t rom_bank = 1; // 7 bits, 0 reads as 1
+    // $00-$07 select a RAM bank, $08-$0C a clock register
+    uint8_t ram_select = 0;
+
+    // Seconds, minutes, hours, day low, day high/flags. Writes set the
+    // clock, and reads see the copy made by the last latch. The clock is
+    // kept, but doesn't count.
+    std::array<uint8_t, 5> rtc{};
+    std::array<uint8_t, 5> rtc_latched{};
+    uint8_t last_latch_write = 0xFF;
+
+    // Points Memory at the banks the registers select
+    void mapBanks();
+};
+
+
+
+// Up to 8MiB ROM and 128KiB RAM. All 9 ROM bank bits are written directly,
+// and bank 0 can be mapped to ROM1.
+class MBC5Controller : public MBCController
+{
+public:
+    MBC5Controller(Memory& _mem, uint16_t _rom_bank_amount, uint16_t _ram_bank_amount,
+                   bool _has_rumble);
+
+    void writeROM(uint16_t address, uint8_t data) override;
+    void saveState(StateWriter& writer) const override;
+    void loadState(StateReader& reader) override;
+    void dumpMBC() override;
+
+private:
+    bool has_rumble; // Bit 3 of the RAM bank drives the motor instead
+    bool ram_enabled = false;
+    uint16_t rom_bank = 1;
+    uint8_t ram_bank = 0;
+
+    // Points Memory at the banks the registers select
+    void mapBanks();
+};
@@ -1,44 +1,36 @@
 #include "memory.hpp"
+#include "mbc.hpp"
 #include "../program/logger.hpp"
 #include <filesystem>
+#include <fstream>
 
 using Logger::log, fmt::format;
 
-Memory::Memory()
+// The arena starts zeroed
+Memory::Memory() : arena(std::make_unique<MemoryArena>())
 {
-    // Resize static blocks to correct sizes
-    ROM0.data.resize(0x4000);
-    VRAM[0].data.resize(0x2000);
-    VRAM[1].data.resize(0x2000);
-    WRAM0.data.resize(0x1000);
-    OAM.data.resize(0x00A0);
-    IOReg.data.resize(0x0080);
-    HRAM.data.resize(0x007F);
-    IEReg.data.resize(0x0001);
-
-    for(size_t i = 0; i < WRAM1.size(); i++)
-    {
-        WRAM1[i].data.resize(0x1000);
-    }
+    // ROM stays unmapped until loadROM
+    mapRegions();
 }
 
 Memory::~Memory()
 {
-    if(p_ERAM.is_open()) { p_ERAM.close(); }
+    flushERAM();
 }
 
 
 
-// Reads a byte from memory
-uint8_t Memory::readByte(uint16_t address)
+// Reads a byte from memory, ignoring PPU locks
+uint8_t Memory::readByte(uint16_t address, bool ignore_lock)
 {
-    return readByte(address, false);
+    if(!ignore_lock) { return readByte(address); }
+    return readSlow(address, true);
 }
 
 
 
-// Reads a byte from memory, ignoring PPU locks
-uint8_t Memory::readByte(uint16_t address, bool ignore_lock)
+// Reads a byte from a region without a mapped page
+uint8_t Memory::readSlow(uint16_t address, bool ignore_lock)
 {
     // Each return value checks if the value is not locked, or if ignore_lock is true
     // If true, return the value, otherwise return 0xFF
@@ -47,60 +39,62 @@ uint8_t Memory::readByte(uint16_t address, bool ignore_lock)
         // ROM0
         if(address >= 0x0000 && address <= 0x3FFF)
         {
-            return(!ROM0.is_locked || ignore_lock) ? ROM0.data.at(address) : 0xFF;
+            if(!ROM || ROM0_index >= ROM_bank_amount) { throw std::out_of_range("Invalid ROM bank"); }
+            return ROM[ROM0_index * 0x4000 + address];
         }
         // ROM1
         if(address >= 0x4000 && address <= 0x7FFF)
         {
-            auto &mb = ROM1.at(ROM1_index);
-            return(!mb.is_locked || ignore_lock) ? mb.data.at(address - 0x4000) : 0xFF;
+            if(!ROM || ROM1_index >= ROM_bank_amount) { throw std::out_of_range("Invalid ROM bank"); }
+            return ROM[ROM1_index * 0x4000 + (address - 0x4000)];
         }
         // VRAM
         if(address >= 0x8000 && address <= 0x9FFF)
         {
-            auto &mb = VRAM.at(VRAM_index);
-            return(!mb.is_locked || ignore_lock) ? mb.data.at(address - 0x8000) : 0xFF;
+            auto &bank = arena->VRAM.at(VRAM_index);
+            return(!VRAM_locked || ignore_lock) ? bank[address - 0x8000] : 0xFF;
         }
         // ERAM
         if(address >= 0xA000 && address <= 0xBFFF)
         {
+            if(!ERAM_enabled) { return mbc ? mbc->readRAM(address) : 0xFF; }
             return readERAMByte(ERAM_index, address - 0xA000);
         }
         // WRAM0
         if(address >= 0xC000 && address <= 0xCFFF)
         {
-            return(!WRAM0.is_locked || ignore_lock) ? WRAM0.data.at(address - 0xC000) : 0xFF;
+            return arena->WRAM0[address - 0xC000];
         }
         // WRAM1
         if(address >= 0xD000 && address <= 0xDFFF)
         {
-            auto &mb = WRAM1.at(WRAM1_index);
-            return(!mb.is_locked || ignore_lock) ? mb.data.at(address - 0xD000) : 0xFF;
+            return arena->WRAM1.at(WRAM1_index)[address - 0xD000];
         }
         // ECHO RAM
         if(address >= 0xE000 && address <= 0xFDFF)
         {
-            return readByte(address - 0x2000, ignore_lock);
+            return readSlow(address - 0x2000, ignore_lock);
         }
         // OAM
         if(address >= 0xFE00 && address <= 0xFE9F)
         {
-            return (!OAM.is_locked || ignore_lock) ? OAM.data.at(address - 0xFE00) : 0xFF;
+            return (!OAM_locked || ignore_lock) ? arena->OAM[address - 0xFE00] : 0xFF;
         }
         // IO Registers
         if(address >= 0xFF00 && address <= 0xFF7F)
         {
-            return(!IOReg.is_locked || ignore_lock) ? IOReg.data.at(address - 0xFF00) : 0xFF;
+            IODevice* device = io_devices[address - 0xFF00];
+            return device ? device->readIO(address) : arena->IOReg[address - 0xFF00];
         }
         // HRAM
         if(address >= 0xFF80 && address <= 0xFFFE)
         {
-            return(!HRAM.is_locked || ignore_lock) ? HRAM.data.at(address - 0xFF80) : 0xFF;
+            return arena->HRAM[address - 0xFF80];
         }
         // Interrupt Enable Register
         if(address == 0xFFFF)
         {
-            return(!IEReg.is_locked || ignore_lock) ? IEReg.data.at(0) : 0xFF;
+            return ie_device ? ie_device->readIO(address) : arena->IEReg;
         }
 
     } catch(std::out_of_range& ex) {
@@ -135,35 +129,35 @@ uint8_t Memory::getByte(uint16_t address)
         // ROM0
         if(address >= 0x0000 && address <= 0x3FFF)
         {
-            return ROM0.data.at(address);
+            if(!ROM || ROM0_index >= ROM_bank_amount) { return 0x00; }
+            return ROM[ROM0_index * 0x4000 + address];
         }
         // ROM1
         if(address >= 0x4000 && address <= 0x7FFF)
         {
-            auto &mb = ROM1.at(ROM1_index);
-            return mb.data.at(address - 0x4000);
+            if(!ROM || ROM1_index >= ROM_bank_amount) { return 0x00; }
+            return ROM[ROM1_index * 0x4000 + (address - 0x4000)];
         }
         // VRAM
         if(address >= 0x8000 && address <= 0x9FFF)
         {
-            auto &mb = VRAM.at(VRAM_index);
-            return mb.data.at(address - 0x8000);
+            return arena->VRAM.at(VRAM_index)[address - 0x8000];
         }
         // ERAM
         if(address >= 0xA000 && address <= 0xBFFF)
         {
+            if(!ERAM_enabled) { return mbc ? mbc->readRAM(address) : 0xFF; }
             return readERAMByte(ERAM_index, address - 0xA000);
         }
         // WRAM0
         if(address >= 0xC000 && address <= 0xCFFF)
         {
-            return WRAM0.data.at(address - 0xC000);
+            return arena->WRAM0[address - 0xC000];
         }
         // WRAM1
         if(address >= 0xD000 && address <= 0xDFFF)
         {
-            auto &mb = WRAM1.at(WRAM1_index);
-            return mb.data.at(address - 0xD000);
+            return arena->WRAM1.at(WRAM1_index)[address - 0xD000];
         }
         // ECHO RAM
         if(address >= 0xE000 && address <= 0xFDFF)
@@ -173,22 +167,23 @@ uint8_t Memory::getByte(uint16_t address)
         // OAM
         if(address >= 0xFE00 && address <= 0xFE9F)
         {
-            return OAM.data.at(address - 0xFE00);
+            return arena->OAM[address - 0xFE00];
         }
         // IO Registers
         if(address >= 0xFF00 && address <= 0xFF7F)
         {
-            return IOReg.data.at(address - 0xFF00);
+            IODevice* device = io_devices[address - 0xFF00];
+            return device ? device->readIO(address) : arena->IOReg[address - 0xFF00];
         }
         // HRAM
         if(address >= 0xFF80 && address <= 0xFFFE)
         {
-            return HRAM.data.at(address - 0xFF80);
+            return arena->HRAM[address - 0xFF80];
         }
         // Interrupt Enable Register
         if(address == 0xFFFF)
         {
-            return IEReg.data.at(0);
+            return ie_device ? ie_device->readIO(address) : arena->IEReg;
         }
 
     } catch(std::out_of_range& ex) {
@@ -200,20 +195,25 @@ uint8_t Memory::getByte(uint16_t address)
 
 
 
-// Writes a byte to memory
-void Memory::writeByte(uint16_t address, uint8_t data)
+// Writes a byte to a region without a mapped page
+void Memory::writeSlow(uint16_t address, uint8_t data)
 {
+    // IO registers and IE share a page with HRAM, but never hold code
+    uint8_t page = address >> 8;
+    if(watched_pages[page] && (page != 0xFF || (address >= 0xFF80 && address <= 0xFFFE)))
+    {
+        // ECHO RAM pages are watched along with the WRAM page they mirror
+        if(page >= 0xE0 && page <= 0xFD) { page -= 0x20; }
+        unwatchPage(page);
+        code_watcher->pageWritten(page);
+    }
+
     try {
-        // ROM0
-        if(address >= 0x0000 && address <= 0x3FFF)
-        {
-            log(format("MEMORY: Attempted write to ROM! Address: ${:04X}", address),
-                Logger::logDEBUG);
-            return;
-        }
-        // ROM1
-        if(address >= 0x4000 && address <= 0x7FFF)
+        // ROM0 and ROM1. Writes here go to the bank controller.
+        if(address >= 0x0000 && address <= 0x7FFF)
         {
+            if(mbc) { mbc->writeROM(address, data); return; }
+
             log(format("MEMORY: Attempted write to ROM! Address: ${:04X}", address),
                 Logger::logDEBUG);
             return;
@@ -221,57 +221,64 @@ void Memory::writeByte(uint16_t address, uint8_t data)
         // VRAM
         if(address >= 0x8000 && address <= 0x9FFF)
         {
-            auto &mb = VRAM.at(VRAM_index);
-            if (!mb.is_locked) { mb.data.at(address - 0x8000) = data; }
+            auto &bank = arena->VRAM.at(VRAM_index);
+            if(!VRAM_locked) { bank[address - 0x8000] = data; }
             return;
         }
         // ERAM
         if(address >= 0xA000 && address <= 0xBFFF)
         {
+            if(!ERAM_enabled)
+            {
+                if(mbc) { mbc->writeRAM(address, data); }
+                return;
+            }
             writeERAMByte(ERAM_index, address - 0xA000, data);
             return;
         }
         // WRAM0
         if(address >= 0xC000 && address <= 0xCFFF)
         {
-            if(!WRAM0.is_locked) { WRAM0.data.at(address - 0xC000) = data; }
+            arena->WRAM0[address - 0xC000] = data;
             return;
         }
         // WRAM1
         if(address >= 0xD000 && address <= 0xDFFF)
         {
-            auto &mb = WRAM1.at(WRAM1_index);
-            if(!mb.is_locked) { mb.data.at(address - 0xD000) = data; }
+            arena->WRAM1.at(WRAM1_index)[address - 0xD000] = data;
             return;
         }
         // ECHO RAM
         if(address >= 0xE000 && address <= 0xFDFF)
         {
-            writeByte(address - 0x2000, data);
+            writeSlow(address - 0x2000, data);
             return;
         }
         // OAM
         if(address >= 0xFE00 && address <= 0xFE9F)
         {
-            if(!OAM.is_locked) { OAM.data.at(address - 0xFE00) = data; }
+            if(!OAM_locked) { arena->OAM[address - 0xFE00] = data; }
             return;
         }
         // IO Registers
         if(address >= 0xFF00 && address <= 0xFF7F)
         {
-            if (!IOReg.is_locked) { IOReg.data.at(address - 0xFF00) = data; }
+            IODevice* device = io_devices[address - 0xFF00];
+            if(device) { device->writeIO(address, data); }
+            else { arena->IOReg[address - 0xFF00] = data; }
             return;
         }
         // HRAM
         if(address >= 0xFF80 && address <= 0xFFFE)
         {
-            if(!HRAM.is_locked) { HRAM.data.at(address - 0xFF80) = data; }
+            arena->HRAM[address - 0xFF80] = data;
             return;
         }
         // Interrupt Enable Register
         if(address == 0xFFFF)
         {
-            if (!IEReg.is_locked) { IEReg.data.at(0) = data; }
+            if(ie_device) { ie_device->writeIO(address, data); }
+            else { arena->IEReg = data; }
             return;
         }
 
@@ -295,85 +302,417 @@ void Memory::writeByte(uint16_t address, uint8_t data)
 
 
 
-// Copies an array of 0x4000 bytes into ROM0
-void Memory::loadROM0(const std::array<uint8_t, 0x4000>& data)
+// Points ROM0 and ROM1 at a ROM image of bank_amount 16KiB banks. The
+// image is not copied, so it must outlive this object.
+void Memory::loadROM(const uint8_t* data, uint16_t bank_amount)
 {
-    std::copy(data.begin(), data.end(), ROM0.data.begin());
+    ROM = data;
+    ROM_bank_amount = bank_amount;
+    ROM0_index = 0;
+    ROM1_index = 1;
+    mapROM0();
+    mapROM1();
 }
 
 
-// Copies a vector of MemoryBanks into ROM1
-void Memory::loadROM1(const std::vector<MemoryBank>& data, uint16_t bank_amount)
+// Sets the ROM bank mapped to ROM0. Only MBC1 can switch it.
+void Memory::setROM0Index(uint16_t index)
 {
-    ROM_bank_amount = bank_amount;
-    ROM1 = data;
+    if(index == ROM0_index) { return; }
+
+    ROM0_index = index;
+    mapROM0();
+    if(code_watcher) { code_watcher->bankSwitched(); }
 }
 
 
-// Sets the currently selected ROM1 bank
-void Memory::setROM1Index(const uint8_t& index)
+// Sets the ROM bank mapped to ROM1
+void Memory::setROM1Index(uint16_t index)
 {
+    // Games often write the bank they already have, e.g. before every access
+    // to banked data
+    if(index == ROM1_index) { return; }
+
     ROM1_index = index;
+    mapROM1();
+    if(code_watcher) { code_watcher->bankSwitched(); }
+}
+
+
+// Sets the currently selected VRAM bank
+void Memory::setVRAMIndex(const uint8_t& index)
+{
+    VRAM_index = index;
+    mapVRAM();
+}
+
+
+// Sets the currently selected WRAM1 bank
+void Memory::setWRAM1Index(const uint8_t& index)
+{
+    WRAM1_index = index;
+    mapWRAM1();
+    if(code_watcher) { code_watcher->bankSwitched(); }
 }
 
 
 // Sets the currently selected ERAM bank
+void Memory::setERAMIndex(const uint8_t& index)
+{
+    if(index == ERAM_index) { return; }
+
+    ERAM_index = index;
+    mapERAM();
+}
+
+
+// Enables or disables ERAM. While disabled, ERAM accesses go to the bank
+// controller instead.
+void Memory::setERAMEnabled(bool enabled)
+{
+    if(enabled == ERAM_enabled) { return; }
+
+    ERAM_enabled = enabled;
+    mapERAM();
+}
+
+
+// Sets up the ERAM. A read-only save is loaded, but never written back.
 void Memory::setERAM(const uint16_t& _bank_amount,
              bool _persistent,
              const std::string& _sav_file_path,
-             BankController _mbc)
+             bool _read_only)
 {
     ERAM_bank_amount = _bank_amount;
     ERAM_persistent = _persistent;
-    mbc = _mbc;
     sav_file_path = _sav_file_path;
 
-    if(ERAM_persistent)
-    {
-        // Open as out-only, to make sure the file is created
-        std::ofstream temp(_sav_file_path, std::fstream::out);
-        temp.close();
-
-        p_ERAM.open(_sav_file_path, std::fstream::out
-                                    | std::fstream::in
-                                    | std::fstream::binary);
+    size_t target_size = ERAM_bank_amount * 0x2000;
+    ERAM = nullptr;
 
-        if(!p_ERAM)
+    if(ERAM_persistent && !_read_only && target_size > 0)
+    {
+        if(sav_file.open(sav_file_path, target_size, true))
         {
-            log("MEMORY: Could not open .sav file! Saves will not be permanent!",
-                Logger::logERROR);
+            ERAM = sav_file.data();
+        } else {
+            log("MEMORY: Could not map .sav file! Saves will only be written "
+                "periodically.", Logger::logERROR);
         }
+    }
 
-        // Ensure that the .sav file is the correct size
-        size_t target_size = ERAM_bank_amount * 0x2000;
-        if(p_ERAM && std::filesystem::file_size(_sav_file_path) != target_size)
+    if(!ERAM)
+    {
+        ERAM_buffer.assign(target_size, 0);
+
+        // Load the existing save, if there is one
+        if(ERAM_persistent && std::filesystem::exists(sav_file_path))
         {
-            std::filesystem::resize_file(_sav_file_path, target_size);
+            std::ifstream file(sav_file_path, std::ios_base::in | std::ios_base::binary);
+            file.read((char*)(ERAM_buffer.data()), target_size);
         }
+
+        ERAM = ERAM_buffer.data();
+    }
+
+    // Nothing to flush
+    if(_read_only) { ERAM_persistent = false; }
+
+    ERAM_dirty = false;
+    mapERAM();
+}
+
+
+// Writes persistent ERAM back to the .sav file
+void Memory::flushERAM()
+{
+    if(!ERAM_persistent) { return; }
+
+    if(sav_file.isOpen())
+    {
+        sav_file.flush();
+        return;
+    }
+
+    if(!ERAM_dirty) { return; }
+
+    // Write to a temporary file, then swap it in, so a crash mid-write
+    // cannot leave a half-written save behind
+    std::string temp_path = sav_file_path + ".tmp";
+    std::ofstream file(temp_path, std::ios_base::out | std::ios_base::binary
+                                  | std::ios_base::trunc);
+    file.write((char*)(ERAM_buffer.data()), ERAM_buffer.size());
+
+    // Anything past ERAM in the old file, like an RTC footer, is kept
+    std::error_code size_error;
+    uintmax_t old_size = std::filesystem::file_size(sav_file_path, size_error);
+    if(!size_error && old_size > ERAM_buffer.size())
+    {
+        std::ifstream old_file(sav_file_path, std::ios_base::in | std::ios_base::binary);
+        old_file.seekg(ERAM_buffer.size());
+        file << old_file.rdbuf();
+    }
+    file.close();
+
+    std::error_code error;
+    if(file)
+    {
+        std::filesystem::rename(temp_path, sav_file_path, error);
+    }
+
+    if(!file || error)
+    {
+        log("MEMORY: Could not write .sav file!", Logger::logERROR);
+        return;
+    }
+
+    ERAM_dirty = false;
+}
+
+
+
+// Forwards the IO registers from first to last (inclusive) to device.
+// IE ($FFFF) can be forwarded too.
+void Memory::mapIO(uint16_t first, uint16_t last, IODevice* device)
+{
+    for(uint32_t address = first; address <= last; address++)
+    {
+        if(address == 0xFFFF) { ie_device = device; }
+        else { io_devices.at(address - 0xFF00) = device; }
+    }
+}
+
+
+
+// Sets the bank controller that writes to ROM are sent to. nullptr
+// ignores them, like a cartridge without one.
+void Memory::setMBC(MBCController* controller)
+{
+    mbc = controller;
+}
+
+
+
+// Sets the object told about writes to watched pages and bank switches
+void Memory::setCodeWatcher(CodeWatcher* watcher)
+{
+    code_watcher = watcher;
+}
+
+
+// Routes writes to a WRAM or HRAM page (and its ECHO RAM mirror) through
+// the slow path, which tells the CodeWatcher about the first one
+void Memory::watchPage(uint8_t page)
+{
+    watched_pages[page] = true;
+    write_pages[page] = nullptr;
+
+    if(page >= 0xC0 && page <= 0xDD)
+    {
+        watched_pages[page + 0x20] = true;
+        write_pages[page + 0x20] = nullptr;
     }
+}
+
 
-    if(!ERAM_persistent || !p_ERAM)
+// Stops watching a page, and maps it for fast writes again
+void Memory::unwatchPage(uint8_t page)
+{
+    watched_pages[page] = false;
+    if(page >= 0xC0 && page <= 0xDD) { watched_pages[page + 0x20] = false; }
+
+    if(page >= 0xC0 && page <= 0xCF)
     {
-        np_ERAM.resize(ERAM_bank_amount * 0x2000);
+        uint8_t* data = arena->WRAM0.data() + (page - 0xC0) * 0x100;
+        mapPages(page, 1, data, data);
+        mapPages(page + 0x20, 1, data, data);
+
+    } else if(page >= 0xD0 && page <= 0xDF) {
+
+        mapWRAM1();
     }
 }
 
 
+// Gets the bank mapped at address. 0 for regions that can't be switched.
+uint16_t Memory::getBank(uint16_t address) const
+{
+    if(address <= 0x3FFF) { return ROM0_index; }
+    if(address >= 0x4000 && address <= 0x7FFF) { return ROM1_index; }
+    if(address >= 0xD000 && address <= 0xDFFF) { return WRAM1_index; }
+    return 0;
+}
+
+
 
 // Sets locks for PPU
 void Memory::setVRAMLock(bool value)
 {
-    for(auto bank : VRAM)
+    VRAM_locked = value;
+    mapVRAM();
+}
+
+void Memory::setOAMLock(bool value)
+{
+    OAM_locked = value;
+}
+
+// Direct views of VRAM and OAM for the PPU, which ignores the locks
+const uint8_t* Memory::getVRAMBank(uint8_t bank) const
+{
+    return arena->VRAM.at(bank).data();
+}
+
+const uint8_t* Memory::getOAM() const
+{
+    return arena->OAM.data();
+}
+
+// The arena holding every writable region except ERAM, as one block
+const MemoryArena& Memory::getArena() const
+{
+    return *arena;
+}
+
+
+// Points the pages from first_page to first_page + page_count at data.
+// Passing nullptr sends the pages to the slow path.
+void Memory::mapPages(uint8_t first_page, uint8_t page_count,
+                      const uint8_t* read_data, uint8_t* write_data)
+{
+    for(int i = 0; i < page_count; i++)
     {
-        bank.is_locked = value;
+        read_pages[first_page + i] = read_data ? read_data + i * 0x100 : nullptr;
+        // Watched pages keep sending writes to the slow path
+        bool fast_write = write_data && !watched_pages[first_page + i];
+        write_pages[first_page + i] = fast_write ? write_data + i * 0x100 : nullptr;
     }
 }
 
-void Memory::setOAMLock(bool value)
+
+// Points every region's pages at its current bank
+void Memory::mapRegions()
+{
+    uint8_t* WRAM0 = arena->WRAM0.data();
+    mapPages(0xC0, 0x10, WRAM0, WRAM0);
+    // ECHO RAM mirrors $C000-$DDFF
+    mapPages(0xE0, 0x10, WRAM0, WRAM0);
+    mapROM0();
+    mapROM1();
+    mapVRAM();
+    mapERAM();
+    mapWRAM1();
+}
+
+
+// Re-points the pages of each switchable/lockable region. Invalid bank
+// indexes are left to the slow path, which logs them.
+// ROM is never writable, writes go to the slow path
+void Memory::mapROM0()
+{
+    const uint8_t* data = nullptr;
+    if(ROM && ROM0_index < ROM_bank_amount)
+    {
+        data = ROM + ROM0_index * 0x4000;
+    }
+    mapPages(0x00, 0x40, data, nullptr);
+}
+
+void Memory::mapROM1()
+{
+    const uint8_t* data = nullptr;
+    if(ROM && ROM1_index < ROM_bank_amount)
+    {
+        data = ROM + ROM1_index * 0x4000;
+    }
+    mapPages(0x40, 0x40, data, nullptr);
+}
+
+void Memory::mapVRAM()
 {
-    OAM.is_locked = value;
+    uint8_t* data = nullptr;
+    if(VRAM_index < arena->VRAM.size() && !VRAM_locked)
+    {
+        data = arena->VRAM[VRAM_index].data();
+    }
+    mapPages(0x80, 0x20, data, data);
 }
 
+void Memory::mapERAM()
+{
+    uint8_t* data = nullptr;
+    if(ERAM && ERAM_enabled && ERAM_index < ERAM_bank_amount)
+    {
+        data = ERAM + ERAM_index * 0x2000;
+    }
+    // Buffered saves need writes to go through the slow path to be marked dirty
+    bool track_writes = ERAM_persistent && !sav_file.isOpen();
+    mapPages(0xA0, 0x20, data, track_writes ? nullptr : data);
+}
+
+void Memory::mapWRAM1()
+{
+    uint8_t* data = nullptr;
+    if(WRAM1_index < arena->WRAM1.size())
+    {
+        data = arena->WRAM1[WRAM1_index].data();
+    }
+    mapPages(0xD0, 0x10, data, data);
+    // ECHO RAM stops at $FDFF
+    mapPages(0xF0, 0x0E, data, data);
+}
+
+
+// Copies the arena, ERAM, and the bank indexes and locks in and out of a
+// save state. Loading stops watching every page, so the CodeWatcher must
+// drop its cached code too. Loaded ERAM stays out of the .sav file until the
+// game writes to it.
+void Memory::saveState(StateWriter& writer) const
+{
+    writer.write(*arena);
+    writer.write(ROM0_index);
+    writer.write(ROM1_index);
+    writer.write(VRAM_index);
+    writer.write(VRAM_locked);
+    writer.write(ERAM_index);
+    writer.write(ERAM_enabled);
+    writer.write(WRAM1_index);
+    writer.write(OAM_locked);
+    writer.writeBytes(ERAM, ERAM_bank_amount * 0x2000);
+}
+
+void Memory::loadState(StateReader& reader)
+{
+    reader.read(*arena);
+    reader.read(ROM0_index);
+    reader.read(ROM1_index);
+    reader.read(VRAM_index);
+    reader.read(VRAM_locked);
+    reader.read(ERAM_index);
+    reader.read(ERAM_enabled);
+    reader.read(WRAM1_index);
+    reader.read(OAM_locked);
+
+    // Writing the state's ERAM into the mapped .sav would replace the battery
+    // save on disk at once. It goes into the buffer instead, and is only
+    // written back once the game writes to ERAM. Saves the game made before
+    // the load are kept.
+    flushERAM();
+    size_t ERAM_size = ERAM_bank_amount * 0x2000;
+    if(sav_file.isOpen())
+    {
+        ERAM_buffer.assign(ERAM, ERAM + ERAM_size);
+        sav_file.close();
+        ERAM = ERAM_buffer.data();
+    }
+    reader.readBytes(ERAM, ERAM_size);
+    ERAM_dirty = false;
+
+    watched_pages.fill(false);
+    mapRegions();
+}
+
+
 
 // Dumps the contents of memory to the log
 void Memory::dumpMemory()
@@ -410,44 +749,36 @@ void Memory::dumpMemory()
 
 
 
+// Reads a byte from an ERAM bank. Mapped banks never reach this
 uint8_t Memory::readERAMByte(uint8_t bank, uint16_t address)
 {
-    if(bank > ERAM_bank_amount)
+    if(bank >= ERAM_bank_amount)
     {
         log(format("MEMORY: Attempted read of invalid ERAM bank. "
                    "Requested Bank: {:d} | Bank Amount: {:d}",
                    bank, ERAM_bank_amount),
             Logger::logDEBUG);
+        return 0xFF;
     }
 
-    if(ERAM_persistent && p_ERAM)
-    {
-        p_ERAM.seekg(bank * address);
-        return p_ERAM.get();
-    }
-
-    return np_ERAM.at(bank * address);
+    return ERAM[bank * 0x2000 + address];
 }
 
 
 
-
+// Writes a byte to an ERAM bank. Only buffered saves and invalid banks
+// reach this
 void Memory::writeERAMByte(uint8_t bank, uint16_t address, uint8_t data)
 {
-    if(bank > ERAM_bank_amount)
+    if(bank >= ERAM_bank_amount)
     {
         log(format("MEMORY: Attempted write to invalid ERAM bank. "
                    "Requested Bank: {:d} | Bank Amount: {:d}",
                    bank, ERAM_bank_amount),
             Logger::logDEBUG);
-    }
-
-    if(ERAM_persistent && p_ERAM)
-    {
-        p_ERAM.seekg(bank * address);
-        p_ERAM.put(data);
         return;
     }
 
-    np_ERAM.at(bank * address) = data;
+    ERAM[bank * 0x2000 + address] = data;
+    ERAM_dirty = true;
 }
@@ -2,7 +2,56 @@
 
 #include "../core.hpp"
 #include "gbdefs.hpp"
-#include <fstream>
+#include "../utility/mappedfile.hpp"
+#include "savestate.hpp"
+#include <cstddef>
+#include <memory>
+
+class MBCController;
+
+// A component that owns some of the IO registers ($FF00-$FF7F, and IE at
+// $FFFF). Memory forwards CPU accesses to registers mapped with
+// Memory::mapIO() to it.
+class IODevice
+{
+public:
+    virtual ~IODevice() = default;
+
+    virtual uint8_t readIO(uint16_t address) = 0;
+    virtual void writeIO(uint16_t address, uint8_t data) = 0;
+};
+
+// Keeps cached decodes of code in sync with memory. Memory reports writes to
+// pages passed to Memory::watchPage(), and bank switches.
+class CodeWatcher
+{
+public:
+    virtual ~CodeWatcher() = default;
+
+    // A watched page was written. The page is no longer watched.
+    virtual void pageWritten(uint8_t page) = 0;
+    // A different bank was mapped to ROM1 or WRAM1
+    virtual void bankSwitched() = 0;
+};
+
+// Every writable region inside the Gameboy, in one block. Regions sit at
+// fixed offsets, and the block is aligned to a cache line, so the hot RAM
+// shares cache lines with nothing else. ROM and ERAM belong to the cartridge,
+// and are kept separately.
+struct alignas(64) MemoryArena
+{
+    std::array<std::array<uint8_t, 0x2000>, 2> VRAM; // CGB has 2 banks of VRAM
+    std::array<uint8_t, 0x1000> WRAM0;
+    std::array<std::array<uint8_t, 0x1000>, 7> WRAM1; // CGB has 7 banks of WRAM
+    std::array<uint8_t, 0x0100> OAM; // $FEA0-$FEFF is unusable, but padded in
+    // $FF00-$FFFF are laid out like the address space
+    std::array<uint8_t, 0x0080> IOReg;
+    std::array<uint8_t, 0x007F> HRAM;
+    uint8_t IEReg;
+};
+
+static_assert(sizeof(MemoryArena) == 0xC200, "MemoryArena has padding");
+static_assert(offsetof(MemoryArena, IOReg) % 64 == 0);
 
 class Memory
 {
@@ -11,59 +60,172 @@ public:
     ~Memory();
 
     // Reads a byte from memory
-    uint8_t readByte(uint16_t address);
+    inline uint8_t readByte(uint16_t address);
     // Reads a byte from memory, ignoring PPU locks
     uint8_t readByte(uint16_t address, bool ignore_lock);
     // Reads a byte from memory, does not log. For dumping
     uint8_t getByte(uint16_t address);
     // Writes a byte to memory
-    void writeByte(uint16_t address, uint8_t data);
-
-    // Copies an array of 0x4000 bytes into ROM0
-    void loadROM0(const std::array<uint8_t, 0x4000>& data);
-    // Copies a vector of MemoryBanks into ROM1
-    void loadROM1(const std::vector<MemoryBank>& data, uint16_t bank_amount);
-    // Sets the currently selected ROM1 bank
-    void setROM1Index(const uint8_t& index);
-    // Sets up the ERAM
+    inline void writeByte(uint16_t address, uint8_t data);
+    // Gets the host pointer behind a 256-byte page of the address space, or
+    // nullptr if reads from it go through the slow path
+    inline const uint8_t* getReadPage(uint8_t page) const;
+
+    // Points ROM0 and ROM1 at a ROM image of bank_amount 16KiB banks. The
+    // image is not copied, so it must outlive this object.
+    void loadROM(const uint8_t* data, uint16_t bank_amount);
+    // Sets the ROM bank mapped to ROM0. Only MBC1 can switch it.
+    void setROM0Index(uint16_t index);
+    // Sets the ROM bank mapped to ROM1
+    void setROM1Index(uint16_t index);
+    // Sets the currently selected VRAM bank
+    void setVRAMIndex(const uint8_t& index);
+    // Sets the currently selected WRAM1 bank
+    void setWRAM1Index(const uint8_t& index);
+    // Sets the currently selected ERAM bank
+    void setERAMIndex(const uint8_t& index);
+    // Enables or disables ERAM. While disabled, ERAM accesses go to the bank
+    // controller instead.
+    void setERAMEnabled(bool enabled);
+    // Sets up the ERAM. A read-only save is loaded, but never written back.
     void setERAM(const uint16_t& _bank_amount,
                       bool _persistent,
                       const std::string& _sav_file_path,
-                      BankController mbc);
+                      bool _read_only);
+    // Sets the bank controller that writes to ROM are sent to. nullptr
+    // ignores them, like a cartridge without one.
+    void setMBC(MBCController* controller);
+    // Writes persistent ERAM back to the .sav file
+    void flushERAM();
+
+    // Forwards the IO registers from first to last (inclusive) to device.
+    // IE ($FFFF) can be forwarded too.
+    void mapIO(uint16_t first, uint16_t last, IODevice* device);
+
+    // Sets the object told about writes to watched pages and bank switches
+    void setCodeWatcher(CodeWatcher* watcher);
+    // Routes writes to a WRAM or HRAM page (and its ECHO RAM mirror) through
+    // the slow path, which tells the CodeWatcher about the first one
+    void watchPage(uint8_t page);
+    // Gets the bank mapped at address. 0 for regions that can't be switched.
+    uint16_t getBank(uint16_t address) const;
 
     // Sets locks for PPU
     void setVRAMLock(bool value);
     void setOAMLock(bool value);
+    // Direct views of VRAM and OAM for the PPU, which ignores the locks
+    const uint8_t* getVRAMBank(uint8_t bank) const;
+    const uint8_t* getOAM() const;
+    // The arena holding every writable region except ERAM, as one block
+    const MemoryArena& getArena() const;
+
+    // Copies the arena, ERAM, and the bank indexes and locks in and out of a
+    // save state. Loading stops watching every page, so the CodeWatcher must
+    // drop its cached code too. Loaded ERAM stays out of the .sav file until
+    // the game writes to it.
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
 
     // Dumps the contents of memory to the log
     void dumpMemory();
 
 private:
-    MemoryBank ROM0{{}, false};
-    std::vector<MemoryBank> ROM1{}; // MBC controls bank amount
-    uint16_t ROM1_index = 0;
-    uint16_t ROM_bank_amount;
-    std::array<MemoryBank, 2> VRAM{}; // CGB has 2 banks of VRAM
+    // The ROM image, owned by the Cartridge. Bank n starts at ROM + n * 0x4000
+    const uint8_t* ROM = nullptr;
+    uint16_t ROM0_index = 0; // MBC controls bank amount
+    uint16_t ROM1_index = 1;
+    uint16_t ROM_bank_amount = 0;
+    // VRAM, WRAM, OAM, IO, HRAM, and IE
+    std::unique_ptr<MemoryArena> arena;
     uint8_t VRAM_index = 0;
+    bool VRAM_locked = false;
     // ERAM handled further in file
     uint16_t ERAM_index = 0;
-    MemoryBank WRAM0{{}, false};
-    std::array<MemoryBank, 7> WRAM1{}; // CGB has 7 banks of WRAM
+    bool ERAM_enabled = true;
     uint8_t WRAM1_index = 0;
-    MemoryBank OAM{{}, false};
-    MemoryBank IOReg{{}, false};
-    MemoryBank HRAM{{}, false};
-    MemoryBank IEReg{{}, false};
-
-    BankController mbc;
-    uint16_t ERAM_bank_amount;
-    bool ERAM_persistent;
-    // Vector is used if ERAM is not persistent
-    std::vector<uint8_t> np_ERAM;
-    // fstream is used if ERAM is persistent
+    bool OAM_locked = false;
+    // Owner of each IO register, nullptr if it is plain storage in IOReg
+    std::array<IODevice*, 0x80> io_devices{};
+    IODevice* ie_device = nullptr; // Owner of IE, nullptr if it is in IEReg
+
+    MBCController* mbc = nullptr; // Owned by the Cartridge
+    uint16_t ERAM_bank_amount = 0;
+    bool ERAM_persistent = false;
     std::string sav_file_path;
-    std::fstream p_ERAM;
+    // Points at every ERAM bank. Persistent ERAM is the .sav file mapped into
+    // memory. Otherwise, if mapping fails, or once a save state is loaded, it
+    // points at ERAM_buffer.
+    uint8_t* ERAM = nullptr;
+    MappedFile sav_file;
+    std::vector<uint8_t> ERAM_buffer;
+    // Set when buffered persistent ERAM has changes not in the .sav file
+    bool ERAM_dirty = false;
+
+    // Host pointers for each 256-byte page of the address space, indexed by
+    // the upper byte of the address. Pages set to nullptr are handled by the
+    // slow path (IO, ERAM, OAM, HRAM, locked banks, and writes to ROM).
+    // readByte() and writeByte() check for HRAM before taking it.
+    std::array<const uint8_t*, 256> read_pages{};
+    std::array<uint8_t*, 256> write_pages{};
+
+    CodeWatcher* code_watcher = nullptr;
+    // Pages with writes routed to the slow path for the CodeWatcher
+    std::array<bool, 256> watched_pages{};
+
+    // Points the pages from first_page to first_page + page_count at data.
+    // Passing nullptr sends the pages to the slow path.
+    void mapPages(uint8_t first_page, uint8_t page_count,
+                  const uint8_t* read_data, uint8_t* write_data);
+    // Stops watching a page, and maps it for fast writes again
+    void unwatchPage(uint8_t page);
+    // Points every region's pages at its current bank
+    void mapRegions();
+    // Re-points the pages of each switchable/lockable region
+    void mapROM0();
+    void mapROM1();
+    void mapVRAM();
+    void mapERAM();
+    void mapWRAM1();
+
+    // Reads a byte from a region without a mapped page
+    uint8_t readSlow(uint16_t address, bool ignore_lock);
+    // Writes a byte to a region without a mapped page
+    void writeSlow(uint16_t address, uint8_t data);
+
+    uint8_t readERAMByte(uint8_t bank, uint16_t address);
+    void writeERAMByte(uint8_t bank, uint16_t address, uint8_t data);
+};
 
-    inline uint8_t readERAMByte(uint8_t bank, uint16_t address);
-    inline void writeERAMByte(uint8_t bank, uint16_t address, uint8_t data);
-};
\ No newline at end of file
+
+
+// Reads a byte from memory
+uint8_t Memory::readByte(uint16_t address)
+{
+    const uint8_t* page = read_pages[address >> 8];
+    if(page) { return page[address & 0xFF]; }
+    // HRAM shares page $FF with the IO registers and IE, so it is checked on
+    // its own. Polling loops and OAM DMA routines run from it.
+    if(address >= 0xFF80 && address != 0xFFFF) { return arena->HRAM[address - 0xFF80]; }
+    return readSlow(address, false);
+}
+
+// Writes a byte to memory
+void Memory::writeByte(uint16_t address, uint8_t data)
+{
+    uint8_t* page = write_pages[address >> 8];
+    if(page) { page[address & 0xFF] = data; return; }
+    // Unless the CodeWatcher is watching HRAM for its first write
+    if(address >= 0xFF80 && address != 0xFFFF && !watched_pages[0xFF])
+    {
+        arena->HRAM[address - 0xFF80] = data;
+        return;
+    }
+    writeSlow(address, data);
+}
+
+// Gets the host pointer behind a 256-byte page of the address space, or
+// nullptr if reads from it go through the slow path
+const uint8_t* Memory::getReadPage(uint8_t page) const
+{
+    return read_pages[page];
+}
\ No newline at end of file
@@ -1,9 +1,11 @@
 #include "ppu.hpp"
 #include "../program/logger.hpp"
+#include <algorithm>
 
 using Logger::log, fmt::format;
 
-PPU::PPU()
+PPU::PPU(Scheduler& _scheduler, InterruptController& _interrupts)
+    : scheduler(_scheduler), interrupts(_interrupts)
 {
     LCDC = 0;
     SCX = 0;
@@ -17,45 +19,458 @@ PPU::PPU()
     WY = 0;
     WX = 0;
     ppu_state = OAMSearch;
+    last_update = 0;
+    lcd_on = false;
+    scanl_cycle = 0;
+    window_line = 0;
+    stat_line = false;
+    stat_changed = false;
+    LCDC_changed = false;
+    old_LCDC = 0;
+    LCDC_write_time = 0;
 }
 
 PPU::~PPU() = default;
 
 
-// Steps the PPU by a given number of cycles
+// Catches up to the scheduler's clock, and schedules the next event
+void PPU::update(Memory& mem)
+{
+    uint64_t now = scheduler.now();
+
+    // An LCDC write takes effect from the cycle it was made on, so the cycles
+    // before it are stepped with the old value. Otherwise turning the LCD off
+    // would drop the scanlines finished before the write, and their interrupts.
+    if(LCDC_changed)
+    {
+        LCDC_changed = false;
+        uint8_t new_LCDC = LCDC;
+        LCDC = old_LCDC;
+        if(LCDC_write_time > last_update)
+        {
+            step(static_cast<int>(LCDC_write_time - last_update), mem);
+            last_update = LCDC_write_time;
+        }
+        LCDC = new_LCDC;
+    }
+
+    step(static_cast<int>(now - last_update), mem);
+    last_update = now;
+
+    scheduleNextEvent();
+}
+
+
+
+// Steps the PPU by a given number of cycles. Modes only change on scanline
+// boundaries, so the cycles are handled as one batch instead of one by one.
 void PPU::step(int steps, Memory& mem)
 {
-    // NOTE: I'm pretty sure that certain registers are only read during certain
-    // states, but this should be good enough to get something on the screen.
-    readRegisters(mem);
+    // While the LCD is off, LY stays at 0 and the CPU can access VRAM/OAM
+    if(!(LCDC & 0x80))
+    {
+        if(lcd_on)
+        {
+            lcd_on = false;
+            LY = 0;
+            scanl_cycle = 0;
+            window_line = 0;
+            setState(HBlank, mem);
+        }
 
-    for(int i = 0; i < steps; i++)
+        return;
+    }
+
+    // Turning the LCD on starts a new frame
+    if(!lcd_on)
     {
+        lcd_on = true;
+        setState(OAMSearch, mem);
+    }
+
+    // Writes to STAT/LYC can raise the STAT line, which needs memory for IF
+    if(stat_changed)
+    {
+        stat_changed = false;
+        updateSTAT(mem);
+    }
+
+    scanl_cycle += steps;
+
+    // Each pass either changes mode, or waits for more cycles
+    bool changed = true;
+    while(changed)
+    {
+        changed = false;
+
         switch(ppu_state)
         {
-        case HBlank:
+        case OAMSearch:
         {
+            if(scanl_cycle < OAM_SEARCH_CYCLES) { break; }
+
+            setState(PixelTransfer, mem);
+            changed = true;
             break;
         }
 
-        case VBlank:
+        case PixelTransfer:
         {
+            if(scanl_cycle < OAM_SEARCH_CYCLES + PIXEL_TRANSFER_CYCLES) { break; }
+
+            renderScanline(mem);
+            setState(HBlank, mem);
+            changed = true;
             break;
         }
 
-        case OAMSearch:
+        case HBlank:
         {
+            if(scanl_cycle < SCANLINE_CYCLES) { break; }
+
+            scanl_cycle -= SCANLINE_CYCLES;
+            LY++;
+
+            if(LY == VBLANK_START_LINE)
+            {
+                setState(VBlank, mem);
+                interrupts.request(InterruptController::VBLANK);
+            } else {
+                setState(OAMSearch, mem);
+            }
+
+            changed = true;
             break;
         }
 
-        case PixelTransfer:
+        case VBlank:
         {
+            if(scanl_cycle < SCANLINE_CYCLES) { break; }
+
+            scanl_cycle -= SCANLINE_CYCLES;
+            LY++;
+
+            if(LY == LINES_PER_FRAME)
+            {
+                LY = 0;
+                window_line = 0;
+                setState(OAMSearch, mem);
+            } else {
+                updateSTAT(mem);
+            }
+
+            changed = true;
+            break;
+        }
+        }
+    }
+}
+
+
+
+// Schedules the next mode change, or nothing while the LCD is off
+void PPU::scheduleNextEvent()
+{
+    if(!lcd_on)
+    {
+        scheduler.cancel(EventType::PPU);
+        return;
+    }
+
+    int mode_end;
+    switch(ppu_state)
+    {
+        case OAMSearch: mode_end = OAM_SEARCH_CYCLES; break;
+        case PixelTransfer: mode_end = OAM_SEARCH_CYCLES + PIXEL_TRANSFER_CYCLES; break;
+        default: mode_end = SCANLINE_CYCLES; break;
+    }
+
+    scheduler.schedule(EventType::PPU, last_update + (mode_end - scanl_cycle));
+}
+
+
+// Has the PPU handle a register write after the current instruction
+void PPU::scheduleWriteEvent()
+{
+    // Time spent with the LCD off is skipped. Turning it on counts from the
+    // start of the instruction that did it.
+    if(!lcd_on) { last_update = scheduler.now(); }
+
+    scheduler.schedule(EventType::PPU, scheduler.now());
+}
+
+
+
+// Reads an LCD register
+uint8_t PPU::readIO(uint16_t address)
+{
+    switch(address)
+    {
+        case 0xFF40: return LCDC;
+        case 0xFF41: return STAT | 0x80; // Bit 7 is unused, and always set
+        case 0xFF42: return SCY;
+        case 0xFF43: return SCX;
+        case 0xFF44: return LY;
+        case 0xFF45: return LYC;
+        case 0xFF47: return BGP;
+        case 0xFF48: return OBP0;
+        case 0xFF49: return OBP1;
+        case 0xFF4A: return WY;
+        case 0xFF4B: return WX;
+        default: return 0xFF;
+    }
+}
+
+
+// Writes an LCD register. Changes to LCDC.7, STAT, and LYC take effect after
+// the current instruction.
+void PPU::writeIO(uint16_t address, uint8_t data)
+{
+    switch(address)
+    {
+        case 0xFF40:
+            // Only the first write before the PPU catches up is kept
+            if(lcd_on && !LCDC_changed)
+            {
+                LCDC_changed = true;
+                old_LCDC = LCDC;
+                LCDC_write_time = scheduler.now();
+            }
+            LCDC = data;
+            scheduleWriteEvent();
+            break;
+        // The mode and LY=LYC bits are read-only
+        case 0xFF41:
+            STAT = (STAT & 0b111) | (data & 0x78);
+            stat_changed = true;
+            scheduleWriteEvent();
             break;
+        case 0xFF42: SCY = data; break;
+        case 0xFF43: SCX = data; break;
+        case 0xFF44: break; // LY is read-only
+        case 0xFF45: LYC = data; stat_changed = true; scheduleWriteEvent(); break;
+        case 0xFF47: BGP = data; break;
+        case 0xFF48: OBP0 = data; break;
+        case 0xFF49: OBP1 = data; break;
+        case 0xFF4A: WY = data; break;
+        case 0xFF4B: WX = data; break;
+        default: break;
+    }
+}
+
+
+
+// Gets the last rendered frame, as palette indexes (0-3)
+const FrameBuffer& PPU::getFrameBuffer() const
+{
+    return frame_buffer;
+}
+
+
+
+// Switches to a new mode, updating STAT and the VRAM/OAM locks
+void PPU::setState(PPUState state, Memory& mem)
+{
+    ppu_state = state;
+    STAT = (STAT & ~0b11) | state;
+
+    // OAM is in use during OAM Search and Pixel Transfer, VRAM only during
+    // Pixel Transfer
+    mem.setOAMLock(state == OAMSearch || state == PixelTransfer);
+    mem.setVRAMLock(state == PixelTransfer);
+
+    updateSTAT(mem);
+}
+
+
+// Updates the LY=LYC flag, and requests a STAT interrupt on a rising edge
+void PPU::updateSTAT(Memory& mem)
+{
+    bool coincidence = lcd_on && (LY == LYC);
+    STAT = coincidence ? (STAT | 0b100) : (STAT & ~0b100);
+
+    bool line = (coincidence && (STAT & 0x40))
+             || (lcd_on && ppu_state == HBlank && (STAT & 0x08))
+             || (ppu_state == VBlank && (STAT & 0x10))
+             || (ppu_state == OAMSearch && (STAT & 0x20));
+
+    if(line && !stat_line) { interrupts.request(InterruptController::STAT); }
+    stat_line = line;
+}
+
+
+// Draws the background, window, and sprites of line LY into frame_buffer
+void PPU::renderScanline(Memory& mem)
+{
+    const uint8_t* vram = mem.getVRAMBank(0);
+    const uint8_t* oam = mem.getOAM();
+
+    // Color indexes before the palette, sprites need them for priority
+    std::array<uint8_t, GB_X_RES> bg_colors{};
+
+    // Gets the 2-bit color of a pixel in a tile, addressed according to LCDC.4
+    auto tilePixel = [&](uint8_t tile, uint8_t x, uint8_t y)
+    {
+        uint16_t address = (LCDC & 0x10) ? tile * 16
+                                         : 0x1000 + static_cast<int8_t>(tile) * 16;
+        uint8_t lsb = vram[address + y * 2];
+        uint8_t msb = vram[address + y * 2 + 1];
+        uint8_t bit = 7 - x;
+        return static_cast<uint8_t>((((msb >> bit) & 1) << 1) | ((lsb >> bit) & 1));
+    };
+
+    // Background, LCDC.0 disables both it and the window on the DMG
+    if(LCDC & 0x01)
+    {
+        uint16_t map = (LCDC & 0x08) ? 0x1C00 : 0x1800;
+        uint8_t y = SCY + LY;
+
+        for(uint32_t i = 0; i < GB_X_RES; i++)
+        {
+            uint8_t x = SCX + i;
+            uint8_t tile = vram[map + (y / 8) * 32 + (x / 8)];
+            bg_colors[i] = tilePixel(tile, x % 8, y % 8);
         }
+    }
+
+    // Window, drawn over the background from WX - 7
+    if((LCDC & 0x01) && (LCDC & 0x20) && LY >= WY && WX <= 166)
+    {
+        uint16_t map = (LCDC & 0x40) ? 0x1C00 : 0x1800;
+        int start = WX - 7;
+
+        for(int i = std::max(start, 0); i < static_cast<int>(GB_X_RES); i++)
+        {
+            uint8_t x = i - start;
+            uint8_t tile = vram[map + (window_line / 8) * 32 + (x / 8)];
+            bg_colors[i] = tilePixel(tile, x % 8, window_line % 8);
+        }
+
+        // The window only moves down on lines it was drawn on
+        window_line++;
+    }
+
+    // With LCDC.0 clear the background is white, whatever BGP maps color 0
+    // to. bg_colors stays 0, so every sprite is drawn over it.
+    uint8_t* line = frame_buffer.data() + LY * GB_X_RES;
+    for(uint32_t i = 0; i < GB_X_RES; i++)
+    {
+        line[i] = (LCDC & 0x01) ? (BGP >> (bg_colors[i] * 2)) & 0b11 : 0;
+    }
+
+    // Sprites
+    if(!(LCDC & 0x02)) { return; }
+
+    int height = (LCDC & 0x04) ? 16 : 8;
+
+    // Up to 10 sprites per line, in OAM order
+    std::array<uint8_t, 10> sprites{};
+    int sprite_count = 0;
+    for(int i = 0; i < 40 && sprite_count < 10; i++)
+    {
+        int row = LY + 16 - oam[i * 4];
+        if(row >= 0 && row < height) { sprites[sprite_count++] = i; }
+    }
+
+    // On the DMG, the sprite with the lower X is on top, then the one first in
+    // OAM. Sort by priority, and draw the lowest priority first.
+    std::stable_sort(sprites.begin(), sprites.begin() + sprite_count,
+                     [&](uint8_t a, uint8_t b) { return oam[a * 4 + 1] < oam[b * 4 + 1]; });
+
+    for(int s = sprite_count - 1; s >= 0; s--)
+    {
+        const uint8_t* sprite = oam + sprites[s] * 4;
+        int sprite_x = sprite[1] - 8;
+        uint8_t tile = sprite[2];
+        uint8_t flags = sprite[3];
+        uint8_t palette = (flags & 0x10) ? OBP1 : OBP0;
+
+        int row = LY + 16 - sprite[0];
+        if(flags & 0x40) { row = height - 1 - row; }
+        // 8x16 sprites ignore bit 0 of the tile index
+        if(height == 16) { tile &= 0xFE; }
+
+        // Sprites always use $8000 addressing
+        uint16_t address = tile * 16 + row * 2;
+        uint8_t lsb = vram[address];
+        uint8_t msb = vram[address + 1];
+
+        for(int px = 0; px < 8; px++)
+        {
+            int x = sprite_x + px;
+            if(x < 0 || x >= static_cast<int>(GB_X_RES)) { continue; }
+
+            uint8_t bit = (flags & 0x20) ? px : 7 - px;
+            uint8_t color = (((msb >> bit) & 1) << 1) | ((lsb >> bit) & 1);
+
+            // Color 0 is transparent, and flag bit 7 puts the background on top
+            if(color == 0) { continue; }
+            if((flags & 0x80) && bg_colors[x] != 0) { continue; }
+
+            line[x] = (palette >> (color * 2)) & 0b11;
         }
     }
+}
+
+
+
+// Copies the PPU's state and the last frame in and out of a save state.
+// The next event is restored by the Scheduler, and the VRAM and OAM locks
+// by Memory.
+void PPU::saveState(StateWriter& writer) const
+{
+    writer.write(ppu_state);
+    writer.write(last_update);
+    writer.write(lcd_on);
+    writer.write(scanl_cycle);
+    writer.write(window_line);
+    writer.write(stat_line);
+    writer.write(stat_changed);
+    writer.write(LCDC_changed);
+    writer.write(old_LCDC);
+    writer.write(LCDC_write_time);
+
+    writer.write(LCDC);
+    writer.write(SCY);
+    writer.write(SCX);
+    writer.write(STAT);
+    writer.write(LY);
+    writer.write(LYC);
+    writer.write(BGP);
+    writer.write(OBP0);
+    writer.write(OBP1);
+    writer.write(WY);
+    writer.write(WX);
+
+    writer.write(frame_buffer);
+}
+
+void PPU::loadState(StateReader& reader)
+{
+    reader.readEnum(ppu_state, PixelTransfer);
+    reader.read(last_update);
+    reader.read(lcd_on);
+    reader.read(scanl_cycle);
+    reader.read(window_line);
+    reader.read(stat_line);
+    reader.read(stat_changed);
+    reader.read(LCDC_changed);
+    reader.read(old_LCDC);
+    reader.read(LCDC_write_time);
+
+    reader.read(LCDC);
+    reader.read(SCY);
+    reader.read(SCX);
+    reader.read(STAT);
+    reader.read(LY);
+    reader.read(LYC);
+    reader.read(BGP);
+    reader.read(OBP0);
+    reader.read(OBP1);
+    reader.read(WY);
+    reader.read(WX);
 
-    writeRegisters(mem);
+    reader.read(frame_buffer);
 }
 
 
@@ -75,37 +490,3 @@ void PPU::dumpPPU()
         Logger::logDEBUG);
     log(format("--END PPU DUMP--"), Logger::logDEBUG);
 }
-
-
-// Reads each register's value from memory
-void PPU::readRegisters(Memory& mem)
-{
-    LCDC = mem.readByte(0xFF40);
-    SCX = mem.readByte(0xFF42);
-    SCY = mem.readByte(0xFF43);
-    STAT = mem.readByte(0xFF41);
-    LY = mem.readByte(0xFF44);
-    LYC = mem.readByte(0xFF45);
-    BGP = mem.readByte(0xFF47);
-    OBP0 = mem.readByte(0xFF48);
-    OBP1 = mem.readByte(0xFF49);
-    WY = mem.readByte(0xFF4A);
-    WX = mem.readByte(0xFF4B);
-}
-
-
-// Writes each registers value to memory
-void PPU::writeRegisters(Memory& mem) const
-{
-    mem.writeByte(0xFF40, LCDC);
-    mem.writeByte(0xFF42, SCX);
-    mem.writeByte(0xFF43, SCY);
-    mem.writeByte(0xFF41, STAT);
-    mem.writeByte(0xFF44, LY);
-    mem.writeByte(0xFF45, LYC);
-    mem.writeByte(0xFF47, BGP);
-    mem.writeByte(0xFF48, OBP0);
-    mem.writeByte(0xFF49, OBP1);
-    mem.writeByte(0xFF4A, WY);
-    mem.writeByte(0xFF4B, WX);
-}
\ No newline at end of file
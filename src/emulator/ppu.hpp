@@ -1,18 +1,38 @@
 #pragma once
 
 #include "../core.hpp"
-#include <queue>
 #include "memory.hpp"
-#include "../program/window.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+#include "savestate.hpp"
 
-class PPU
+// Owns the LCD registers $FF40-$FF45 and $FF47-$FF4B. DMA ($FF46) is left
+// to Memory.
+//
+// The PPU is only stepped when its scheduler event fires. The event is set
+// for the next mode change, which is the next time any register changes, and
+// for right after a write that the PPU has to react to.
+class PPU : public IODevice
 {
 public:
-    PPU();
+    PPU(Scheduler& _scheduler, InterruptController& _interrupts);
     ~PPU();
 
-    // Steps the PPU by a given number of cycles
-    void step(int steps, Memory& mem);
+    // LCD register access, for Memory
+    uint8_t readIO(uint16_t address) override;
+    void writeIO(uint16_t address, uint8_t data) override;
+
+    // Catches up to the scheduler's clock, and schedules the next event
+    void update(Memory& mem);
+
+    // Gets the last rendered frame, as palette indexes (0-3)
+    const FrameBuffer& getFrameBuffer() const;
+
+    // Copies the PPU's state and the last frame in and out of a save state.
+    // The next event is restored by the Scheduler, and the VRAM and OAM
+    // locks by Memory.
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
 
     // Dumps PPU information to the log
     void dumpPPU();
@@ -27,21 +47,51 @@ private:
         PixelTransfer = 3,
     } ppu_state;
 
+    // Length of each mode in cycles. PixelTransfer is fixed at its minimum,
+    // the rest of the scanline is HBlank.
+    static constexpr int OAM_SEARCH_CYCLES = 80;
+    static constexpr int PIXEL_TRANSFER_CYCLES = 172;
+    static constexpr int SCANLINE_CYCLES = 456;
+    static constexpr int VBLANK_START_LINE = 144;
+    static constexpr int LINES_PER_FRAME = 154;
+
+    Scheduler& scheduler;
+    InterruptController& interrupts;
+    uint64_t last_update; // Cycle the PPU has been stepped up to
+
+    bool lcd_on; // LCDC bit 7 as of the last step
     uint16_t scanl_cycle; // Current cycle in the scanline
+    uint8_t window_line; // Line of the window to draw next
+    bool stat_line; // STAT interrupt line, the interrupt fires on a rising edge
+    bool stat_changed; // STAT or LYC was written, the STAT line must be checked
+    // LCDC was written. The cycles up to the write are stepped with the old
+    // value before the new one takes effect.
+    bool LCDC_changed;
+    uint8_t old_LCDC;
+    uint64_t LCDC_write_time;
 
     uint8_t LCDC; // LCD Control - $FF40
-    uint8_t SCX, SCY; // Scroll X and Y - $FF42 and $FF43
+    uint8_t SCY, SCX; // Scroll Y and X - $FF42 and $FF43
     uint8_t STAT; // LCD Status - $FF41
     uint8_t LY, LYC; // Line Y and Line Y Compare - $FF44 and $FF45
     uint8_t BGP; // Background Palette Data - $FF47
     uint8_t OBP0, OBP1; // Object Palette Data - $FF48 and $FF49
     uint8_t WY, WX; // Window Y and X - $FF4A and $FF4B
 
-    std::queue<uint8_t> pixel_fifo{};
-    Window::PImage frame_buffer = {{}, 160, 144};
+    FrameBuffer frame_buffer{};
+
+    // Steps the PPU by a given number of cycles
+    void step(int steps, Memory& mem);
+    // Schedules the next mode change, or nothing while the LCD is off
+    void scheduleNextEvent();
+    // Has the PPU handle a register write after the current instruction
+    void scheduleWriteEvent();
+
+    // Switches to a new mode, updating STAT and the VRAM/OAM locks
+    void setState(PPUState state, Memory& mem);
+    // Updates the LY=LYC flag, and requests a STAT interrupt on a rising edge
+    void updateSTAT(Memory& mem);
 
-    // Reads each registers' value from memory
-    void readRegisters(Memory& mem);
-    // Writes each registers' value to memory
-    void writeRegisters(Memory& mem) const;
-};
\ No newline at end of file
+    // Draws the background, window, and sprites of line LY into frame_buffer
+    void renderScanline(Memory& mem);
+};
@@ -0,0 +1,59 @@
+#include "savestate.hpp"
+#include "../program/logger.hpp"
+#include <filesystem>
+#include <fstream>
+
+using Logger::log;
+
+// Writes a save state to a file, replacing the whole file. Returns false if
+// it can't be written.
+bool writeStateFile(const std::string& path, const std::vector<uint8_t>& state)
+{
+    // Write to a temporary file, then swap it in, so a crash mid-write
+    // cannot leave half of a state behind
+    std::string temp_path = path + ".tmp";
+    std::ofstream file(temp_path, std::ios_base::out | std::ios_base::binary
+                                  | std::ios_base::trunc);
+    file.write((const char*)(state.data()), state.size());
+    file.close();
+
+    std::error_code error;
+    if(file)
+    {
+        std::filesystem::rename(temp_path, path, error);
+    }
+
+    if(!file || error)
+    {
+        log("STATE: Could not write save state to " + path, Logger::logERROR);
+        return false;
+    }
+
+    return true;
+}
+
+
+
+// Reads a whole save state file into state. Returns false if it can't be read.
+bool readStateFile(const std::string& path, std::vector<uint8_t>& state)
+{
+    std::error_code error;
+    uintmax_t size = std::filesystem::file_size(path, error);
+    if(error)
+    {
+        log("STATE: No save state at " + path, Logger::logERROR);
+        return false;
+    }
+
+    std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+    state.resize(size);
+    file.read((char*)(state.data()), size);
+
+    if(!file)
+    {
+        log("STATE: Could not read save state from " + path, Logger::logERROR);
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,103 @@
+// Binary save states. A state is a short header, then each component's fields
+// in a fixed order. Components copy their fields in and out with StateWriter
+// and StateReader, which are plain memcpys, so a whole state is saved or
+// loaded in microseconds.
+//
+// Fields are copied in host byte order, so states are only portable between
+// machines of the same endianness. SAVE_STATE_VERSION must be bumped whenever
+// a component's fields change.
+#pragma once
+
+#include "../core.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+constexpr std::array<char, 4> SAVE_STATE_MAGIC = { 'M', 'G', 'B', 'S' };
+constexpr uint32_t SAVE_STATE_VERSION = 2;
+
+// Appends fields to a save state
+class StateWriter
+{
+public:
+    StateWriter(std::vector<uint8_t>& _out) : out(_out) {}
+
+    template<typename T> void write(const T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Fields must be plain data");
+        writeBytes(&value, sizeof(T));
+    }
+
+    void writeBytes(const void* data, size_t size)
+    {
+        if(size == 0) { return; }
+
+        size_t offset = out.size();
+        out.resize(offset + size);
+        std::memcpy(out.data() + offset, data, size);
+    }
+
+private:
+    std::vector<uint8_t>& out;
+};
+
+// Reads fields back out of a save state, in the order they were written.
+// Throws std::out_of_range if the state is too short, or a bool or enum field
+// holds a value it can't.
+class StateReader
+{
+public:
+    StateReader(const std::vector<uint8_t>& _state) : state(_state) {}
+
+    template<typename T> void read(T& value)
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "Fields must be plain data");
+        static_assert(!std::is_enum_v<T>, "Enums must be read with readEnum()");
+
+        // Any byte but 0 or 1 in a bool is undefined behaviour
+        if constexpr(std::is_same_v<T, bool>)
+        {
+            uint8_t byte;
+            readBytes(&byte, 1);
+            if(byte > 1) { throw std::out_of_range("Save state has an invalid flag"); }
+            value = byte;
+        } else {
+            readBytes(&value, sizeof(T));
+        }
+    }
+
+    // Reads an enum, which must be between 0 and last
+    template<typename T> void readEnum(T& value, T last)
+    {
+        static_assert(std::is_enum_v<T>, "Only for enums");
+
+        // Negative values become too large to pass, once unsigned
+        using Raw = std::make_unsigned_t<std::underlying_type_t<T>>;
+        Raw raw;
+        read(raw);
+        if(raw > static_cast<Raw>(last))
+        {
+            throw std::out_of_range("Save state has an invalid mode");
+        }
+        value = static_cast<T>(raw);
+    }
+
+    void readBytes(void* data, size_t size)
+    {
+        if(size == 0) { return; }
+        if(size > state.size() - offset) { throw std::out_of_range("Save state is truncated"); }
+
+        std::memcpy(data, state.data() + offset, size);
+        offset += size;
+    }
+
+private:
+    const std::vector<uint8_t>& state;
+    size_t offset = 0;
+};
+
+// Writes a save state to a file, replacing the whole file. Returns false if
+// it can't be written.
+bool writeStateFile(const std::string& path, const std::vector<uint8_t>& state);
+// Reads a whole save state file into state. Returns false if it can't be read.
+bool readStateFile(const std::string& path, std::vector<uint8_t>& state);
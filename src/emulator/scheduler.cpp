@@ -0,0 +1,99 @@
+#include "scheduler.hpp"
+#include <algorithm>
+
+Scheduler::Scheduler()
+{
+    deadlines.fill(NEVER);
+}
+
+Scheduler::~Scheduler() = default;
+
+
+
+// Sets the deadline of an event type, replacing any pending one
+void Scheduler::schedule(EventType type, uint64_t time)
+{
+    deadlines[static_cast<size_t>(type)] = time;
+
+    heap.push_back({ time, type });
+    std::push_heap(heap.begin(), heap.end(), laterThan);
+
+    dropStale();
+}
+
+// Removes the pending deadline of an event type, if any
+void Scheduler::cancel(EventType type)
+{
+    deadlines[static_cast<size_t>(type)] = NEVER;
+    dropStale();
+}
+
+// Gets the pending deadline of an event type, or NEVER
+uint64_t Scheduler::deadline(EventType type) const
+{
+    return deadlines[static_cast<size_t>(type)];
+}
+
+
+
+// Pops the earliest event that is due by now into type. Returns false if
+// none are due.
+bool Scheduler::popDue(EventType& type)
+{
+    if(heap.empty() || heap.front().time > clock) { return false; }
+
+    type = heap.front().type;
+    deadlines[static_cast<size_t>(type)] = NEVER;
+
+    std::pop_heap(heap.begin(), heap.end(), laterThan);
+    heap.pop_back();
+    dropStale();
+
+    return true;
+}
+
+
+
+// Copies the clock and the pending deadlines in and out of a save state
+void Scheduler::saveState(StateWriter& writer) const
+{
+    writer.write(clock);
+    writer.write(deadlines);
+}
+
+void Scheduler::loadState(StateReader& reader)
+{
+    reader.read(clock);
+    reader.read(deadlines);
+
+    // Stale entries aren't saved, so the heap is rebuilt from the deadlines
+    heap.clear();
+    for(size_t i = 0; i < deadlines.size(); i++)
+    {
+        if(deadlines[i] != NEVER) { heap.push_back({ deadlines[i], static_cast<EventType>(i) }); }
+    }
+    std::make_heap(heap.begin(), heap.end(), laterThan);
+    dropStale();
+}
+
+
+
+// Orders the heap so that the earliest event is at the front
+bool Scheduler::laterThan(const Event& a, const Event& b)
+{
+    return a.time > b.time;
+}
+
+// Drops stale entries from the top of the heap, and updates next_deadline.
+// Called after every change to the heap.
+void Scheduler::dropStale()
+{
+    while(!heap.empty()
+       && heap.front().time != deadlines[static_cast<size_t>(heap.front().type)])
+    {
+        std::pop_heap(heap.begin(), heap.end(), laterThan);
+        heap.pop_back();
+    }
+
+    next_deadline = heap.empty() ? NEVER : heap.front().time;
+}
@@ -0,0 +1,76 @@
+// Keeps the emulated clock, and a min-heap of cycle-stamped deadlines for the
+// components. The CPU runs freely until the earliest deadline, then the
+// component that owns it catches up. Components are only stepped when one of
+// their events fires, instead of after every instruction.
+#pragma once
+
+#include "../core.hpp"
+#include "savestate.hpp"
+#include <vector>
+
+// Each source of events has one pending deadline at most
+enum class EventType : uint8_t
+{
+    PPU, // Next PPU mode change, or a register write that needs handling
+    TIMER, // TIMA reload after an overflow
+    COUNT,
+};
+
+class Scheduler
+{
+public:
+    Scheduler();
+    ~Scheduler();
+
+    // Deadline of an event type with nothing scheduled
+    static constexpr uint64_t NEVER = UINT64_MAX;
+
+    // Current cycle, counted from power-on
+    uint64_t now() const { return clock; }
+    // Moves the clock forward. Events are not fired.
+    void advance(uint64_t cycles) { clock += cycles; }
+
+    // Cycle of the earliest pending event, or NEVER
+    uint64_t nextDeadline() const { return next_deadline; }
+
+    // Compiled CPU code advances the clock and polls the next deadline
+    // directly, instead of returning after every instruction
+    uint64_t* clockAddress() { return &clock; }
+    const uint64_t* nextDeadlineAddress() const { return &next_deadline; }
+
+    // Sets the deadline of an event type, replacing any pending one
+    void schedule(EventType type, uint64_t time);
+    // Removes the pending deadline of an event type, if any
+    void cancel(EventType type);
+    // Gets the pending deadline of an event type, or NEVER
+    uint64_t deadline(EventType type) const;
+
+    // Pops the earliest event that is due by now into type. Returns false if
+    // none are due.
+    bool popDue(EventType& type);
+
+    // Copies the clock and the pending deadlines in and out of a save state
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
+
+private:
+    struct Event
+    {
+        uint64_t time;
+        EventType type;
+    };
+
+    uint64_t clock = 0;
+    uint64_t next_deadline = NEVER; // Time of the front of the heap
+
+    // Replacing or cancelling an event leaves its old entry in the heap. Entries
+    // that don't match deadlines[type] are stale, and skipped when popped.
+    std::vector<Event> heap;
+    std::array<uint64_t, static_cast<size_t>(EventType::COUNT)> deadlines;
+
+    // Orders the heap so that the earliest event is at the front
+    static bool laterThan(const Event& a, const Event& b);
+    // Drops stale entries from the top of the heap, and updates next_deadline.
+    // Called after every change to the heap.
+    void dropStale();
+};
@@ -0,0 +1,256 @@
+#include "timer.hpp"
+#include "../program/logger.hpp"
+#include <algorithm>
+
+using Logger::log, fmt::format;
+
+Timer::Timer(Scheduler& _scheduler, InterruptController& _interrupts)
+    : scheduler(_scheduler), interrupts(_interrupts)
+{
+    div_base = 0;
+    tima_count = 0;
+    tima_sync = 0;
+    reload_time = 0;
+    TMA = 0;
+    TAC = 0;
+    div_polled = false;
+    tima_polled = false;
+}
+
+Timer::~Timer() = default;
+
+
+// Catches up to the scheduler's clock, and schedules the next event
+void Timer::update()
+{
+    catchUp();
+    scheduleNextEvent();
+}
+
+
+
+// Cycles between falling edges of the counter bit selected by TAC
+uint64_t Timer::edgePeriod() const
+{
+    // Bits 9, 3, 5, and 7. Each falls once every two of its own periods.
+    static constexpr std::array<uint64_t, 4> PERIODS = { 1024, 16, 64, 256 };
+    return PERIODS[TAC & 0b11];
+}
+
+// Returns true if the counter bit selected by TAC, ANDed with the enable
+// bit, is set at cycle time. TIMA counts the falling edges of this.
+bool Timer::edgeSignal(uint64_t time) const
+{
+    return (TAC & 0b100) && ((time - div_base) & (edgePeriod() / 2));
+}
+
+// Cycle of the nth falling edge after cycle time
+uint64_t Timer::edgeTime(uint64_t time, uint64_t n) const
+{
+    uint64_t period = edgePeriod();
+    return div_base + ((time - div_base) / period + n) * period;
+}
+
+
+
+// Brings TIMA up to the scheduler's clock
+void Timer::catchUp()
+{
+    uint64_t now = scheduler.now();
+
+    while(true)
+    {
+        if(tima_count > 0xFF)
+        {
+            if(now < reload_time) { break; }
+
+            tima_count = TMA;
+            tima_sync = reload_time;
+            interrupts.request(InterruptController::TIMER);
+            continue;
+        }
+
+        if(!(TAC & 0b100)) { break; }
+
+        uint64_t period = edgePeriod();
+        uint64_t edges = (now - div_base) / period - (tima_sync - div_base) / period;
+        uint64_t to_overflow = 0x100 - tima_count;
+
+        if(edges < to_overflow)
+        {
+            tima_count += edges;
+            break;
+        }
+
+        // Edges stop counting at the overflow. The next one is at least 16
+        // cycles away, after the reload.
+        tima_sync = edgeTime(tima_sync, to_overflow);
+        tima_count = 0x100;
+        reload_time = tima_sync + RELOAD_DELAY;
+    }
+
+    tima_sync = now;
+}
+
+
+// Adds one to TIMA at the current cycle, for the DIV and TAC glitches
+void Timer::increment()
+{
+    if(tima_count > 0xFF) { return; }
+
+    tima_count++;
+    if(tima_count > 0xFF) { reload_time = scheduler.now() + RELOAD_DELAY; }
+}
+
+
+// Schedules the next overflow or reload, if there is one
+void Timer::scheduleNextEvent()
+{
+    if(tima_count > 0xFF)
+    {
+        scheduler.schedule(EventType::TIMER, reload_time);
+
+    } else if(TAC & 0b100) {
+
+        uint64_t overflow = edgeTime(tima_sync, 0x100 - tima_count);
+        scheduler.schedule(EventType::TIMER, overflow + RELOAD_DELAY);
+
+    } else {
+
+        scheduler.cancel(EventType::TIMER);
+    }
+}
+
+
+
+// Cycle that DIV or TIMA can next change, if either has been read since
+// the last call, otherwise NEVER. An idle loop polling them can be skipped
+// up to then, instead of up to the next event.
+uint64_t Timer::takePolledChange()
+{
+    uint64_t now = scheduler.now();
+    uint64_t change = Scheduler::NEVER;
+
+    if(div_polled)
+    {
+        change = div_base + ((now - div_base) / 256 + 1) * 256;
+    }
+
+    if(tima_polled)
+    {
+        catchUp();
+        if(tima_count > 0xFF) { change = std::min(change, reload_time); }
+        else if(TAC & 0b100) { change = std::min(change, edgeTime(now, 1)); }
+    }
+
+    div_polled = false;
+    tima_polled = false;
+    return change;
+}
+
+
+
+// Reads a timer register
+uint8_t Timer::readIO(uint16_t address)
+{
+    switch(address)
+    {
+        case 0xFF04:
+            div_polled = true;
+            return ((scheduler.now() - div_base) >> 8) & 0xFF;
+
+        case 0xFF05:
+            tima_polled = true;
+            catchUp();
+            return tima_count & 0xFF;
+
+        case 0xFF06: return TMA;
+        default: return TAC | 0xF8; // Unused bits read as 1
+    }
+}
+
+
+// Writes a timer register
+void Timer::writeIO(uint16_t address, uint8_t data)
+{
+    catchUp();
+    uint64_t now = scheduler.now();
+
+    switch(address)
+    {
+        case 0xFF04:
+        {
+            // Any write resets the counter. If the selected bit was set, that
+            // is a falling edge.
+            if(edgeSignal(now)) { increment(); }
+            div_base = now;
+            break;
+        }
+
+        case 0xFF05:
+        {
+            // Writing during the reload delay cancels the reload
+            tima_count = data;
+            break;
+        }
+
+        case 0xFF06:
+        {
+            // A pending reload uses the new value
+            TMA = data;
+            break;
+        }
+
+        default:
+        {
+            // Disabling the timer, or selecting a bit that is clear, while
+            // the selected bit is set is also a falling edge
+            bool before = edgeSignal(now);
+            TAC = data & 0b111;
+            if(before && !edgeSignal(now)) { increment(); }
+            break;
+        }
+    }
+
+    scheduleNextEvent();
+}
+
+
+
+// Copies the counter and registers in and out of a save state. The
+// overflow event is restored by the Scheduler.
+void Timer::saveState(StateWriter& writer) const
+{
+    writer.write(div_base);
+    writer.write(tima_count);
+    writer.write(tima_sync);
+    writer.write(reload_time);
+    writer.write(TMA);
+    writer.write(TAC);
+}
+
+void Timer::loadState(StateReader& reader)
+{
+    reader.read(div_base);
+    reader.read(tima_count);
+    reader.read(tima_sync);
+    reader.read(reload_time);
+    reader.read(TMA);
+    reader.read(TAC);
+
+    div_polled = false;
+    tima_polled = false;
+}
+
+
+
+// Dumps timer information to the log
+void Timer::dumpTimer()
+{
+    log("--BEGIN TIMER DUMP--", Logger::logDEBUG);
+    log(format("DIV: 0x{:02X}, TIMA: 0x{:02X}, TMA: 0x{:02X}, TAC: 0b{:08b}",
+               ((scheduler.now() - div_base) >> 8) & 0xFF, tima_count & 0xFF,
+               TMA, TAC | 0xF8),
+        Logger::logDEBUG);
+    log("--END TIMER DUMP--", Logger::logDEBUG);
+}
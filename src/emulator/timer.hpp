@@ -0,0 +1,75 @@
+#pragma once
+
+#include "../core.hpp"
+#include "memory.hpp"
+#include "scheduler.hpp"
+#include "interrupts.hpp"
+#include "savestate.hpp"
+
+// Owns the timer registers $FF04-$FF07. Nothing is ticked per cycle.
+//
+// DIV is the upper byte of a 16-bit counter that runs from the last DIV
+// write, so it is worked out from the scheduler's clock when read. TIMA
+// counts the falling edges of the counter bit selected by TAC. It is brought
+// up to date when accessed, and the scheduler event is set for its next
+// overflow, which only moves when DIV, TIMA, or TAC are written.
+class Timer : public IODevice
+{
+public:
+    Timer(Scheduler& _scheduler, InterruptController& _interrupts);
+    ~Timer();
+
+    // Timer register access, for Memory
+    uint8_t readIO(uint16_t address) override;
+    void writeIO(uint16_t address, uint8_t data) override;
+
+    // Catches up to the scheduler's clock, and schedules the next event
+    void update();
+
+    // Cycle that DIV or TIMA can next change, if either has been read since
+    // the last call, otherwise NEVER. An idle loop polling them can be skipped
+    // up to then, instead of up to the next event.
+    uint64_t takePolledChange();
+
+    // Copies the counter and registers in and out of a save state. The
+    // overflow event is restored by the Scheduler.
+    void saveState(StateWriter& writer) const;
+    void loadState(StateReader& reader);
+
+    // Dumps timer information to the log
+    void dumpTimer();
+
+private:
+    Scheduler& scheduler;
+    InterruptController& interrupts;
+
+    // TIMA is reloaded from TMA 4 cycles after it overflows, and reads 0 until
+    // then
+    static constexpr int RELOAD_DELAY = 4;
+
+    uint64_t div_base; // Cycle the counter was last reset on
+    // TIMA as of tima_sync. 0x100 between an overflow and the reload.
+    uint16_t tima_count;
+    uint64_t tima_sync;
+    uint64_t reload_time; // Cycle of the pending reload
+    uint8_t TMA; // Timer Modulo - $FF06
+    uint8_t TAC; // Timer Control - $FF07, low 3 bits
+
+    bool div_polled; // DIV has been read since the last takePolledChange()
+    bool tima_polled; // Same for TIMA
+
+    // Cycles between falling edges of the counter bit selected by TAC
+    uint64_t edgePeriod() const;
+    // Returns true if the counter bit selected by TAC, ANDed with the enable
+    // bit, is set at cycle time. TIMA counts the falling edges of this.
+    bool edgeSignal(uint64_t time) const;
+    // Cycle of the nth falling edge after cycle time
+    uint64_t edgeTime(uint64_t time, uint64_t n) const;
+
+    // Brings TIMA up to the scheduler's clock
+    void catchUp();
+    // Adds one to TIMA at the current cycle, for the DIV and TAC glitches
+    void increment();
+    // Schedules the next overflow or reload, if there is one
+    void scheduleNextEvent();
+};
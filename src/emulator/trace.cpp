@@ -0,0 +1,20 @@
+#include "trace.hpp"
+
+using Logger::log, fmt::format;
+
+// Logs the buffer's contents, oldest first
+void TraceBuffer::dumpTrace() const
+{
+    log(format("--BEGIN TRACE DUMP ({:d} instructions)--", size()), Logger::logDEBUG);
+
+    for(size_t i = 0; i < size(); i++)
+    {
+        const TraceEntry& entry = at(i);
+        log(format("{:s} | {:s}",
+                   insToString(entry.ins), regsToString(entry.regs)),
+            Logger::logDEBUG
+        );
+    }
+
+    log("--END TRACE DUMP--", Logger::logDEBUG);
+}
@@ -0,0 +1,76 @@
+// Instruction tracing for the emulator core.
+//
+// EXTREME-level tracing is only compiled in when MOONGB_TRACE is defined (see
+// the MOONGB_TRACE CMake option). Without it, TRACE_LOG compiles to nothing,
+// and the CPU holds an empty stand-in instead of the trace buffer. With it,
+// messages are only formatted if the logger will actually output them.
+#pragma once
+
+#include "../core.hpp"
+#include "gbdefs.hpp"
+
+#ifdef MOONGB_TRACE
+static constexpr bool TRACE_ENABLED = true;
+#else
+static constexpr bool TRACE_ENABLED = false;
+#endif
+
+// Logs a fmt::format message at logEXTREME. The arguments are not evaluated
+// unless tracing is compiled in and the log level allows it.
+#define TRACE_LOG(...)                                                        \
+    do {                                                                      \
+        if constexpr(TRACE_ENABLED)                                           \
+        {                                                                     \
+            if(Logger::willLog(Logger::logEXTREME))                           \
+            {                                                                 \
+                Logger::log(fmt::format(__VA_ARGS__), Logger::logEXTREME);    \
+            }                                                                 \
+        }                                                                     \
+    } while(0)
+
+// One executed instruction, stored in binary form
+struct TraceEntry
+{
+    Instruction ins;
+    RegisterSet regs; // Register state after the instruction
+};
+
+// Fixed-size ring buffer of the most recently executed instructions
+class TraceBuffer
+{
+public:
+    // Must be a power of two
+    static constexpr size_t SIZE = 4096;
+
+    // Stores an entry, overwriting the oldest one if full
+    inline void record(const TraceEntry& entry)
+    {
+        entries[head & (SIZE - 1)] = entry;
+        head++;
+    }
+
+    // Number of valid entries
+    size_t size() const { return head < SIZE ? head : SIZE; }
+
+    // Gets an entry, where 0 is the oldest
+    const TraceEntry& at(size_t index) const
+    {
+        size_t oldest = head < SIZE ? 0 : head - SIZE;
+        return entries[(oldest + index) & (SIZE - 1)];
+    }
+
+    // Logs the buffer's contents, oldest first
+    void dumpTrace() const;
+
+private:
+    std::array<TraceEntry, SIZE> entries{};
+    size_t head = 0;
+};
+
+// Stands in for TraceBuffer when tracing is compiled out. Holding it with
+// [[no_unique_address]] takes no space.
+struct EmptyTraceBuffer
+{
+    inline void record(const TraceEntry&) {}
+    void dumpTrace() const {}
+};
@@ -30,6 +30,8 @@ const map<string, string> DEF_OPTIONS {
     {"LogToLogFile", "1"},
     {"WinSizeX", "640"},
     {"WinSizeY", "576"},
+    // Times each memory access. Slower, for test ROMs that need it.
+    {"AccurateTiming", "0"},
     // Default color palette based off of Gameboy Pocket
     {"ColorPalette", "{196,207,161,000} " // BG
                      "{196,207,161,000} " // Tile0
@@ -6,7 +6,7 @@
 #include <filesystem>
 #include <fstream>
 #include <ctime>
-#include "config.hpp"
+#include "../core.hpp"
 
 using std::string, std::cout, std::cerr, std::ofstream, fmt::format;
 
@@ -22,21 +22,32 @@ bool log_to_logfile;
 string log_file_path;
 ofstream LogFile;
 
+// Returns true if a message of the given level would be output. Check this
+// before formatting expensive messages.
+bool Logger::willLog(LogLevel level)
+{
+    return level <= log_level && (log_to_stdout || log_to_logfile);
+}
+
+
 string getTimestamp();
 
 
-// Use to initialize logger AFTER config has loaded
-int Logger::initLogger()
+// Initializes the logger. The log file is created as MoonGB.log inside of
+// log_directory if to_logfile is set.
+int Logger::initLogger(const string& log_directory, LogLevel level,
+                       bool to_stdout, bool to_logfile)
 {
     using std::filesystem::exists;
     using std::filesystem::create_directories;
     using std::filesystem::filesystem_error;
 
-    // For some reason stoi tries grabbing param to getOption instead of return
-    log_file_path = Config::getOption("PrefPath");
-    log_level = static_cast<LogLevel>(atoi(Config::getOption("LogLevel").c_str()));
-    log_to_stdout = atoi(Config::getOption("LogToStdout").c_str());
-    log_to_logfile = atoi(Config::getOption("LogToLogFile").c_str());
+    log_file_path = log_directory;
+    log_level = level;
+    log_to_stdout = to_stdout;
+    log_to_logfile = to_logfile;
+
+    if(!log_to_logfile) { return 0; }
 
     try {
         if(!exists(log_file_path)) { create_directories(log_file_path); }
@@ -17,10 +17,13 @@ enum LogLevel
     logVERBOSE = 2, // Log program information
     logDEBUG = 3,   // Log emulation errors
     logEXTREME = 4, // Log emulation info (SLOW AND BIG!) (like multiple GB log files)
+                    // Only logged by builds with MOONGB_TRACE enabled
 };
 
-// Use to initialize logger AFTER config has loaded
-int initLogger();
+// Initializes the logger. The log file is created as MoonGB.log inside of
+// log_directory if to_logfile is set.
+int initLogger(const std::string& log_directory, LogLevel level,
+               bool to_stdout, bool to_logfile);
 
 // Closes the LogFile to properly clear buffers
 void closeLogger();
@@ -28,4 +31,8 @@ void closeLogger();
 // Puts a message in the console and/or log file.
 void log(const std::string& message, LogLevel level);
 
+// Returns true if a message of the given level would be output. Check this
+// before formatting expensive messages.
+bool willLog(LogLevel level);
+
 };
@@ -18,7 +18,12 @@ using std::string, Logger::log, std::unique_ptr, std::make_unique;
 ProgramStates programState = STOPPED;
 
 GUI::GUIController gui;
-unique_ptr<Gameboy> gb;
+unique_ptr<Emulator> gb;
+
+// Reused by every save and load, so neither allocates
+std::vector<uint8_t> state_buffer;
+// Save states sit next to the ROM, like the .sav file
+string getStateFilePath(int slot);
 
 constexpr double MAX_FRAMERATE = 59.7;
 uint64_t frameStart, frameEnd;
@@ -27,8 +32,16 @@ double delta;
 
 void Program::initProgram()
 {
+    using Config::getOption;
+
     Config::loadConfigFile();
-    Logger::initLogger();
+    // For some reason stoi tries grabbing param to getOption instead of return
+    Logger::initLogger(
+        getOption("PrefPath"),
+        static_cast<Logger::LogLevel>(atoi(getOption("LogLevel").c_str())),
+        atoi(getOption("LogToStdout").c_str()),
+        atoi(getOption("LogToLogFile").c_str())
+    );
     log("Starting MoonGB v" VERSION, Logger::logVERBOSE);
     Window::initWindow();
     log("PROGRAM: Fully initialized", Logger::logVERBOSE);
@@ -83,6 +96,19 @@ void Program::beginProgramLoop()
                     case SDLK_ESCAPE:
                     {
                         programState = MENU;
+                        break;
+                    }
+                    // F1-F9 load a save state slot, Shift+F1-F9 save to it
+                    case SDLK_F1: case SDLK_F2: case SDLK_F3:
+                    case SDLK_F4: case SDLK_F5: case SDLK_F6:
+                    case SDLK_F7: case SDLK_F8: case SDLK_F9:
+                    {
+                        if(event.key.repeat) { break; }
+
+                        int slot = event.key.keysym.sym - SDLK_F1 + 1;
+                        if(event.key.keysym.mod & KMOD_SHIFT) { saveStateSlot(slot); }
+                        else { loadStateSlot(slot); }
+                        break;
                     }
                     }
                 }
@@ -110,12 +136,12 @@ void Program::beginProgramLoop()
                 break;
             }
 
-            while(gb->getCycle() < gb->getCyclesPerFrame() && programState == RUNNING)
-            {
-                gb->step();
-            }
-            gb->resetCycle();
+            gb->runFrame();
             log("PROGRAM: Finished frame.", Logger::logEXTREME);
+            Window::drawFrame(gb->getFrameBuffer().data());
+
+            // STOP shuts down the emulator
+            if(gb->isStopped()) { programState = STOPPED; }
 
             break;
         }
@@ -181,7 +207,12 @@ void Program::startEmulator()
         }
 
         try {
-            gb = make_unique<Gameboy>(path);
+            if(atoi(Config::getOption("AccurateTiming").c_str()))
+            {
+                gb = make_unique<Gameboy<CycleAccuracy>>(path);
+            } else {
+                gb = make_unique<Gameboy<FastAccuracy>>(path);
+            }
         } catch(std::runtime_error& ex) {
             continue;
         } catch(std::invalid_argument& ex) {
@@ -206,6 +237,45 @@ void Program::quitEmulator()
 }
 
 
+// Saves the running emulator to a numbered save state slot
+void Program::saveStateSlot(int slot)
+{
+    if(!gb) { return; }
+
+    string path = getStateFilePath(slot);
+    gb->saveState(state_buffer);
+    if(writeStateFile(path, state_buffer))
+    {
+        log("PROGRAM: Saved state to " + path, Logger::logVERBOSE);
+    }
+}
+
+
+// Loads a numbered save state slot into the running emulator
+void Program::loadStateSlot(int slot)
+{
+    if(!gb) { return; }
+
+    string path = getStateFilePath(slot);
+    if(readStateFile(path, state_buffer) && gb->loadState(state_buffer))
+    {
+        log("PROGRAM: Loaded state from " + path, Logger::logVERBOSE);
+    }
+}
+
+
+// Save states sit next to the ROM, like the .sav file
+string getStateFilePath(int slot)
+{
+    string path = gb->getRomFilePath();
+    size_t extension_pos = path.find_last_of('.');
+    if(extension_pos != string::npos) { path.erase(extension_pos); }
+
+    return path + fmt::format(".ss{:d}", slot);
+}
+
+
+
 ProgramStates Program::getProgramState()
 {
     return programState;
@@ -26,6 +26,11 @@ void startEmulator();
 // Closes the emulator if running and switches back to the menu.
 void quitEmulator();
 
+// Saves the running emulator to a numbered save state slot
+void saveStateSlot(int slot);
+// Loads a numbered save state slot into the running emulator
+void loadStateSlot(int slot);
+
 ProgramStates getProgramState();
 void setProgramState(ProgramStates state);
 
@@ -19,6 +19,11 @@ array<SDL_Color, 5> color_palette;
 
 SDL_Texture* charMap = nullptr;
 
+// Frames are converted into this texture, then copied to the screen
+SDL_Texture* frameTexture = nullptr;
+// color_palette in frameTexture's ARGB8888 format, always opaque
+array<uint32_t, 5> palette_lut{};
+
 void Window::initWindow()
 {
     using std::stoi;
@@ -108,6 +113,23 @@ void Window::initWindow()
     SDL_Color color = color_palette[4];
     SDL_SetTextureColorMod(charMap, color.r, color.g, color.b);
 
+    frameTexture = SDL_CreateTexture(
+                   renderer,
+                   SDL_PIXELFORMAT_ARGB8888,
+                   SDL_TEXTUREACCESS_STREAMING,
+                   GB_X_RES,
+                   GB_Y_RES
+                   );
+
+    if(frameTexture == nullptr)
+    {
+        log(format("WINDOW: Could not create frame texture! {:s}",
+                    SDL_GetError()), Logger::logERROR);
+        exit(1);
+    }
+    // PImages leave BG pixels transparent
+    SDL_SetTextureBlendMode(frameTexture, SDL_BLENDMODE_BLEND);
+
     // Initial render to screen, window will not show up without it
     clearWindow();
     updateWindow();
@@ -118,6 +140,7 @@ void Window::initWindow()
 
 void Window::closeWindow()
 {
+    SDL_DestroyTexture(frameTexture);
     SDL_DestroyTexture(charMap);
     SDL_DestroyWindow(window);
     // Causes Segfault. Does DestroyWindow also destroy attached renderers?
@@ -154,6 +177,13 @@ void Window::refreshColorPalette()
     using Config::stringToPalette, Config::getOption;
     color_palette = stringToPalette(getOption("ColorPalette"));
 
+    for(size_t i = 0; i < color_palette.size(); i++)
+    {
+        SDL_Color c = color_palette[i];
+        palette_lut[i] = 0xFF000000 | ((uint32_t)c.r << 16)
+                       | ((uint32_t)c.g << 8) | c.b;
+    }
+
     // Label color is always darkest, for simplicity
     SDL_Color color = color_palette[TILE3];
     SDL_SetTextureColorMod(charMap, color.r, color.g, color.b);
@@ -182,33 +212,61 @@ void Window::renderWindowToLogical(int windowX, int windowY,
 
 // Drawing stuff //
 
-// Draws an array of PaletteIDs to the screen
-void Window::drawPImage(const PaletteID* data, int x, int y, int width, int height)
+// Converts width*height values into the top-left of frameTexture, with
+// to_pixel giving each value's ARGB8888 color, then copies it to the screen
+// at x, y.
+template<typename T, typename F>
+static void drawToFrameTexture(const T* data, int x, int y, int width, int height,
+                               F to_pixel)
 {
-    // NOTE: This can and should be optimized. Probably by using a surface.
+    SDL_Rect area = {0, 0, width, height};
+    void* pixels;
+    int pitch;
 
-    // Tiles are stored into vectors of points to call SDL_RenderDrawPoints()
-    // a few times instead of SDL_RenderDrawPoint() 23,040 times.
-    array<vector<SDL_Point>, 5> points{};
+    if(SDL_LockTexture(frameTexture, &area, &pixels, &pitch) != 0)
+    {
+        log(format("WINDOW: Could not lock frame texture! {:s}",
+                   SDL_GetError()), Logger::logERROR);
+        return;
+    }
 
-    for (int i = 0; i < width * height; i++) {
-        SDL_Point position{(x + (i % width)), (y + (i/width))};
-        int TileID = data[i];
-        // Push location into correct vector of tiles
-        points[TileID].push_back(position);
+    for(int row = 0; row < height; row++)
+    {
+        uint32_t* line = (uint32_t*)((uint8_t*)pixels + row * pitch);
+        const T* source = data + row * width;
+        for(int col = 0; col < width; col++)
+        {
+            line[col] = to_pixel(source[col]);
+        }
     }
 
-    // Skip index 0 because no need to draw BG pixels, since BG is BG-colored
-    for(size_t i = 1; i < points.size(); i++)
+    SDL_UnlockTexture(frameTexture);
+
+    SDL_Rect destination = {x, y, width, height};
+    SDL_RenderCopy(renderer, frameTexture, &area, &destination);
+}
+
+// Draws an array of PaletteIDs to the screen, up to 160x144. BG pixels are
+// skipped, so whatever is under them shows through.
+void Window::drawPImage(const PaletteID* data, int x, int y, int width, int height)
+{
+    if(width > GB_X_RES || height > GB_Y_RES)
     {
-        SDL_SetRenderDrawColor(renderer,
-                               color_palette[i].r,
-                               color_palette[i].g,
-                               color_palette[i].b,
-                               color_palette[i].a
-        );
-        SDL_RenderDrawPoints(renderer, points[i].data(), (int)points[i].size());
+        log(format("WINDOW: PImage is too large to draw! {:d}x{:d}",
+                   width, height), Logger::logERROR);
+        return;
     }
+
+    drawToFrameTexture(data, x, y, width, height,
+                       [](PaletteID id) { return id == BG ? 0 : palette_lut[id]; });
+}
+
+// Draws a 160x144 frame of shades (0-3) from the emulator to the screen
+void Window::drawFrame(const uint8_t* data)
+{
+    // Shade 0 is the lightest, TILE0
+    drawToFrameTexture(data, 0, 0, GB_X_RES, GB_Y_RES,
+                       [](uint8_t shade) { return palette_lut[TILE0 + (shade & 0b11)]; });
 }
 
 
@@ -34,8 +34,11 @@ namespace Window
                                float* logicalX, float* logicalY);
 
     // Drawing stuff //
-    // Draws an array of PaletteIDs to the screen
+    // Draws an array of PaletteIDs to the screen, up to 160x144. BG pixels
+    // are skipped, so whatever is under them shows through.
     void drawPImage(const PaletteID* data, int x, int y, int width, int height);
+    // Draws a 160x144 frame of shades (0-3) from the emulator to the screen
+    void drawFrame(const uint8_t* data);
     // Draws a point with a given palette color
     void drawPPoint(const PaletteID& color, int x, int y);
     // Draws a line with a given palette color
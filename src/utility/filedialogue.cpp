@@ -1,5 +1,15 @@
 #include "filedialogue.hpp"
 
+#ifdef _WIN32
+#include <windows.h>
+#include <shobjidl.h>
+#include <tchar.h>
+#include <codecvt>
+
+#elif __linux__
+#include <gtk/gtk.h>
+#endif
+
 using std::string, std::vector;
 
 // Opens a choose-file dialogue in the default directory
@@ -0,0 +1,99 @@
+#include "mappedfile.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MOONGB_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() = default;
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+
+
+#ifdef MOONGB_HAS_MMAP
+// Maps the file at path. If writable, the file is created if missing or
+// grown to size if shorter, the first size bytes are mapped, and writes go
+// back to the file. Otherwise, the whole file is mapped read-only and size
+// is ignored. Returns false on failure.
+bool MappedFile::open(const std::string& path, size_t size, bool writable)
+{
+    close();
+
+    int fd = ::open(path.c_str(), writable ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+    if(fd < 0) { return false; }
+
+    struct stat info{};
+    if(fstat(fd, &info) != 0) { ::close(fd); return false; }
+
+    if(writable)
+    {
+        // A short file is grown, which keeps its data and zero-fills the new
+        // space. A longer one is never shrunk, only its first size bytes are
+        // mapped, so data past them (like another emulator's RTC footer) is kept.
+        if(static_cast<size_t>(info.st_size) < size && ftruncate(fd, size) != 0)
+        {
+            ::close(fd);
+            return false;
+        }
+    } else {
+        size = info.st_size;
+    }
+
+    // Mapping 0 bytes is an error
+    if(size == 0) { ::close(fd); return false; }
+
+    int protection = writable ? (PROT_READ | PROT_WRITE) : PROT_READ;
+    int flags = writable ? MAP_SHARED : MAP_PRIVATE;
+    void* result = mmap(nullptr, size, protection, flags, fd, 0);
+
+    // The mapping stays valid after the descriptor is closed
+    ::close(fd);
+
+    if(result == MAP_FAILED) { return false; }
+
+    mapping = static_cast<uint8_t*>(result);
+    mapping_size = size;
+    mapping_writable = writable;
+
+    return true;
+}
+
+// Unmaps the file. Changes to a writable mapping are kept.
+void MappedFile::close()
+{
+    if(!mapping) { return; }
+
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+    mapping_writable = false;
+}
+
+// Asks the OS to write changes back to the file, without waiting for it
+void MappedFile::flush()
+{
+    if(mapping && mapping_writable) { msync(mapping, mapping_size, MS_ASYNC); }
+}
+
+#else
+bool MappedFile::open(const std::string& path, size_t size, bool writable)
+{
+    return false;
+}
+
+void MappedFile::close() {}
+void MappedFile::flush() {}
+#endif
+
+
+
+bool MappedFile::isOpen() const { return mapping != nullptr; }
+uint8_t* MappedFile::data() const { return mapping; }
+size_t MappedFile::size() const { return mapping_size; }
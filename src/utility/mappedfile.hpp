@@ -0,0 +1,36 @@
+// Maps a file into memory, so that reads and writes to it are plain memory
+// accesses. Only implemented on POSIX systems, elsewhere open() fails and the
+// caller should fall back to reading the file into a buffer.
+#pragma once
+
+#include "../core.hpp"
+
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Maps the file at path. If writable, the file is created if missing or
+    // grown to size if shorter, the first size bytes are mapped, and writes go
+    // back to the file. Otherwise, the whole file is mapped read-only and size
+    // is ignored. Returns false on failure.
+    bool open(const std::string& path, size_t size, bool writable);
+    // Unmaps the file. Changes to a writable mapping are kept.
+    void close();
+
+    // Asks the OS to write changes back to the file, without waiting for it
+    void flush();
+
+    bool isOpen() const;
+    uint8_t* data() const;
+    size_t size() const;
+
+private:
+    uint8_t* mapping = nullptr;
+    size_t mapping_size = 0;
+    bool mapping_writable = false;
+};
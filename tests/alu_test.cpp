@@ -0,0 +1,333 @@
+// Exhaustive checks of the CPU's flag arithmetic. Run with ctest.
+//
+// F is kept packed, and the ALU sets it with masks and lookup tables. Each
+// operation is checked against the FlagRegister-based arithmetic it replaced,
+// which unpacked F into four bools before every instruction, for every input
+// and every flag state.
+//
+// DAA is checked against decimal arithmetic instead. Its table is built with
+// the same algorithm the old code used, so comparing the two proves nothing.
+
+#include "../src/core.hpp"
+#include "../src/emulator/gbdefs.hpp"
+#include "../src/emulator/alu.hpp"
+#include <functional>
+
+using fmt::format;
+
+// Reference //
+
+namespace FlagReference
+{
+
+struct Result
+{
+    uint8_t value;
+    uint8_t f;
+};
+
+template<uint8_t OPER>
+Result alu(uint8_t a, uint8_t value, uint8_t f)
+{
+    FlagRegister flags;
+    flags.byteToFlags(f);
+
+    if constexpr(OPER == 0 || OPER == 1) // ADD, ADC
+    {
+        uint8_t carry = (OPER == 1) ? flags.carry : 0;
+        uint16_t sum = a + value + carry;
+
+        flags.subtract = false;
+        flags.half_carry = ((a & 0xF) + (value & 0xF) + carry) > 0xF;
+        flags.carry = sum > 0xFF;
+        a = sum;
+        flags.zero = (a == 0);
+
+    } else if constexpr(OPER == 2 || OPER == 3 || OPER == 7) { // SUB, SBC, CP
+
+        uint8_t carry = (OPER == 3) ? flags.carry : 0;
+        uint8_t dif = a - value - carry;
+
+        flags.subtract = true;
+        flags.half_carry = (a & 0xF) < ((value & 0xF) + carry);
+        flags.carry = a < (value + carry);
+        flags.zero = (dif == 0);
+
+        if constexpr(OPER != 7) { a = dif; }
+
+    } else if constexpr(OPER == 4) { // AND
+
+        a &= value;
+        flags.zero = (a == 0);
+        flags.subtract = false;
+        flags.half_carry = true;
+        flags.carry = false;
+
+    } else { // XOR, OR
+
+        if constexpr(OPER == 5) { a ^= value; }
+        else { a |= value; }
+        flags.zero = (a == 0);
+        flags.subtract = false;
+        flags.half_carry = false;
+        flags.carry = false;
+    }
+
+    return { a, flags.flagsToByte() };
+}
+
+template<uint8_t OPER>
+Result rotate(uint8_t value, uint8_t f)
+{
+    FlagRegister flags;
+    flags.byteToFlags(f);
+
+    bool old_msb = (value >> 7) & 1;
+    bool old_lsb = value & 1;
+
+    if constexpr(OPER == 0) { value = (value << 1) | old_msb; flags.carry = old_msb; }
+    else if constexpr(OPER == 1) { value = (value >> 1) | (old_lsb << 7); flags.carry = old_lsb; }
+    else if constexpr(OPER == 2) { value = (value << 1) | flags.carry; flags.carry = old_msb; }
+    else if constexpr(OPER == 3) { value = (value >> 1) | (flags.carry << 7); flags.carry = old_lsb; }
+    else if constexpr(OPER == 4) { value = value << 1; flags.carry = old_msb; }
+    else if constexpr(OPER == 5) { value = (value >> 1) | (old_msb << 7); flags.carry = old_lsb; }
+    else if constexpr(OPER == 6) { value = (value >> 4) | (value << 4); flags.carry = false; }
+    else { value = value >> 1; flags.carry = old_lsb; }
+
+    flags.zero = (value == 0);
+    flags.subtract = false;
+    flags.half_carry = false;
+
+    return { value, flags.flagsToByte() };
+}
+
+Result inc(uint8_t value, uint8_t f)
+{
+    FlagRegister flags;
+    flags.byteToFlags(f);
+
+    uint8_t sum = value + 1;
+    flags.zero = (sum == 0);
+    flags.subtract = false;
+    flags.half_carry = (sum & 0xF) == 0;
+
+    return { sum, flags.flagsToByte() };
+}
+
+Result dec(uint8_t value, uint8_t f)
+{
+    FlagRegister flags;
+    flags.byteToFlags(f);
+
+    uint8_t dif = value - 1;
+    flags.zero = (dif == 0);
+    flags.subtract = true;
+    flags.half_carry = (dif & 0xF) == 0xF;
+
+    return { dif, flags.flagsToByte() };
+}
+
+uint8_t addSPFlags(uint16_t sp, uint8_t offset)
+{
+    FlagRegister flags;
+    flags.zero = false;
+    flags.subtract = false;
+    flags.half_carry = ((sp & 0xF) + (offset & 0xF)) > 0xF;
+    flags.carry = ((sp & 0xFF) + offset) > 0xFF;
+
+    return flags.flagsToByte();
+}
+
+} // namespace FlagReference
+
+// End Reference //
+
+
+
+// Checks //
+
+namespace Ref = FlagReference;
+
+// The masks and packFlags() agree with FlagRegister for every flag state
+bool checkPacking()
+{
+    for(int f = 0; f < 256; f += 0x10)
+    {
+        FlagRegister flags;
+        flags.byteToFlags(f);
+
+        uint8_t packed = packFlags(f & FLAG_ZERO, f & FLAG_SUBTRACT,
+                                   f & FLAG_HALF_CARRY, f & FLAG_CARRY);
+        if(packed != flags.flagsToByte() || packed != f)
+        {
+            std::cerr << format("Flag packing mismatch: F=${:02X}\n", f);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Checks an ALU operation for every A, operand, and flag state
+template<uint8_t OPER>
+bool checkALU()
+{
+    for(int f = 0; f < 256; f += 0x10)
+    {
+        for(int a = 0; a < 256; a++)
+        {
+            for(int value = 0; value < 256; value++)
+            {
+                ALU::Result packed = ALU::operate<OPER>(a, value, f);
+                Ref::Result reference = Ref::alu<OPER>(a, value, f);
+                if(packed.value != reference.value || packed.f != reference.f)
+                {
+                    std::cerr << format("ALU {:d} mismatch: A=${:02X} n=${:02X} F=${:02X}\n",
+                                        OPER, a, value, f);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// Checks a single-operand operation for every value and flag state
+bool checkUnary(const std::string& name,
+                std::function<ALU::Result(uint8_t, uint8_t)> packed_op,
+                std::function<Ref::Result(uint8_t, uint8_t)> reference_op)
+{
+    for(int f = 0; f < 256; f += 0x10)
+    {
+        for(int value = 0; value < 256; value++)
+        {
+            ALU::Result packed = packed_op(value, f);
+            Ref::Result reference = reference_op(value, f);
+            if(packed.value != reference.value || packed.f != reference.f)
+            {
+                std::cerr << format("{:s} mismatch: n=${:02X} F=${:02X}\n", name, value, f);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+template<uint8_t OPER>
+bool checkRotate()
+{
+    return checkUnary("Rotate " + std::to_string(OPER), ALU::rotate<OPER>, Ref::rotate<OPER>);
+}
+
+// Only the low byte of SP affects the flags
+bool checkAddSP()
+{
+    for(int sp = 0; sp < 256; sp++)
+    {
+        for(int offset = 0; offset < 256; offset++)
+        {
+            if(ALU::addSPFlags(sp, offset) != Ref::addSPFlags(sp, offset))
+            {
+                std::cerr << format("ADD SP mismatch: SP=${:02X} n=${:02X}\n", sp, offset);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Converts 0-99 to packed BCD, for checking DAA
+uint8_t toBCD(int value) { return ((value / 10) << 4) | (value % 10); }
+
+// Adds or subtracts every pair of 2-digit BCD numbers, with and without a
+// carry in, then runs DAA on the result. It must be the decimal sum or
+// difference, with carry set on a decimal carry/borrow out.
+template<uint8_t OPER>
+bool checkDAADecimal()
+{
+    constexpr bool SUBTRACT = (OPER == 2 || OPER == 3);
+    constexpr bool USES_CARRY = (OPER == 1 || OPER == 3);
+
+    for(int carry_in = 0; carry_in <= (USES_CARRY ? 1 : 0); carry_in++)
+    {
+        for(int x = 0; x < 100; x++)
+        {
+            for(int y = 0; y < 100; y++)
+            {
+                uint8_t f_in = carry_in ? FLAG_CARRY : 0;
+                ALU::Result binary = ALU::operate<OPER>(toBCD(x), toBCD(y), f_in);
+                ALU::Result adjusted = ALU::daa(binary.value, binary.f);
+
+                int decimal = SUBTRACT ? x - y - carry_in : x + y + carry_in;
+                bool carry_out = decimal < 0 || decimal > 99;
+                decimal = (decimal + 100) % 100;
+
+                uint8_t expected_f = packFlags(decimal == 0, SUBTRACT, false, carry_out);
+                if(adjusted.value != toBCD(decimal) || adjusted.f != expected_f)
+                {
+                    std::cerr << format("DAA mismatch after ALU {:d}: {:d} and {:d}, "
+                                        "carry in {:d}. Got ${:02X} F=${:02X}, "
+                                        "expected ${:02X} F=${:02X}\n",
+                                        OPER, x, y, carry_in, adjusted.value,
+                                        adjusted.f, toBCD(decimal), expected_f);
+                    return false;
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+// For every A and flag state, including ones no BCD arithmetic produces,
+// DAA clears half carry, keeps subtract, never clears carry, and sets zero
+// from its result
+bool checkDAAFlags()
+{
+    for(int f = 0; f < 256; f += 0x10)
+    {
+        for(int a = 0; a < 256; a++)
+        {
+            ALU::Result adjusted = ALU::daa(a, f);
+
+            bool valid = !(adjusted.f & FLAG_HALF_CARRY)
+                && (adjusted.f & FLAG_SUBTRACT) == (f & FLAG_SUBTRACT)
+                && (!(f & FLAG_CARRY) || (adjusted.f & FLAG_CARRY))
+                && ((adjusted.f & FLAG_ZERO) != 0) == (adjusted.value == 0)
+                && (adjusted.f & 0x0F) == 0;
+            if(!valid)
+            {
+                std::cerr << format("DAA flags wrong: A=${:02X} F=${:02X} gave F=${:02X}\n",
+                                    a, f, adjusted.f);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// End Checks //
+
+
+
+int main()
+{
+    bool passed = checkPacking()
+        && checkALU<0>() && checkALU<1>() && checkALU<2>() && checkALU<3>()
+        && checkALU<4>() && checkALU<5>() && checkALU<6>() && checkALU<7>()
+        && checkRotate<0>() && checkRotate<1>() && checkRotate<2>() && checkRotate<3>()
+        && checkRotate<4>() && checkRotate<5>() && checkRotate<6>() && checkRotate<7>()
+        && checkUnary("INC", ALU::inc, Ref::inc)
+        && checkUnary("DEC", ALU::dec, Ref::dec)
+        && checkAddSP()
+        && checkDAADecimal<0>() && checkDAADecimal<1>()
+        && checkDAADecimal<2>() && checkDAADecimal<3>()
+        && checkDAAFlags();
+
+    std::cout << (passed ? "ALU: pass\n" : "ALU: fail\n");
+    return passed ? 0 : 1;
+}